@@ -0,0 +1,239 @@
+// 压测工具,对比服务器使用epoll和io_uring两种后端时的吞吐、延迟和CPU开销
+// 用法: ./http_bench [ip] [port] [path] [-c 并发连接数] [-d 秒数] [-p 服务器pid] [-l 标签]
+// 服务器每个连接只处理一个请求,所以每个请求都包含connect/accept和关闭连接
+// 指定服务器pid时,从/proc/[pid]/stat读取压测期间服务器消耗的CPU时间,换算成每个请求的微秒数
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "util.hpp"
+
+struct Client{
+    int fd;
+    bool sent;
+    uint64_t start_us;
+    std::string response;
+};
+
+// 服务器进程累计消耗的CPU时间(用户态+内核态),单位为时钟滴答,失败返回-1
+static int64_t ReadCpuTicks(pid_t pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    //proc文件的st_size为0,不能用FileUtil::ReadAll
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+    {
+        return -1;
+    }
+    char buf[1024];
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if(len <= 0)
+    {
+        return -1;
+    }
+    std::string content(buf, len);
+    //进程名可能包含空格,从最后一个')'之后开始数,utime和stime是第14、15个字段
+    size_t pos = content.rfind(')');
+    if(pos == std::string::npos)
+    {
+        return -1;
+    }
+    std::vector<std::string> fields;
+    StringUtil::Split(content.substr(pos + 2), " ", &fields);
+    if(fields.size() < 13)
+    {
+        return -1;
+    }
+    return atoll(fields[11].c_str()) + atoll(fields[12].c_str());
+}
+
+static uint64_t NowUs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int StartClient(int epfd, const struct sockaddr_in& addr, Client* client)
+{
+    client->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(client->fd < 0)
+    {
+        return -1;
+    }
+    client->sent = false;
+    client->start_us = NowUs();
+    client->response.clear();
+    if(connect(client->fd, (const struct sockaddr*)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS)
+    {
+        close(client->fd);
+        client->fd = -1;
+        return -1;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLOUT | EPOLLIN;
+    ev.data.ptr = client;
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, client->fd, &ev);
+}
+
+static void StopClient(int epfd, Client* client)
+{
+    epoll_ctl(epfd, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    client->fd = -1;
+}
+
+int main(int argc, char* argv[])
+{
+    int conns = 64;
+    int seconds = 5;
+    pid_t server_pid = 0;
+    std::string label = "bench";
+    int opt = 0;
+    while((opt = getopt(argc, argv, "c:d:p:l:")) != -1)
+    {
+        if(opt == 'c')
+        {
+            conns = atoi(optarg);
+        }
+        else if(opt == 'd')
+        {
+            seconds = atoi(optarg);
+        }
+        else if(opt == 'p')
+        {
+            server_pid = atoi(optarg);
+        }
+        else if(opt == 'l')
+        {
+            label = optarg;
+        }
+        else
+        {
+            optind = argc + 1;
+            break;
+        }
+    }
+    if(argc - optind != 3 || conns <= 0 || seconds <= 0)
+    {
+        std::cout << "Usage:./http_bench [ip] [port] [path] [-c conns] [-d seconds] [-p server_pid] [-l label]" << std::endl;
+        return 1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(argv[optind]);
+    addr.sin_port = htons(atoi(argv[optind + 1]));
+    std::string request = std::string("GET ") + argv[optind + 2] + " HTTP/1.1\r\nHost: bench\r\n\r\n";
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(epfd < 0)
+    {
+        perror("epoll_create1");
+        return 1;
+    }
+    std::vector<Client> clients(conns);
+    uint64_t errors = 0;
+    std::vector<uint32_t> latencies;
+    int64_t cpu_start = server_pid > 0 ? ReadCpuTicks(server_pid) : -1;
+    uint64_t start = NowUs();
+    uint64_t end = start + (uint64_t)seconds * 1000000;
+    for(int i = 0; i < conns; i++)
+    {
+        if(StartClient(epfd, addr, &clients[i]) < 0)
+        {
+            ++errors;
+        }
+    }
+    struct epoll_event events[256];
+    char buf[16 * 1024];
+    while(NowUs() < end)
+    {
+        int n = epoll_wait(epfd, events, 256, 100);
+        for(int i = 0; i < n; i++)
+        {
+            Client* client = static_cast<Client*>(events[i].data.ptr);
+            if(!client->sent)
+            {
+                //连接建立之后一次写完请求,请求很短,不会写不完
+                if(send(client->fd, request.data(), request.size(), MSG_NOSIGNAL) != (ssize_t)request.size())
+                {
+                    ++errors;
+                    StopClient(epfd, client);
+                    StartClient(epfd, addr, client);
+                    continue;
+                }
+                client->sent = true;
+                struct epoll_event ev;
+                ev.events = EPOLLIN;
+                ev.data.ptr = client;
+                epoll_ctl(epfd, EPOLL_CTL_MOD, client->fd, &ev);
+                continue;
+            }
+            ssize_t ret = 0;
+            while((ret = recv(client->fd, buf, sizeof(buf), 0)) > 0)
+            {
+                //只保留状态行,body只统计不保存
+                if(client->response.size() < 16)
+                {
+                    client->response.append(buf, std::min((size_t)ret, (size_t)16));
+                }
+            }
+            if(ret < 0 && errno == EAGAIN)
+            {
+                continue;
+            }
+            //服务器写完响应之后关闭连接
+            if(ret == 0 && client->response.compare(0, 12, "HTTP/1.1 200") == 0)
+            {
+                latencies.push_back(NowUs() - client->start_us);
+            }
+            else
+            {
+                ++errors;
+            }
+            StopClient(epfd, client);
+            if(StartClient(epfd, addr, client) < 0)
+            {
+                ++errors;
+            }
+        }
+    }
+    double elapsed = (NowUs() - start) / 1000000.0;
+    int64_t cpu_end = server_pid > 0 ? ReadCpuTicks(server_pid) : -1;
+    for(int i = 0; i < conns; i++)
+    {
+        if(clients[i].fd >= 0)
+        {
+            StopClient(epfd, &clients[i]);
+        }
+    }
+    close(epfd);
+
+    size_t count = latencies.size();
+    std::sort(latencies.begin(), latencies.end());
+    uint32_t p50 = count > 0 ? latencies[count / 2] : 0;
+    uint32_t p99 = count > 0 ? latencies[std::min(count - 1, count * 99 / 100)] : 0;
+    printf("%-8s requests=%zu rps=%.0f p50=%uus p99=%uus errors=%llu", label.c_str(), count,
+           count / elapsed, p50, p99, (unsigned long long)errors);
+    if(cpu_start >= 0 && cpu_end >= 0 && count > 0)
+    {
+        double cpu_us = (cpu_end - cpu_start) * 1000000.0 / sysconf(_SC_CLK_TCK);
+        printf(" server_cpu=%.1fus/req", cpu_us / count);
+    }
+    printf("\n");
+    return 0;
+}
@@ -0,0 +1,224 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string>
+
+namespace http_server{
+
+// 静态站点打包文件的格式,由bundle_pack生成,服务器启动时mmap进来直接使用
+// 整个文件的布局如下(所有整数都是本机字节序):
+//   BundleHeader
+//   uint32_t seeds[bucket_num]      完美哈希每个桶的种子
+//   uint32_t slots[slot_num]        完美哈希的槽位,存放的是entries的下标
+//   BundleEntry entries[entry_num]
+//   字符串和文件内容
+// 查找一个路径:先用种子0算出桶,再用桶的种子算出槽位,最后比较一次路径确认命中
+static const char kBundleMagic[8] = {'H','S','B','U','N','D','L','1'};
+static const uint32_t kBundleEmptySlot = 0xFFFFFFFF;
+
+struct BundleHeader{
+    char magic[8];
+    uint32_t entry_num;
+    uint32_t bucket_num;
+    uint32_t slot_num;
+    uint32_t reserved;
+    uint64_t seeds_offset;
+    uint64_t slots_offset;
+    uint64_t entries_offset;
+    uint64_t file_size;
+};
+
+struct BundleEntry{
+    uint64_t path_offset;
+    uint64_t data_offset;
+    uint64_t data_len;
+    uint64_t gzip_offset;
+    uint64_t gzip_len;   //为0表示没有gzip压缩的版本
+    uint64_t mime_offset;
+    uint32_t path_len;
+    uint32_t mime_len;
+    char etag[24];       //带引号的ETag,以\0结尾
+};
+
+// 完美哈希使用的哈希函数,打包和查找两边必须一致
+inline uint64_t BundleHash(const char* key, size_t len, uint32_t seed)
+{
+    //FNV-1a
+    uint64_t h = 14695981039346656037ULL;
+    for(size_t i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)key[i];
+        h *= 1099511628211ULL;
+    }
+    //splitmix64的混合步骤,让不同的种子得到差别足够大的结果
+    h += seed * 0x9E3779B97F4A7C15ULL;
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+    return h ^ (h >> 31);
+}
+
+// 只读的打包文件,加载之后查找不需要任何系统调用
+class Bundle{
+public:
+    Bundle()
+        :base_(NULL)
+        ,size_(0)
+        ,header_(NULL)
+    {}
+
+    ~Bundle()
+    {
+        if(base_ != NULL)
+        {
+            munmap(const_cast<char*>(base_), size_);
+        }
+    }
+
+    // 加载打包文件,返回0表示成功
+    int Load(const std::string& path)
+    {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if(fd < 0)
+        {
+            return -1;
+        }
+        struct stat st;
+        if(fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(BundleHeader))
+        {
+            close(fd);
+            return -1;
+        }
+        void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if(addr == MAP_FAILED)
+        {
+            return -1;
+        }
+        base_ = reinterpret_cast<const char*>(addr);
+        size_ = st.st_size;
+        header_ = reinterpret_cast<const BundleHeader*>(base_);
+        if(!Check())
+        {
+            munmap(addr, size_);
+            base_ = NULL;
+            header_ = NULL;
+            return -1;
+        }
+        return 0;
+    }
+
+    bool IsLoaded() const
+    {
+        return header_ != NULL;
+    }
+
+    // 查找path对应的文件,没有找到返回NULL
+    const BundleEntry* Find(const std::string& path) const
+    {
+        if(header_ == NULL || header_->entry_num == 0)
+        {
+            return NULL;
+        }
+        uint64_t h = BundleHash(path.data(), path.size(), 0);
+        uint32_t seed = seeds_[h % header_->bucket_num];
+        uint32_t index = slots_[BundleHash(path.data(), path.size(), seed) % header_->slot_num];
+        if(index == kBundleEmptySlot)
+        {
+            return NULL;
+        }
+        const BundleEntry* entry = &entries_[index];
+        if(entry->path_len != path.size()
+           || memcmp(base_ + entry->path_offset, path.data(), path.size()) != 0)
+        {
+            return NULL;
+        }
+        return entry;
+    }
+
+    const char* Data(const BundleEntry* entry) const
+    {
+        return base_ + entry->data_offset;
+    }
+
+    const char* GzipData(const BundleEntry* entry) const
+    {
+        return base_ + entry->gzip_offset;
+    }
+
+    std::string MimeType(const BundleEntry* entry) const
+    {
+        return std::string(base_ + entry->mime_offset, entry->mime_len);
+    }
+
+    size_t Size() const
+    {
+        return header_ == NULL ? 0 : header_->entry_num;
+    }
+
+private:
+    Bundle(const Bundle&);
+    Bundle& operator=(const Bundle&);
+
+    bool InRange(uint64_t offset, uint64_t len) const
+    {
+        return offset <= size_ && len <= size_ - offset;
+    }
+
+    // 校验文件头以及所有偏移量都在文件范围之内,防止损坏的文件导致越界访问
+    bool Check()
+    {
+        if(memcmp(header_->magic, kBundleMagic, sizeof(kBundleMagic)) != 0
+           || header_->file_size != size_)
+        {
+            return false;
+        }
+        if(header_->entry_num > 0 && (header_->bucket_num == 0 || header_->slot_num == 0))
+        {
+            return false;
+        }
+        if(!InRange(header_->seeds_offset, (uint64_t)header_->bucket_num * sizeof(uint32_t))
+           || !InRange(header_->slots_offset, (uint64_t)header_->slot_num * sizeof(uint32_t))
+           || !InRange(header_->entries_offset, (uint64_t)header_->entry_num * sizeof(BundleEntry))
+           || header_->seeds_offset % sizeof(uint32_t) != 0
+           || header_->slots_offset % sizeof(uint32_t) != 0
+           || header_->entries_offset % sizeof(uint64_t) != 0)
+        {
+            return false;
+        }
+        seeds_ = reinterpret_cast<const uint32_t*>(base_ + header_->seeds_offset);
+        slots_ = reinterpret_cast<const uint32_t*>(base_ + header_->slots_offset);
+        entries_ = reinterpret_cast<const BundleEntry*>(base_ + header_->entries_offset);
+        for(uint32_t i = 0; i < header_->slot_num; i++)
+        {
+            if(slots_[i] != kBundleEmptySlot && slots_[i] >= header_->entry_num)
+            {
+                return false;
+            }
+        }
+        for(uint32_t i = 0; i < header_->entry_num; i++)
+        {
+            const BundleEntry& entry = entries_[i];
+            if(!InRange(entry.path_offset, entry.path_len)
+               || !InRange(entry.data_offset, entry.data_len)
+               || !InRange(entry.gzip_offset, entry.gzip_len)
+               || !InRange(entry.mime_offset, entry.mime_len)
+               || entry.etag[sizeof(entry.etag) - 1] != '\0')
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    const char* base_;
+    size_t size_;
+    const BundleHeader* header_;
+    const uint32_t* seeds_;
+    const uint32_t* slots_;
+    const BundleEntry* entries_;
+};
+}
@@ -0,0 +1,144 @@
+// 把一个静态站点目录打包成一个文件,供httpserver -b 使用
+// 用法: ./bundle_pack [目录] [输出文件]
+#include <stdio.h>
+#include <dirent.h>
+#include <zlib.h>
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "util.hpp"
+#include "bundle_writer.hpp"
+
+using namespace http_server;
+
+// 只对文本类的文件做gzip压缩,图片等格式本身已经压缩过了
+static bool IsCompressible(const std::string& mime)
+{
+    return mime.compare(0, 5, "text/") == 0
+        || mime.find("javascript") != std::string::npos
+        || mime.find("json") != std::string::npos
+        || mime.find("svg") != std::string::npos;
+}
+
+static int Gzip(const std::string& input, std::string* output)
+{
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    // windowBits为15+16表示输出gzip格式
+    if(deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        return -1;
+    }
+    output->resize(deflateBound(&zs, input.size()) + 32);
+    zs.next_in = (Bytef*)input.data();
+    zs.avail_in = input.size();
+    zs.next_out = (Bytef*)&(*output)[0];
+    zs.avail_out = output->size();
+    int ret = deflate(&zs, Z_FINISH);
+    output->resize(zs.total_out);
+    deflateEnd(&zs);
+    return ret == Z_STREAM_END ? 0 : -1;
+}
+
+// 递归收集目录下的所有普通文件,符号链接(例如CGI程序)不打包
+static int Collect(const std::string& root, const std::string& url_dir, BundleWriter* writer)
+{
+    std::string dir_path = root + url_dir;
+    DIR* dir = opendir(dir_path.c_str());
+    if(dir == NULL)
+    {
+        perror("opendir");
+        return -1;
+    }
+    std::vector<std::string> names;
+    struct dirent* item = NULL;
+    while((item = readdir(dir)) != NULL)
+    {
+        std::string name = item->d_name;
+        if(name != "." && name != "..")
+        {
+            names.push_back(name);
+        }
+    }
+    closedir(dir);
+    //保证每次打包的结果一致
+    std::sort(names.begin(), names.end());
+
+    for(size_t i = 0; i < names.size(); i++)
+    {
+        std::string url_path = url_dir + names[i];
+        struct stat st;
+        if(lstat((root + url_path).c_str(), &st) < 0)
+        {
+            perror("lstat");
+            return -1;
+        }
+        if(S_ISDIR(st.st_mode))
+        {
+            if(Collect(root, url_path + "/", writer) < 0)
+            {
+                return -1;
+            }
+            continue;
+        }
+        if(!S_ISREG(st.st_mode))
+        {
+            continue;
+        }
+        std::string data;
+        if(FileUtil::ReadAll(root + url_path, &data) < 0)
+        {
+            return -1;
+        }
+        std::string mime = FileUtil::GetMimeType(url_path);
+        std::string gzip;
+        if(IsCompressible(mime))
+        {
+            //压缩之后没有明显变小就不保存gzip版本
+            if(Gzip(data, &gzip) < 0 || gzip.size() * 10 >= data.size() * 9)
+            {
+                gzip.clear();
+            }
+        }
+        writer->AddFile(url_path, data, mime, gzip);
+        //目录请求映射到目录下的index.html
+        if(names[i] == "index.html")
+        {
+            writer->AddAlias(url_dir);
+            if(url_dir != "/")
+            {
+                writer->AddAlias(url_dir.substr(0, url_dir.size() - 1));
+            }
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    if(argc != 3)
+    {
+        std::cout << "Usage:./bundle_pack [dir] [output]" << std::endl;
+        return 1;
+    }
+    std::string root = argv[1];
+    while(root.size() > 1 && root[root.size() - 1] == '/')
+    {
+        root.resize(root.size() - 1);
+    }
+    BundleWriter writer;
+    if(Collect(root, "/", &writer) < 0)
+    {
+        return 1;
+    }
+    uint64_t file_size = 0;
+    if(writer.Write(argv[2], &file_size) < 0)
+    {
+        perror("write bundle");
+        return 1;
+    }
+    std::cout << "packed " << writer.FileNum() << " files (" << writer.EntryNum() << " paths) into "
+              << argv[2] << ", " << file_size << " bytes" << std::endl;
+    return 0;
+}
@@ -0,0 +1,144 @@
+#include "bundle_writer.hpp"
+#include "unit_test.hpp"
+#include "util.hpp"
+
+using namespace http_server;
+
+static const char* kBundlePath = "/tmp/bundle_test.bundle";
+
+static std::string EntryData(const Bundle& bundle, const BundleEntry* entry)
+{
+    return std::string(bundle.Data(entry), entry->data_len);
+}
+
+TEST(BuildIndexIsPerfect)
+{
+    std::vector<std::string> paths;
+    for(int i = 0; i < 1000; i++)
+    {
+        paths.push_back("/file" + std::to_string(i) + ".html");
+    }
+    uint32_t bucket_num = paths.size() / 4 + 1;
+    uint32_t slot_num = paths.size() + paths.size() / 4 + 1;
+    std::vector<uint32_t> seeds;
+    std::vector<uint32_t> slots;
+    EXPECT_EQ(0, BundleWriter::BuildIndex(paths, bucket_num, slot_num, &seeds, &slots));
+    //每个key都能通过两次哈希找到自己,并且没有两个key占用同一个槽位
+    std::vector<int> hits(paths.size(), 0);
+    for(size_t i = 0; i < paths.size(); i++)
+    {
+        const std::string& path = paths[i];
+        uint32_t seed = seeds[BundleHash(path.data(), path.size(), 0) % bucket_num];
+        uint32_t index = slots[BundleHash(path.data(), path.size(), seed) % slot_num];
+        EXPECT_EQ((uint32_t)i, index);
+        if(index < hits.size())
+        {
+            ++hits[index];
+        }
+    }
+    EXPECT_TRUE(std::count(hits.begin(), hits.end(), 1) == (long)paths.size());
+}
+
+TEST(WriteLoadFindRoundTrip)
+{
+    BundleWriter writer;
+    writer.AddFile("/index.html", "<h1>home</h1>", "text/html", "");
+    writer.AddAlias("/");
+    writer.AddFile("/game/index.html", "<h1>game</h1>", "text/html", "GZIPDATA");
+    writer.AddAlias("/game/");
+    writer.AddAlias("/game");
+    writer.AddFile("/img/logo.png", std::string("\x89PNG\0\x01", 6), "image/png", "");
+    EXPECT_EQ(0, writer.Write(kBundlePath, NULL));
+
+    Bundle bundle;
+    EXPECT_EQ(0, bundle.Load(kBundlePath));
+    EXPECT_EQ((size_t)6, bundle.Size());
+
+    const BundleEntry* home = bundle.Find("/");
+    EXPECT_TRUE(home != NULL && EntryData(bundle, home) == "<h1>home</h1>");
+    const BundleEntry* game = bundle.Find("/game");
+    EXPECT_TRUE(game != NULL && EntryData(bundle, game) == "<h1>game</h1>");
+    EXPECT_TRUE(game != NULL && std::string(bundle.GzipData(game), game->gzip_len) == "GZIPDATA");
+    EXPECT_TRUE(game != NULL && bundle.MimeType(game) == "text/html");
+    //同一个文件的多个路径共用同一份数据和ETag
+    const BundleEntry* game_index = bundle.Find("/game/index.html");
+    EXPECT_TRUE(game_index != NULL && game != NULL && game_index->data_offset == game->data_offset
+                && strcmp(game_index->etag, game->etag) == 0);
+    const BundleEntry* logo = bundle.Find("/img/logo.png");
+    EXPECT_TRUE(logo != NULL && EntryData(bundle, logo) == std::string("\x89PNG\0\x01", 6));
+    EXPECT_TRUE(logo != NULL && logo->gzip_len == 0 && bundle.MimeType(logo) == "image/png");
+    unlink(kBundlePath);
+}
+
+TEST(FindMisses)
+{
+    BundleWriter writer;
+    writer.AddFile("/index.html", "home", "text/html", "");
+    writer.AddFile("/a.css", "a", "text/css", "");
+    EXPECT_EQ(0, writer.Write(kBundlePath, NULL));
+    Bundle bundle;
+    EXPECT_EQ(0, bundle.Load(kBundlePath));
+    EXPECT_TRUE(bundle.Find("/index.html") != NULL);
+    EXPECT_TRUE(bundle.Find("/missing.html") == NULL);
+    EXPECT_TRUE(bundle.Find("/index.htm") == NULL);
+    EXPECT_TRUE(bundle.Find("/index.html/") == NULL);
+    EXPECT_TRUE(bundle.Find("") == NULL);
+    for(int i = 0; i < 1000; i++)
+    {
+        EXPECT_TRUE(bundle.Find("/miss" + std::to_string(i)) == NULL);
+    }
+    unlink(kBundlePath);
+}
+
+TEST(EmptyBundle)
+{
+    BundleWriter writer;
+    EXPECT_EQ(0, writer.Write(kBundlePath, NULL));
+    Bundle bundle;
+    EXPECT_EQ(0, bundle.Load(kBundlePath));
+    EXPECT_TRUE(bundle.Find("/") == NULL);
+    unlink(kBundlePath);
+}
+
+TEST(LoadRejectsCorruptFiles)
+{
+    BundleWriter writer;
+    writer.AddFile("/index.html", "home", "text/html", "");
+    uint64_t file_size = 0;
+    EXPECT_EQ(0, writer.Write(kBundlePath, &file_size));
+    std::string data;
+    FileUtil::ReadAll(kBundlePath, &data);
+    EXPECT_EQ(file_size, (uint64_t)data.size());
+
+    Bundle missing;
+    EXPECT_EQ(-1, missing.Load("/tmp/bundle_test.missing"));
+    //截断的文件
+    std::string corrupt = data.substr(0, data.size() - 1);
+    std::ofstream(kBundlePath, std::ios::binary | std::ios::trunc).write(corrupt.data(), corrupt.size());
+    Bundle truncated;
+    EXPECT_EQ(-1, truncated.Load(kBundlePath));
+    EXPECT_FALSE(truncated.IsLoaded());
+    //错误的magic
+    corrupt = data;
+    corrupt[0] = 'X';
+    std::ofstream(kBundlePath, std::ios::binary | std::ios::trunc).write(corrupt.data(), corrupt.size());
+    Bundle bad_magic;
+    EXPECT_EQ(-1, bad_magic.Load(kBundlePath));
+    //表项的偏移量超出了文件范围
+    corrupt = data;
+    BundleHeader header;
+    memcpy(&header, corrupt.data(), sizeof(header));
+    BundleEntry entry;
+    memcpy(&entry, corrupt.data() + header.entries_offset, sizeof(entry));
+    entry.data_len = data.size();
+    memcpy(&corrupt[header.entries_offset], &entry, sizeof(entry));
+    std::ofstream(kBundlePath, std::ios::binary | std::ios::trunc).write(corrupt.data(), corrupt.size());
+    Bundle bad_offset;
+    EXPECT_EQ(-1, bad_offset.Load(kBundlePath));
+    unlink(kBundlePath);
+}
+
+int main()
+{
+    return unit_test::RunAll();
+}
@@ -0,0 +1,212 @@
+#pragma once
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "bundle.hpp"
+
+namespace http_server{
+
+// 生成静态站点打包文件,文件格式见bundle.hpp
+// bundle_pack用它打包整个目录,单元测试用它构造打包文件
+class BundleWriter{
+public:
+    // 添加一个文件,path为url路径,例如/game/index.html,gzip为空表示没有压缩的版本
+    void AddFile(const std::string& path, const std::string& data, const std::string& mime,
+                 const std::string& gzip)
+    {
+        PackFile file;
+        file.data = data;
+        file.gzip = gzip;
+        file.mime = mime;
+        char etag[sizeof(((BundleEntry*)0)->etag)];
+        snprintf(etag, sizeof(etag), "\"%016llx\"",
+                 (unsigned long long)BundleHash(data.data(), data.size(), 0));
+        file.etag = etag;
+        files_.push_back(file);
+        AddAlias(path);
+    }
+
+    // 给最后添加的文件增加一个路径,例如目录/game/和/game都指向/game/index.html
+    void AddAlias(const std::string& path)
+    {
+        PackEntry entry = {path, files_.size() - 1};
+        entries_.push_back(entry);
+    }
+
+    size_t FileNum() const
+    {
+        return files_.size();
+    }
+
+    size_t EntryNum() const
+    {
+        return entries_.size();
+    }
+
+    // 写出打包文件,返回0表示成功,file_size不为NULL时返回文件的大小
+    // 先写到临时文件再rename,正在运行的服务器mmap的旧文件不受影响
+    int Write(const std::string& output_path, uint64_t* file_size)
+    {
+        BundleHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, kBundleMagic, sizeof(kBundleMagic));
+        header.entry_num = entries_.size();
+        header.bucket_num = entries_.size() / 4 + 1;
+        header.slot_num = entries_.size() + entries_.size() / 4 + 1;
+        std::vector<std::string> paths;
+        for(size_t i = 0; i < entries_.size(); i++)
+        {
+            paths.push_back(entries_[i].path);
+        }
+        std::vector<uint32_t> seeds;
+        std::vector<uint32_t> slots;
+        if(BuildIndex(paths, header.bucket_num, header.slot_num, &seeds, &slots) < 0)
+        {
+            return -1;
+        }
+
+        //计算各部分的偏移量
+        header.seeds_offset = sizeof(header);
+        header.slots_offset = header.seeds_offset + seeds.size() * sizeof(uint32_t);
+        header.entries_offset = Align(header.slots_offset + slots.size() * sizeof(uint32_t), 8);
+        uint64_t offset = header.entries_offset + entries_.size() * sizeof(BundleEntry);
+        std::string blob;
+        std::vector<BundleEntry> packed(entries_.size());
+        std::vector<uint64_t> data_offsets(files_.size());
+        std::vector<uint64_t> gzip_offsets(files_.size());
+        for(size_t i = 0; i < files_.size(); i++)
+        {
+            data_offsets[i] = offset + blob.size();
+            blob += files_[i].data;
+            gzip_offsets[i] = offset + blob.size();
+            blob += files_[i].gzip;
+        }
+        for(size_t i = 0; i < entries_.size(); i++)
+        {
+            const PackFile& file = files_[entries_[i].file];
+            BundleEntry& entry = packed[i];
+            memset(&entry, 0, sizeof(entry));
+            entry.path_offset = offset + blob.size();
+            entry.path_len = entries_[i].path.size();
+            blob += entries_[i].path;
+            entry.mime_offset = offset + blob.size();
+            entry.mime_len = file.mime.size();
+            blob += file.mime;
+            entry.data_offset = data_offsets[entries_[i].file];
+            entry.data_len = file.data.size();
+            entry.gzip_offset = gzip_offsets[entries_[i].file];
+            entry.gzip_len = file.gzip.size();
+            strncpy(entry.etag, file.etag.c_str(), sizeof(entry.etag) - 1);
+        }
+        header.file_size = offset + blob.size();
+
+        std::string tmp_path = output_path + ".tmp";
+        std::ofstream out(tmp_path.c_str(), std::ios::binary | std::ios::trunc);
+        out.write((const char*)&header, sizeof(header));
+        out.write((const char*)seeds.data(), seeds.size() * sizeof(uint32_t));
+        out.write((const char*)slots.data(), slots.size() * sizeof(uint32_t));
+        std::string padding(header.entries_offset - header.slots_offset - slots.size() * sizeof(uint32_t), '\0');
+        out.write(padding.data(), padding.size());
+        out.write((const char*)packed.data(), packed.size() * sizeof(BundleEntry));
+        out.write(blob.data(), blob.size());
+        out.close();
+        if(!out || rename(tmp_path.c_str(), output_path.c_str()) < 0)
+        {
+            return -1;
+        }
+        if(file_size != NULL)
+        {
+            *file_size = header.file_size;
+        }
+        return 0;
+    }
+
+    // 构造完美哈希(hash and displace)
+    // 先把所有key按种子0分到若干个桶里,然后从大到小给每个桶找一个种子,
+    // 使得桶里所有的key用这个种子算出来的槽位都是空的并且互不冲突
+    static int BuildIndex(const std::vector<std::string>& paths, uint32_t bucket_num, uint32_t slot_num,
+                          std::vector<uint32_t>* seeds, std::vector<uint32_t>* slots)
+    {
+        std::vector<std::vector<uint32_t> > buckets(bucket_num);
+        for(uint32_t i = 0; i < paths.size(); i++)
+        {
+            const std::string& path = paths[i];
+            buckets[BundleHash(path.data(), path.size(), 0) % bucket_num].push_back(i);
+        }
+        std::vector<uint32_t> order(bucket_num);
+        for(uint32_t i = 0; i < bucket_num; i++)
+        {
+            order[i] = i;
+        }
+        std::stable_sort(order.begin(), order.end(), [&buckets](uint32_t a, uint32_t b){
+            return buckets[a].size() > buckets[b].size();
+        });
+        seeds->assign(bucket_num, 0);
+        slots->assign(slot_num, kBundleEmptySlot);
+        for(size_t i = 0; i < order.size(); i++)
+        {
+            const std::vector<uint32_t>& bucket = buckets[order[i]];
+            if(bucket.empty())
+            {
+                break;
+            }
+            bool found = false;
+            for(uint32_t seed = 1; seed < 1000000 && !found; seed++)
+            {
+                std::vector<uint32_t> used;
+                found = true;
+                for(size_t j = 0; j < bucket.size(); j++)
+                {
+                    const std::string& path = paths[bucket[j]];
+                    uint32_t slot = BundleHash(path.data(), path.size(), seed) % slot_num;
+                    if((*slots)[slot] != kBundleEmptySlot
+                       || std::find(used.begin(), used.end(), slot) != used.end())
+                    {
+                        found = false;
+                        break;
+                    }
+                    used.push_back(slot);
+                }
+                if(found)
+                {
+                    (*seeds)[order[i]] = seed;
+                    for(size_t j = 0; j < bucket.size(); j++)
+                    {
+                        (*slots)[used[j]] = bucket[j];
+                    }
+                }
+            }
+            if(!found)
+            {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+private:
+    struct PackFile{
+        std::string data;
+        std::string gzip;
+        std::string mime;
+        std::string etag;
+    };
+
+    // 打包文件中的一个表项,同一个文件的多个路径共用同一个PackFile
+    struct PackEntry{
+        std::string path;
+        size_t file;
+    };
+
+    static uint64_t Align(uint64_t offset, uint64_t align)
+    {
+        return (offset + align - 1) / align * align;
+    }
+
+    std::vector<PackFile> files_;
+    std::vector<PackEntry> entries_;
+};
+}
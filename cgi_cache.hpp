@@ -0,0 +1,309 @@
+#pragma once
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <strings.h>
+#include <algorithm>
+#include <functional>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "util.hpp"
+
+namespace http_server{
+
+// 幂等的CGI GET请求的结果缓存
+// 1.只对显式开启了缓存的路由生效,key是规范化之后的路径加上排过序的query_string
+// 2.缓存时间优先使用CGI程序输出的Cache-Control/Expires,没有的话使用路由配置的默认时间
+// 3.按照LRU淘汰,所有结果加起来的字节数不超过上限
+// 4.同一个key同时有多个请求没有命中时,只有第一个请求(leader)去执行CGI,其余的请求等待并共享它的结果
+//   等待有时间上限,leader卡住时等待的请求超时后各自去执行,不会跟着一起被占住
+//   查询时不阻塞线程,需要等待时由调用者自己挂起协程等待通知
+class CgiCache{
+public:
+    enum Result{
+        HIT,     //拿到了结果,可能来自缓存,也可能来自同时在执行的leader
+        LEADER,  //需要自己执行CGI,执行完之后必须调用Finish
+        MISS,    //需要自己执行CGI,不需要调用Finish
+        WAIT,    //有leader正在执行,等通知或者超时之后调用Collect
+    };
+
+    // 一次正在执行的CGI,leader调用Finish时填入结果
+    struct Flight{
+        Flight() :done(false), ok(false) {}
+        bool done;
+        bool ok;
+        std::string value;
+        std::vector<std::function<void()> > notifies;
+    };
+    typedef std::shared_ptr<Flight> FlightPtr;
+
+    // wait_ms为等待同一个key的leader的最长时间(毫秒)
+    explicit CgiCache(size_t max_bytes = 16 * 1024 * 1024, int wait_ms = 3000)
+        :max_bytes_(max_bytes)
+        ,bytes_(0)
+        ,wait_ms_(wait_ms)
+    {
+        pthread_mutex_init(&mutex_, NULL);
+    }
+
+    ~CgiCache()
+    {
+        pthread_mutex_destroy(&mutex_);
+    }
+
+    // 对url_path开启缓存,default_ttl为CGI程序没有给出缓存时间时使用的时间(秒)
+    // 需要在服务器开始处理请求之前调用
+    void EnableRoute(const std::string& url_path, int default_ttl)
+    {
+        routes_[url_path] = default_ttl;
+    }
+
+    bool IsEnabled(const std::string& url_path) const
+    {
+        return routes_.find(url_path) != routes_.end();
+    }
+
+    // 构造缓存的key,参数顺序不同但内容相同的query_string得到同一个key
+    static std::string MakeKey(const std::string& url_path, const std::string& query_string)
+    {
+        std::vector<std::string> params;
+        size_t start = 0;
+        while(start <= query_string.size())
+        {
+            size_t end = query_string.find('&', start);
+            if(end == std::string::npos)
+            {
+                end = query_string.size();
+            }
+            if(end > start)
+            {
+                params.push_back(query_string.substr(start, end - start));
+            }
+            start = end + 1;
+        }
+        std::sort(params.begin(), params.end());
+        std::string key = url_path + "?";
+        for(size_t i = 0; i < params.size(); i++)
+        {
+            if(i > 0)
+            {
+                key.push_back('&');
+            }
+            key += params[i];
+        }
+        return key;
+    }
+
+    // 查询缓存,返回HIT时output中是CGI程序的输出
+    // 有leader正在执行同一个key时返回WAIT,并且登记notify,leader调用Finish时(在leader的线程中)执行
+    // 调用者等到notify或者等待超时(WaitMs)之后,用flight调用Collect拿结果
+    Result TryAcquire(const std::string& key, std::string* output,
+                      const std::function<void()>& notify, FlightPtr* flight)
+    {
+        pthread_mutex_lock(&mutex_);
+        Result result = Lookup(key, output, flight);
+        if(result == WAIT)
+        {
+            (*flight)->notifies.push_back(notify);
+        }
+        pthread_mutex_unlock(&mutex_);
+        return result;
+    }
+
+    // TryAcquire返回WAIT之后取结果,leader成功时返回HIT,失败或者还没有结束时返回MISS
+    Result Collect(const FlightPtr& flight, std::string* output)
+    {
+        pthread_mutex_lock(&mutex_);
+        Result result = Take(flight, output);
+        pthread_mutex_unlock(&mutex_);
+        return result;
+    }
+
+    int WaitMs() const
+    {
+        return wait_ms_;
+    }
+
+    // leader执行完CGI之后调用,ok为false表示执行失败,等待的请求需要各自去执行
+    void Finish(const std::string& key, const std::string& url_path, const std::string& output, bool ok)
+    {
+        int ttl = ok ? GetTtl(url_path, output) : 0;
+        std::vector<std::function<void()> > notifies;
+        pthread_mutex_lock(&mutex_);
+        FlightMap::iterator flight_it = flights_.find(key);
+        if(flight_it != flights_.end())
+        {
+            flight_it->second->done = true;
+            flight_it->second->ok = ok;
+            flight_it->second->value = output;
+            notifies.swap(flight_it->second->notifies);
+            flights_.erase(flight_it);
+        }
+        if(ttl > 0 && key.size() + output.size() <= max_bytes_)
+        {
+            Map::iterator it = map_.find(key);
+            if(it != map_.end())
+            {
+                Remove(it);
+            }
+            Entry entry = {key, output, TimeUtil::TimeStamp() + ttl};
+            lru_.push_front(entry);
+            map_[key] = lru_.begin();
+            bytes_ += key.size() + output.size();
+            while(bytes_ > max_bytes_)
+            {
+                Remove(map_.find(lru_.back().key));
+            }
+        }
+        pthread_mutex_unlock(&mutex_);
+        for(size_t i = 0; i < notifies.size(); i++)
+        {
+            notifies[i]();
+        }
+    }
+
+    // 从CGI程序的输出中找到缓存时间(秒),返回0表示不能缓存
+    // 只看header部分,也就是第一个空行之前的内容
+    int GetTtl(const std::string& url_path, const std::string& output)
+    {
+        std::unordered_map<std::string, int>::const_iterator route = routes_.find(url_path);
+        int ttl = route == routes_.end() ? 0 : route->second;
+        bool has_max_age = false;
+        size_t start = 0;
+        while(start < output.size())
+        {
+            size_t end = output.find('\n', start);
+            if(end == std::string::npos)
+            {
+                break;
+            }
+            std::string line = output.substr(start, end - start);
+            start = end + 1;
+            if(!line.empty() && line[line.size() - 1] == '\r')
+            {
+                line.resize(line.size() - 1);
+            }
+            if(line.empty())
+            {
+                break;
+            }
+            size_t pos = line.find(':');
+            if(pos == std::string::npos)
+            {
+                continue;
+            }
+            std::string name = line.substr(0, pos);
+            std::string value = line.substr(pos + 1);
+            if(strcasecmp(name.c_str(), "Cache-Control") == 0)
+            {
+                if(value.find("no-store") != std::string::npos
+                   || value.find("no-cache") != std::string::npos
+                   || value.find("private") != std::string::npos)
+                {
+                    return 0;
+                }
+                //共享缓存优先使用s-maxage
+                size_t age = value.find("s-maxage=");
+                size_t skip = 9;
+                if(age == std::string::npos)
+                {
+                    age = value.find("max-age=");
+                    skip = 8;
+                }
+                if(age != std::string::npos)
+                {
+                    ttl = atoi(value.c_str() + age + skip);
+                    has_max_age = true;
+                }
+            }
+            else if(strcasecmp(name.c_str(), "Expires") == 0 && !has_max_age)
+            {
+                //max-age的优先级高于Expires
+                struct tm tm;
+                memset(&tm, 0, sizeof(tm));
+                const char* p = value.c_str();
+                while(*p == ' ')
+                {
+                    ++p;
+                }
+                //格式不对的Expires表示已经过期
+                ttl = 0;
+                if(strptime(p, "%a, %d %b %Y %H:%M:%S GMT", &tm) != NULL)
+                {
+                    ttl = (int)(timegm(&tm) - TimeUtil::TimeStamp());
+                }
+            }
+        }
+        return ttl > 0 ? ttl : 0;
+    }
+
+private:
+    CgiCache(const CgiCache&);
+    CgiCache& operator=(const CgiCache&);
+
+    struct Entry{
+        std::string key;
+        std::string value;
+        int64_t expire_time;
+    };
+    typedef std::list<Entry> List;
+    typedef std::unordered_map<std::string, List::iterator> Map;
+
+    typedef std::unordered_map<std::string, FlightPtr> FlightMap;
+
+    // 在锁内查缓存,没有命中时成为leader,或者返回WAIT和正在执行的flight
+    Result Lookup(const std::string& key, std::string* output, FlightPtr* flight)
+    {
+        int64_t now = TimeUtil::TimeStamp();
+        Map::iterator it = map_.find(key);
+        if(it != map_.end())
+        {
+            if(it->second->expire_time > now)
+            {
+                lru_.splice(lru_.begin(), lru_, it->second);
+                *output = it->second->value;
+                return HIT;
+            }
+            Remove(it);
+        }
+        FlightMap::iterator flight_it = flights_.find(key);
+        if(flight_it == flights_.end())
+        {
+            flights_[key] = FlightPtr(new Flight());
+            return LEADER;
+        }
+        *flight = flight_it->second;
+        return WAIT;
+    }
+
+    Result Take(const FlightPtr& flight, std::string* output)
+    {
+        if(flight->done && flight->ok)
+        {
+            *output = flight->value;
+            return HIT;
+        }
+        return MISS;
+    }
+
+    void Remove(Map::iterator it)
+    {
+        bytes_ -= it->second->key.size() + it->second->value.size();
+        lru_.erase(it->second);
+        map_.erase(it);
+    }
+
+    std::unordered_map<std::string, int> routes_;
+    size_t max_bytes_;
+    size_t bytes_;
+    int wait_ms_;
+    List lru_;
+    Map map_;
+    FlightMap flights_;
+    pthread_mutex_t mutex_;
+};
+}
@@ -0,0 +1,269 @@
+#include "cgi_cache.hpp"
+#include "unit_test.hpp"
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+
+using namespace http_server;
+
+TEST(MakeKeySortsParams)
+{
+    EXPECT_EQ("/cgi?a=1&b=2", CgiCache::MakeKey("/cgi", "a=1&b=2"));
+    EXPECT_EQ("/cgi?a=1&b=2", CgiCache::MakeKey("/cgi", "b=2&a=1"));
+    //空的参数被忽略
+    EXPECT_EQ("/cgi?a=1&b=2", CgiCache::MakeKey("/cgi", "&b=2&&a=1&"));
+    EXPECT_EQ("/cgi?", CgiCache::MakeKey("/cgi", ""));
+    //不同的路径和不同的值得到不同的key
+    EXPECT_TRUE(CgiCache::MakeKey("/cgi", "a=1") != CgiCache::MakeKey("/cgj", "a=1"));
+    EXPECT_TRUE(CgiCache::MakeKey("/cgi", "a=1") != CgiCache::MakeKey("/cgi", "a=10"));
+    //同名参数的顺序也会被排序
+    EXPECT_EQ("/cgi?a=1&a=2", CgiCache::MakeKey("/cgi", "a=2&a=1"));
+}
+
+TEST(GetTtlUsesRouteDefault)
+{
+    CgiCache cache;
+    cache.EnableRoute("/cgi", 10);
+    EXPECT_EQ(10, cache.GetTtl("/cgi", "Content-Length:2\n\nok"));
+    EXPECT_EQ(10, cache.GetTtl("/cgi", "no header at all"));
+    EXPECT_EQ(0, cache.GetTtl("/other", "Content-Length:2\n\nok"));
+}
+
+TEST(GetTtlReadsCacheControl)
+{
+    CgiCache cache;
+    cache.EnableRoute("/cgi", 10);
+    EXPECT_EQ(60, cache.GetTtl("/cgi", "Cache-Control: max-age=60\r\n\r\nbody"));
+    EXPECT_EQ(30, cache.GetTtl("/cgi", "cache-control: public, max-age=60, s-maxage=30\n\n"));
+    EXPECT_EQ(0, cache.GetTtl("/cgi", "Cache-Control: no-store\n\n"));
+    EXPECT_EQ(0, cache.GetTtl("/cgi", "Cache-Control: private, max-age=60\n\n"));
+    EXPECT_EQ(0, cache.GetTtl("/cgi", "Cache-Control: max-age=0\n\n"));
+    //空行之后是body,body里的内容不算
+    EXPECT_EQ(10, cache.GetTtl("/cgi", "Content-Length:28\n\nCache-Control: max-age=99\n"));
+}
+
+TEST(GetTtlReadsExpires)
+{
+    CgiCache cache;
+    cache.EnableRoute("/cgi", 10);
+    char expires[64];
+    time_t later = time(NULL) + 120;
+    strftime(expires, sizeof(expires), "%a, %d %b %Y %H:%M:%S GMT", gmtime(&later));
+    int ttl = cache.GetTtl("/cgi", std::string("Expires: ") + expires + "\n\n");
+    EXPECT_TRUE(ttl >= 118 && ttl <= 120);
+    EXPECT_EQ(0, cache.GetTtl("/cgi", "Expires: Thu, 01 Jan 1970 00:00:00 GMT\n\n"));
+    EXPECT_EQ(0, cache.GetTtl("/cgi", "Expires: 0\n\n"));
+    //max-age优先于Expires,不管谁先出现
+    EXPECT_EQ(5, cache.GetTtl("/cgi", "Cache-Control: max-age=5\nExpires: 0\n\n"));
+}
+
+// 等待leader的通知,ProcessCGI中是LoopEvent,这里用一个管道代替
+// 通知可能在等待超时之后才到达,所以管道由通知函数和等待者共同持有
+struct Notifier{
+    Notifier()
+    {
+        EXPECT_EQ(0, pipe(fds));
+    }
+    ~Notifier()
+    {
+        close(fds[0]);
+        close(fds[1]);
+    }
+    int fds[2];
+};
+
+// 和ProcessCGI使用缓存的方式相同:返回WAIT时最多等WaitMs毫秒,然后用Collect取结果
+static CgiCache::Result Acquire(CgiCache* cache, const std::string& key, std::string* output)
+{
+    std::shared_ptr<Notifier> notifier = std::make_shared<Notifier>();
+    CgiCache::FlightPtr flight;
+    CgiCache::Result result = cache->TryAcquire(key, output, [notifier]{
+        char c = 0;
+        write(notifier->fds[1], &c, 1);
+    }, &flight);
+    if(result == CgiCache::WAIT)
+    {
+        struct pollfd pfd = {notifier->fds[0], POLLIN, 0};
+        poll(&pfd, 1, cache->WaitMs());
+        result = cache->Collect(flight, output);
+    }
+    return result;
+}
+
+TEST(LeaderThenHit)
+{
+    CgiCache cache;
+    cache.EnableRoute("/cgi", 10);
+    std::string output;
+    EXPECT_EQ(CgiCache::LEADER, Acquire(&cache, "/cgi?a=1", &output));
+    cache.Finish("/cgi?a=1", "/cgi", "result", true);
+    EXPECT_EQ(CgiCache::HIT, Acquire(&cache, "/cgi?a=1", &output));
+    EXPECT_EQ("result", output);
+    //执行失败或者不能缓存的结果不会留在缓存里
+    EXPECT_EQ(CgiCache::LEADER, Acquire(&cache, "/cgi?a=2", &output));
+    cache.Finish("/cgi?a=2", "/cgi", "", false);
+    EXPECT_EQ(CgiCache::LEADER, Acquire(&cache, "/cgi?a=2", &output));
+    cache.Finish("/cgi?a=2", "/cgi", "Cache-Control: no-store\n\n", true);
+    EXPECT_EQ(CgiCache::LEADER, Acquire(&cache, "/cgi?a=2", &output));
+}
+
+TEST(ExpiresAfterTtl)
+{
+    CgiCache cache;
+    cache.EnableRoute("/cgi", 10);
+    std::string output;
+    EXPECT_EQ(CgiCache::LEADER, Acquire(&cache, "/cgi?a=1", &output));
+    cache.Finish("/cgi?a=1", "/cgi", "Cache-Control: max-age=1\n\nresult", true);
+    EXPECT_EQ(CgiCache::HIT, Acquire(&cache, "/cgi?a=1", &output));
+    //过期之后重新成为leader
+    sleep(2);
+    EXPECT_EQ(CgiCache::LEADER, Acquire(&cache, "/cgi?a=1", &output));
+}
+
+TEST(EvictsByBytes)
+{
+    CgiCache cache(100);
+    cache.EnableRoute("/cgi", 10);
+    std::string output;
+    for(int i = 0; i < 5; i++)
+    {
+        std::string key = "/cgi?a=" + std::to_string(i);
+        Acquire(&cache, key, &output);
+        cache.Finish(key, "/cgi", std::string(30, 'x'), true);
+    }
+    //每项大约37字节,只能留下最近的两项
+    EXPECT_EQ(CgiCache::HIT, Acquire(&cache, "/cgi?a=4", &output));
+    EXPECT_EQ(CgiCache::HIT, Acquire(&cache, "/cgi?a=3", &output));
+    EXPECT_EQ(CgiCache::LEADER, Acquire(&cache, "/cgi?a=0", &output));
+}
+
+TEST(EvictsLeastRecentlyUsed)
+{
+    CgiCache cache(80);
+    cache.EnableRoute("/cgi", 10);
+    std::string output;
+    Acquire(&cache, "/cgi?a=0", &output);
+    cache.Finish("/cgi?a=0", "/cgi", std::string(30, 'x'), true);
+    Acquire(&cache, "/cgi?a=1", &output);
+    cache.Finish("/cgi?a=1", "/cgi", std::string(30, 'x'), true);
+    //命中之后a=0变成最近使用的,放入a=2时淘汰a=1
+    EXPECT_EQ(CgiCache::HIT, Acquire(&cache, "/cgi?a=0", &output));
+    Acquire(&cache, "/cgi?a=2", &output);
+    cache.Finish("/cgi?a=2", "/cgi", std::string(30, 'x'), true);
+    EXPECT_EQ(CgiCache::HIT, Acquire(&cache, "/cgi?a=0", &output));
+    EXPECT_EQ(CgiCache::HIT, Acquire(&cache, "/cgi?a=2", &output));
+    EXPECT_EQ(CgiCache::LEADER, Acquire(&cache, "/cgi?a=1", &output));
+}
+
+struct WaitArg{
+    CgiCache* cache;
+    CgiCache::Result result;
+    std::string output;
+};
+
+static void* Waiter(void* arg)
+{
+    WaitArg* wait = reinterpret_cast<WaitArg*>(arg);
+    wait->result = Acquire(wait->cache, "/cgi?a=1", &wait->output);
+    return NULL;
+}
+
+TEST(WaitersShareLeaderResult)
+{
+    CgiCache cache;
+    cache.EnableRoute("/cgi", 0);
+    std::string output;
+    EXPECT_EQ(CgiCache::LEADER, Acquire(&cache, "/cgi?a=1", &output));
+    WaitArg waits[3];
+    pthread_t tids[3];
+    for(int i = 0; i < 3; i++)
+    {
+        waits[i].cache = &cache;
+        waits[i].result = CgiCache::LEADER;
+        pthread_create(&tids[i], NULL, Waiter, &waits[i]);
+    }
+    usleep(50 * 1000);
+    //ttl为0不会进缓存,但是正在等待的请求仍然拿到结果
+    cache.Finish("/cgi?a=1", "/cgi", "shared", true);
+    for(int i = 0; i < 3; i++)
+    {
+        pthread_join(tids[i], NULL);
+        EXPECT_EQ(CgiCache::HIT, waits[i].result);
+        EXPECT_EQ("shared", waits[i].output);
+    }
+    EXPECT_EQ(CgiCache::LEADER, Acquire(&cache, "/cgi?a=1", &output));
+}
+
+TEST(WaitersGiveUpOnFailureOrTimeout)
+{
+    CgiCache cache(1024, 100);
+    cache.EnableRoute("/cgi", 10);
+    std::string output;
+    EXPECT_EQ(CgiCache::LEADER, Acquire(&cache, "/cgi?a=1", &output));
+    WaitArg wait = {&cache, CgiCache::LEADER, ""};
+    pthread_t tid;
+    //leader一直不结束,等待的请求超时之后得到MISS,自己去执行
+    uint64_t start = TimeUtil::TimeStampUS();
+    pthread_create(&tid, NULL, Waiter, &wait);
+    pthread_join(tid, NULL);
+    uint64_t elapsed_ms = (TimeUtil::TimeStampUS() - start) / 1000;
+    EXPECT_EQ(CgiCache::MISS, wait.result);
+    EXPECT_TRUE(elapsed_ms >= 90 && elapsed_ms < 1000);
+    //leader执行失败时等待的请求也各自去执行,不需要等到超时
+    start = TimeUtil::TimeStampUS();
+    pthread_create(&tid, NULL, Waiter, &wait);
+    usleep(20 * 1000);
+    cache.Finish("/cgi?a=1", "/cgi", "", false);
+    pthread_join(tid, NULL);
+    elapsed_ms = (TimeUtil::TimeStampUS() - start) / 1000;
+    EXPECT_EQ(CgiCache::MISS, wait.result);
+    EXPECT_TRUE(elapsed_ms < 90);
+}
+
+TEST(LateFinishAfterWaiterTimedOut)
+{
+    CgiCache cache(1024, 50);
+    cache.EnableRoute("/cgi", 10);
+    std::string output;
+    EXPECT_EQ(CgiCache::LEADER, Acquire(&cache, "/cgi?a=1", &output));
+    EXPECT_EQ(CgiCache::MISS, Acquire(&cache, "/cgi?a=1", &output));
+    //等待者已经放弃了,leader结束时的通知仍然是安全的,结果照常进入缓存
+    cache.Finish("/cgi?a=1", "/cgi", "result", true);
+    EXPECT_EQ(CgiCache::HIT, Acquire(&cache, "/cgi?a=1", &output));
+    EXPECT_EQ("result", output);
+}
+
+TEST(TryAcquireNotifiesWaiters)
+{
+    CgiCache cache;
+    cache.EnableRoute("/cgi", 10);
+    std::string output;
+    int notified = 0;
+    CgiCache::FlightPtr flight;
+    EXPECT_EQ(CgiCache::LEADER, cache.TryAcquire("/cgi?a=1", &output, [&notified]{ ++notified; }, &flight));
+    //有leader在执行时不阻塞,返回WAIT并且登记通知
+    EXPECT_EQ(CgiCache::WAIT, cache.TryAcquire("/cgi?a=1", &output, [&notified]{ ++notified; }, &flight));
+    EXPECT_EQ(CgiCache::WAIT, cache.TryAcquire("/cgi?a=1", &output, [&notified]{ ++notified; }, &flight));
+    //还没有结束时取结果得到MISS
+    EXPECT_EQ(CgiCache::MISS, cache.Collect(flight, &output));
+    EXPECT_EQ(0, notified);
+    cache.Finish("/cgi?a=1", "/cgi", "result", true);
+    EXPECT_EQ(2, notified);
+    EXPECT_EQ(CgiCache::HIT, cache.Collect(flight, &output));
+    EXPECT_EQ("result", output);
+    //结果已经缓存,后面的请求直接命中
+    output.clear();
+    EXPECT_EQ(CgiCache::HIT, cache.TryAcquire("/cgi?a=1", &output, [&notified]{ ++notified; }, &flight));
+    EXPECT_EQ("result", output);
+    //leader失败时等待者也会收到通知,但是拿不到结果
+    EXPECT_EQ(CgiCache::LEADER, cache.TryAcquire("/cgi?a=2", &output, [&notified]{ ++notified; }, &flight));
+    EXPECT_EQ(CgiCache::WAIT, cache.TryAcquire("/cgi?a=2", &output, [&notified]{ ++notified; }, &flight));
+    cache.Finish("/cgi?a=2", "/cgi", "", false);
+    EXPECT_EQ(3, notified);
+    EXPECT_EQ(CgiCache::MISS, cache.Collect(flight, &output));
+}
+
+int main()
+{
+    return unit_test::RunAll();
+}
@@ -0,0 +1,203 @@
+#include"cgi_process.h"
+#include"event_loop.h"
+#include"trace.hpp"
+#include"util.hpp"
+#include<errno.h>
+#include<fcntl.h>
+#include<signal.h>
+#include<unistd.h>
+#include<sys/syscall.h>
+#include<sys/wait.h>
+
+namespace http_server{
+
+CgiProcess::CgiProcess(EventLoop* loop)
+    :loop_(loop)
+{}
+
+Task<int> CgiProcess::Run(char* const argv[], char* const envp[], const std::string& input,
+                          std::string* output, int64_t deadline_ms)
+{
+    //1.创建一对匿名管道（父子进程要双向通信）
+    //设置O_CLOEXEC,其他线程同时fork出来的CGI子进程不会继承这次的管道
+    int fd1[2],fd2[2];
+    if(pipe2(fd1, O_CLOEXEC) < 0)
+    {
+        perror("pipe2");
+        co_return -1;
+    }
+    if(pipe2(fd2, O_CLOEXEC) < 0)
+    {
+        perror("pipe2");
+        close(fd1[0]);
+        close(fd1[1]);
+        co_return -1;
+    }
+    int father_write = fd1[1];
+    int child_read = fd1[0];
+    int father_read = fd2[0];
+    int child_write = fd2[1];
+    //父进程这一端由事件循环等待,子进程那一端仍然是阻塞的
+    fcntl(father_write, F_SETFL, O_NONBLOCK);
+    fcntl(father_read, F_SETFL, O_NONBLOCK);
+    //2.创建子进程
+    pid_t pid = 0;
+    {
+        TraceSpan span("cgi_fork");
+        pid = fork();
+    }
+    if(pid == 0)
+    {
+        //事件循环线程屏蔽了退出信号,屏蔽字会被exec保留,CGI程序需要恢复
+        sigset_t empty;
+        sigemptyset(&empty);
+        sigprocmask(SIG_SETMASK, &empty, NULL);
+        //CGI程序单独一个进程组,超时的时候连同它创建的子进程一起杀掉
+        setpgid(0, 0);
+        // 把标准输入输出进行重定向,dup2出来的fd没有O_CLOEXEC标志,exec之后仍然有效
+        dup2(child_read, 0);
+        dup2(child_write, 1);
+        // 进行进程的程序替换,由CGI程序完成动态页面的计算,并且写回数据到管道
+        execve(argv[0], argv, envp);
+        //执行到这里说明替换失败了,子进程不能继续执行服务器的逻辑
+        _exit(127);
+    }
+    close(child_read);
+    close(child_write);
+    if(pid > 0)
+    {
+        //父子进程都设置一次,不管谁先执行,kill之前进程组都已经存在了
+        setpgid(pid, pid);
+    }
+    if(pid < 0)
+    {
+        perror("fork");
+        close(father_read);
+        close(father_write);
+        co_return -1;
+    }
+    //3.如果是POST请求，父进程就要把body写入到管道中
+    int ret = 0;
+    if(!input.empty())
+    {
+        TraceSpan span("cgi_write_body");
+        ret = co_await WriteInput(father_write, input, deadline_ms);
+        //CGI程序没有读完body就关闭了标准输入,它的输出仍然有效
+        if(ret == -EPIPE)
+        {
+            ret = 0;
+        }
+    }
+    loop_->Close(father_write);
+    //4.读取子进程的结果,这段时间包含了子进程exec和CGI程序执行的时间
+    if(ret == 0)
+    {
+        TraceSpan span("cgi_exec_read");
+        ret = co_await ReadOutput(father_read, output, deadline_ms);
+    }
+    loop_->Close(father_read);
+    //5.回收子进程,前面出错或者超时的话直接杀掉
+    int status = 0;
+    {
+        TraceSpan span("cgi_wait");
+        if(ret < 0)
+        {
+            Kill(pid);
+        }
+        co_await WaitExit(pid, deadline_ms, &status);
+    }
+    //exec失败或者CGI程序异常退出时,输出不完整,按失败处理
+    if(ret < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        LOG(ERROR) << "CGI exit abnormally! path=" << argv[0] << " status=" << status
+                   << (ret == -ETIMEDOUT ? " timeout" : "") << "\n";
+        output->clear();
+        co_return -1;
+    }
+    co_return 0;
+}
+
+Task<int> CgiProcess::WriteInput(int fd, const std::string& input, int64_t deadline_ms)
+{
+    size_t written = 0;
+    while(written < input.size())
+    {
+        struct iovec iov = {const_cast<char*>(input.data()) + written, input.size() - written};
+        int ret = co_await loop_->Write(fd, &iov, 1, deadline_ms);
+        if(ret < 0)
+        {
+            co_return ret;
+        }
+        written += ret;
+    }
+    co_return 0;
+}
+
+Task<int> CgiProcess::ReadOutput(int fd, std::string* output, int64_t deadline_ms)
+{
+    //直接读到output的末尾,读缓冲区不放在协程帧里
+    static const size_t kReadSize = 4096;
+    output->clear();
+    while(true)
+    {
+        size_t size = output->size();
+        output->resize(size + kReadSize);
+        int ret = co_await loop_->Read(fd, &(*output)[size], kReadSize, deadline_ms);
+        output->resize(size + (ret > 0 ? ret : 0));
+        if(ret <= 0)
+        {
+            co_return ret;
+        }
+    }
+}
+
+void CgiProcess::Kill(pid_t pid)
+{
+    kill(-pid, SIGKILL);
+    kill(pid, SIGKILL);
+}
+
+// 子进程已经关闭了标准输出,通常马上就会退出
+// 通过pidfd(自带CLOEXEC)等待它退出,内核不支持pidfd时退回到定期waitpid(WNOHANG)
+// 到了截止时间还没有退出就杀掉,之后的waitpid不会再阻塞多久
+Task<int> CgiProcess::WaitExit(pid_t pid, int64_t deadline_ms, int* status)
+{
+    int pidfd = -1;
+#ifdef SYS_pidfd_open
+    pidfd = syscall(SYS_pidfd_open, pid, 0);
+#endif
+    if(pidfd >= 0)
+    {
+        if(co_await loop_->WaitReadable(pidfd, deadline_ms) < 0)
+        {
+            Kill(pid);
+        }
+        loop_->Close(pidfd);
+    }
+    else
+    {
+        while(true)
+        {
+            pid_t ret = waitpid(pid, status, WNOHANG);
+            if(ret == pid || (ret < 0 && errno != EINTR))
+            {
+                co_return ret == pid ? 0 : -1;
+            }
+            if(TimeUtil::MonotonicMS() >= deadline_ms)
+            {
+                Kill(pid);
+                break;
+            }
+            co_await SleepFor(5);
+        }
+    }
+    while(waitpid(pid, status, 0) < 0)
+    {
+        if(errno != EINTR)
+        {
+            co_return -1;
+        }
+    }
+    co_return 0;
+}
+}
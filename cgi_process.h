@@ -0,0 +1,37 @@
+#pragma once
+#include <stdint.h>
+#include <sys/types.h>
+#include <string>
+#include "coroutine.hpp"
+
+namespace http_server{
+
+class EventLoop;
+
+// 在事件循环中执行一个CGI程序
+// fork之后子进程只做dup2和exec,父进程通过非阻塞的管道写入请求的body、读取CGI程序的输出,
+// 再通过pidfd等待子进程退出,事件循环线程在这期间可以继续处理别的连接
+// 超过截止时间还没有结束的CGI程序会连同它创建的子进程一起被杀掉
+class CgiProcess{
+public:
+    explicit CgiProcess(EventLoop* loop);
+
+    // argv和envp需要在调用之前准备好(fork之后的子进程里不能分配内存)
+    // input写到CGI程序的标准输入,标准输出放到output中
+    // CGI程序正常退出并且退出码为0时返回0,否则返回-1
+    Task<int> Run(char* const argv[], char* const envp[], const std::string& input,
+                  std::string* output, int64_t deadline_ms);
+
+private:
+    CgiProcess(const CgiProcess&);
+    CgiProcess& operator=(const CgiProcess&);
+
+    Task<int> WriteInput(int fd, const std::string& input, int64_t deadline_ms);
+    Task<int> ReadOutput(int fd, std::string* output, int64_t deadline_ms);
+    Task<int> WaitExit(pid_t pid, int64_t deadline_ms, int* status);
+    // 杀掉CGI程序所在的整个进程组
+    static void Kill(pid_t pid);
+
+    EventLoop* loop_;
+};
+}
@@ -0,0 +1,159 @@
+#include"connection.h"
+#include"event_loop.h"
+#include"util.hpp"
+#include<errno.h>
+#include<string.h>
+
+namespace http_server{
+
+Connection::Connection()
+    :loop_(NULL)
+    ,fd_(-1)
+    ,deadline_ms_(-1)
+    ,pos_(0)
+    ,len_(0)
+{}
+
+void Connection::Reset(EventLoop* loop, int fd)
+{
+    loop_ = loop;
+    fd_ = fd;
+    deadline_ms_ = -1;
+    pos_ = 0;
+    len_ = 0;
+}
+
+Task<int> Connection::Read()
+{
+    if(!buf_)
+    {
+        buf_.reset(new char[kBufferSize]);
+    }
+    if(pos_ == len_)
+    {
+        pos_ = 0;
+        len_ = 0;
+    }
+    else if(len_ == kBufferSize)
+    {
+        //缓冲区满了,把没有读取的数据挪到开头
+        memmove(buf_.get(), buf_.get() + pos_, len_ - pos_);
+        len_ -= pos_;
+        pos_ = 0;
+    }
+    int ret = co_await loop_->Recv(fd_, buf_.get() + len_, kBufferSize - len_, deadline_ms_);
+    if(ret > 0)
+    {
+        len_ += ret;
+    }
+    co_return ret;
+}
+
+Task<int> Connection::ReadLine(std::string* line, size_t max_len)
+{
+    line->clear();
+    while(true)
+    {
+        if(pos_ == len_ && co_await Read() <= 0)
+        {
+            co_return -1;
+        }
+        char c = buf_[pos_++];
+        if(c == '\r')
+        {
+            //\r后面紧跟着\n的话,把\n也一起吃掉
+            if(pos_ < len_ || co_await Read() > 0)
+            {
+                if(buf_[pos_] == '\n')
+                {
+                    ++pos_;
+                }
+            }
+            break;
+        }
+        if(c == '\n')
+        {
+            break;
+        }
+        if(line->size() >= max_len)
+        {
+            co_return -1;
+        }
+        line->push_back(c);
+    }
+    co_return 0;
+}
+
+Task<int> Connection::ReadN(size_t len, std::string* output)
+{
+    output->clear();
+    size_t cached = len_ - pos_ < len ? len_ - pos_ : len;
+    output->append(buf_.get() + pos_, cached);
+    pos_ += cached;
+    if(output->size() == len)
+    {
+        co_return 0;
+    }
+    //剩下的部分直接读到output中,不经过缓冲区
+    size_t got = output->size();
+    output->resize(len);
+    while(got < len)
+    {
+        int ret = co_await loop_->Recv(fd_, &(*output)[got], len - got, deadline_ms_);
+        if(ret <= 0)
+        {
+            co_return -1;
+        }
+        got += ret;
+    }
+    co_return 0;
+}
+
+Task<int> Connection::Write(const struct iovec* iov, int iovcnt)
+{
+    if(iovcnt > kMaxIov)
+    {
+        co_return -1;
+    }
+    struct iovec pending[kMaxIov];
+    memcpy(pending, iov, sizeof(struct iovec) * iovcnt);
+    struct iovec* cur = pending;
+    while(iovcnt > 0)
+    {
+        int ret = co_await loop_->Send(fd_, cur, iovcnt, TimeUtil::MonotonicMS() + kWriteTimeoutMs);
+        if(ret < 0)
+        {
+            co_return -1;
+        }
+        //跳过已经写完的部分
+        size_t write_size = ret;
+        while(iovcnt > 0 && write_size >= cur->iov_len)
+        {
+            write_size -= cur->iov_len;
+            ++cur;
+            --iovcnt;
+        }
+        if(iovcnt > 0)
+        {
+            cur->iov_base = (char*)cur->iov_base + write_size;
+            cur->iov_len -= write_size;
+        }
+    }
+    co_return 0;
+}
+
+Task<int> Connection::SendFile(int in_fd, off_t offset, size_t count)
+{
+    while(count > 0)
+    {
+        int ret = co_await loop_->SendFile(fd_, in_fd, offset, count, TimeUtil::MonotonicMS() + kWriteTimeoutMs);
+        if(ret <= 0)
+        {
+            co_return -1;
+        }
+        offset += ret;
+        count -= ret;
+    }
+    co_return 0;
+}
+}
@@ -0,0 +1,79 @@
+#pragma once
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <memory>
+#include <string>
+#include "coroutine.hpp"
+
+namespace http_server{
+
+class EventLoop;
+
+// 事件循环上的一个客户端连接:读缓冲区,异步的读写,以及连接上所有协程帧的内存池
+// 读操作共用一个截止时间(SetDeadline),用来限制读完整个请求(或者一个HTTP/2帧)的总时间,
+// 客户端每隔几秒发一个字节也没法无限期地拖住连接
+// 写操作每一次都要在kWriteTimeoutMs之内有进展
+class Connection{
+public:
+    static const size_t kBufferSize = 4096;
+    static const int64_t kWriteTimeoutMs = 10 * 1000;
+
+    Connection();
+
+    void Reset(EventLoop* loop, int fd);
+
+    int Fd() const
+    {
+        return fd_;
+    }
+
+    EventLoop* Loop() const
+    {
+        return loop_;
+    }
+
+    FramePool* Pool()
+    {
+        return &pool_;
+    }
+
+    // deadline_ms为单调时钟的毫秒数,-1表示不限
+    void SetDeadline(int64_t deadline_ms)
+    {
+        deadline_ms_ = deadline_ms;
+    }
+
+    // 缓冲区中还有没有读取的数据
+    bool HasBuffered() const
+    {
+        return pos_ < len_;
+    }
+
+    // 从socket中读一批数据追加到缓冲区,返回读到的字节数,0表示对端关闭,小于0表示出错(超时为-ETIMEDOUT)
+    Task<int> Read();
+    // 语义同FileUtil::ReadLine,行分隔符为\n \r \r\n,返回的line中不包含分隔符
+    // 一行超过max_len个字节时返回-1
+    Task<int> ReadLine(std::string* line, size_t max_len);
+    // 读取len个字节,优先使用缓冲区中剩余的数据
+    Task<int> ReadN(size_t len, std::string* output);
+    // 写出iov中的全部数据
+    Task<int> Write(const struct iovec* iov, int iovcnt);
+    // 把文件in_fd从offset开始的count个字节发送出去
+    Task<int> SendFile(int in_fd, off_t offset, size_t count);
+
+private:
+    Connection(const Connection&);
+    Connection& operator=(const Connection&);
+
+    static const int kMaxIov = 8;
+
+    EventLoop* loop_;
+    int fd_;
+    int64_t deadline_ms_;
+    std::unique_ptr<char[]> buf_;
+    size_t pos_;
+    size_t len_;
+    FramePool pool_;
+};
+}
@@ -0,0 +1,300 @@
+#pragma once
+#include <stddef.h>
+#include <stdlib.h>
+#include <coroutine>
+#include <exception>
+#include <new>
+#include <utility>
+
+namespace http_server{
+
+// 协程帧的内存池,每个连接一个
+// 同一个连接上的协程是严格嵌套的(外层一直等到内层结束),所以像栈一样分配:后分配的先释放
+// 1.第一次使用时申请一块固定大小的内存,之后连接对象被复用时这块内存也跟着复用
+// 2.放不下的帧退回到全局的operator new,每个帧前面记录了它来自哪里
+// 3.释放顺序不是后进先出时空间暂时不回收,等池中所有的帧都释放之后整体回收
+// 当前线程正在执行的协程使用哪个池由Current()决定,事件循环在恢复协程之前切换
+class FramePool{
+public:
+    FramePool()
+        :buf_(NULL)
+        ,top_(0)
+        ,live_(0)
+    {}
+
+    ~FramePool()
+    {
+        free(buf_);
+    }
+
+    static FramePool*& Current()
+    {
+        static thread_local FramePool* pool = NULL;
+        return pool;
+    }
+
+    // 给协程的promise_type使用
+    static void* Allocate(size_t size)
+    {
+        size_t total = Align(size + kHeader);
+        FramePool* pool = Current();
+        char* p = pool != NULL ? pool->Take(total) : NULL;
+        if(p == NULL)
+        {
+            pool = NULL;
+            p = static_cast<char*>(::operator new(total));
+        }
+        *reinterpret_cast<FramePool**>(p) = pool;
+        return p + kHeader;
+    }
+
+    static void Deallocate(void* ptr, size_t size)
+    {
+        char* p = static_cast<char*>(ptr) - kHeader;
+        FramePool* pool = *reinterpret_cast<FramePool**>(p);
+        if(pool == NULL)
+        {
+            ::operator delete(p);
+            return;
+        }
+        pool->Give(p, Align(size + kHeader));
+    }
+
+private:
+    FramePool(const FramePool&);
+    FramePool& operator=(const FramePool&);
+
+    static const size_t kSize = 8192;
+    static const size_t kHeader = 16;   //保存来源的池,同时保证帧按16字节对齐
+
+    static size_t Align(size_t size)
+    {
+        return (size + 15) & ~(size_t)15;
+    }
+
+    char* Take(size_t total)
+    {
+        if(buf_ == NULL)
+        {
+            buf_ = static_cast<char*>(malloc(kSize));
+            if(buf_ == NULL)
+            {
+                return NULL;
+            }
+        }
+        if(top_ + total > kSize)
+        {
+            return NULL;
+        }
+        char* p = buf_ + top_;
+        top_ += total;
+        ++live_;
+        return p;
+    }
+
+    void Give(char* p, size_t total)
+    {
+        if(p + total == buf_ + top_)
+        {
+            top_ -= total;
+        }
+        if(--live_ == 0)
+        {
+            top_ = 0;
+        }
+    }
+
+    char* buf_;
+    size_t top_;
+    size_t live_;
+};
+
+// 在作用域内把当前线程的协程帧分配到pool中
+class FramePoolScope{
+public:
+    explicit FramePoolScope(FramePool* pool)
+        :old_(FramePool::Current())
+    {
+        FramePool::Current() = pool;
+    }
+
+    ~FramePoolScope()
+    {
+        FramePool::Current() = old_;
+    }
+
+private:
+    FramePoolScope(const FramePoolScope&);
+    FramePoolScope& operator=(const FramePoolScope&);
+
+    FramePool* old_;
+};
+
+// Task<T>的promise中和返回值无关的部分
+class TaskPromiseBase{
+public:
+    typedef void (*DoneCallback)(void*);
+
+    TaskPromiseBase()
+        :done_(NULL)
+        ,done_arg_(NULL)
+    {}
+
+    static void* operator new(size_t size)
+    {
+        return FramePool::Allocate(size);
+    }
+
+    static void operator delete(void* ptr, size_t size)
+    {
+        FramePool::Deallocate(ptr, size);
+    }
+
+    // 协程创建之后先挂起,等到被co_await或者Start时才开始执行
+    std::suspend_always initial_suspend() noexcept
+    {
+        return std::suspend_always();
+    }
+
+    // 结束时直接切换回等待它的协程(对称转移),不会因为调用链太深而栈溢出
+    // 没有协程在等待它(Start启动的根协程)时,释放自己的帧之后调用done
+    struct FinalAwaiter{
+        bool await_ready() noexcept
+        {
+            return false;
+        }
+
+        template<class Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+        {
+            TaskPromiseBase& promise = handle.promise();
+            if(promise.continuation_)
+            {
+                return promise.continuation_;
+            }
+            DoneCallback done = promise.done_;
+            void* arg = promise.done_arg_;
+            handle.destroy();
+            if(done != NULL)
+            {
+                done(arg);
+            }
+            return std::noop_coroutine();
+        }
+
+        void await_resume() noexcept
+        {}
+    };
+
+    FinalAwaiter final_suspend() noexcept
+    {
+        return FinalAwaiter();
+    }
+
+    // 服务器中不使用异常,协程中漏出来的异常直接终止进程
+    void unhandled_exception()
+    {
+        std::terminate();
+    }
+
+    std::coroutine_handle<> continuation_;
+    DoneCallback done_;
+    void* done_arg_;
+};
+
+template<class T>
+class TaskPromise : public TaskPromiseBase{
+public:
+    TaskPromise()
+        :value_()
+    {}
+
+    void return_value(T value)
+    {
+        value_ = std::move(value);
+    }
+
+    T Result()
+    {
+        return std::move(value_);
+    }
+
+private:
+    T value_;
+};
+
+template<>
+class TaskPromise<void> : public TaskPromiseBase{
+public:
+    void return_void()
+    {}
+
+    void Result()
+    {}
+};
+
+// 惰性启动的协程,返回T
+// 用法: int ret = co_await conn.ReadLine(&line, 8192);
+// 一个Task只能被co_await一次,帧在Task析构时释放
+template<class T>
+class Task{
+public:
+    class promise_type : public TaskPromise<T>{
+    public:
+        Task get_return_object()
+        {
+            return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+    };
+
+    Task(Task&& other) noexcept
+        :handle_(other.handle_)
+    {
+        other.handle_ = nullptr;
+    }
+
+    ~Task()
+    {
+        if(handle_)
+        {
+            handle_.destroy();
+        }
+    }
+
+    bool await_ready() noexcept
+    {
+        return false;
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept
+    {
+        handle_.promise().continuation_ = caller;
+        return handle_;
+    }
+
+    T await_resume()
+    {
+        return handle_.promise().Result();
+    }
+
+    // 作为根协程启动,不再由Task管理,结束时自己释放帧并调用done(arg)
+    void Start(TaskPromiseBase::DoneCallback done, void* arg)
+    {
+        std::coroutine_handle<promise_type> handle = handle_;
+        handle_ = nullptr;
+        handle.promise().done_ = done;
+        handle.promise().done_arg_ = arg;
+        handle.resume();
+    }
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> handle)
+        :handle_(handle)
+    {}
+
+    Task(const Task&);
+    Task& operator=(const Task&);
+
+    std::coroutine_handle<promise_type> handle_;
+};
+}
@@ -0,0 +1,700 @@
+#include"event_loop.h"
+#include"connection.h"
+#include"uring_poller.h"
+#include"util.hpp"
+#include<errno.h>
+#include<fcntl.h>
+#include<poll.h>
+#include<string.h>
+#include<unistd.h>
+#include<sys/epoll.h>
+#include<sys/eventfd.h>
+#include<sys/sendfile.h>
+#include<sys/socket.h>
+#include<sys/stat.h>
+#include<algorithm>
+
+namespace http_server{
+
+// 执行op对应的非阻塞系统调用,返回值同IoOp::result,暂时不能完成时返回-EAGAIN
+static int PerformIo(IoOp* op)
+{
+    ssize_t ret = 0;
+    do
+    {
+        switch(op->type)
+        {
+        case IO_RECV:
+            ret = recv(op->fd, op->buf, op->len, 0);
+            break;
+        case IO_SEND:
+        {
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = const_cast<struct iovec*>(op->iov);
+            msg.msg_iovlen = op->iovcnt;
+            //对端已经关闭时返回EPIPE,不要产生SIGPIPE
+            ret = sendmsg(op->fd, &msg, MSG_NOSIGNAL);
+            break;
+        }
+        case IO_READ:
+            ret = read(op->fd, op->buf, op->len);
+            break;
+        case IO_WRITE:
+            ret = writev(op->fd, op->iov, op->iovcnt);
+            break;
+        case IO_SENDFILE:
+        {
+            off_t offset = op->offset;
+            ret = sendfile(op->fd, op->in_fd, &offset, op->len);
+            break;
+        }
+        case IO_ACCEPT:
+        {
+            socklen_t len = sizeof(*op->addr);
+            ret = accept4(op->fd, (struct sockaddr*)op->addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            break;
+        }
+        case IO_POLL_IN:
+        {
+            struct pollfd pfd;
+            pfd.fd = op->fd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            ret = poll(&pfd, 1, 0);
+            if(ret == 0)
+            {
+                return -EAGAIN;
+            }
+            break;
+        }
+        case IO_OPENAT:
+            ret = openat(AT_FDCWD, op->path, op->flags);
+            break;
+        case IO_STATX:
+            ret = statx(op->fd, op->path, op->flags, STATX_BASIC_STATS, static_cast<struct statx*>(op->buf));
+            break;
+        default:
+            return -EINVAL;
+        }
+    }while(ret < 0 && errno == EINTR);
+    if(ret < 0)
+    {
+        return errno == EWOULDBLOCK ? -EAGAIN : -errno;
+    }
+    return (int)ret;
+}
+
+static bool IsReadOp(IoOpType type)
+{
+    return type == IO_RECV || type == IO_READ || type == IO_ACCEPT || type == IO_POLL_IN;
+}
+
+// 基于epoll的后端
+// 先直接尝试系统调用,返回EAGAIN时才把fd注册到epoll中(边沿触发,注册一次一直有效)
+// 每个fd最多同时有一个读操作和一个写操作在等待
+class EpollPoller : public Poller{
+public:
+    EpollPoller()
+        :epfd_(-1)
+        ,wakeup_fd_(-1)
+    {}
+
+    ~EpollPoller()
+    {
+        if(epfd_ >= 0)
+        {
+            close(epfd_);
+        }
+        if(wakeup_fd_ >= 0)
+        {
+            close(wakeup_fd_);
+        }
+    }
+
+    int Init()
+    {
+        epfd_ = epoll_create1(EPOLL_CLOEXEC);
+        wakeup_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(epfd_ < 0 || wakeup_fd_ < 0)
+        {
+            return -1;
+        }
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = wakeup_fd_;
+        return epoll_ctl(epfd_, EPOLL_CTL_ADD, wakeup_fd_, &ev);
+    }
+
+    virtual const char* Name() const
+    {
+        return "epoll";
+    }
+
+    virtual bool Submit(IoOp* op)
+    {
+        int ret = PerformIo(op);
+        if(ret != -EAGAIN)
+        {
+            op->result = ret;
+            return false;
+        }
+        if((size_t)op->fd >= fds_.size())
+        {
+            fds_.resize(op->fd + 1);
+        }
+        FdState& state = fds_[op->fd];
+        if(!state.registered)
+        {
+            //监听socket被多个worker共享,EPOLLEXCLUSIVE避免一个连接唤醒所有的worker
+            struct epoll_event ev;
+            ev.events = op->type == IO_ACCEPT ? EPOLLIN | EPOLLET | EPOLLEXCLUSIVE
+                                              : EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            ev.data.fd = op->fd;
+            if(epoll_ctl(epfd_, EPOLL_CTL_ADD, op->fd, &ev) < 0)
+            {
+                op->result = -errno;
+                return false;
+            }
+            state.registered = true;
+        }
+        IoOp*& slot = IsReadOp(op->type) ? state.reader : state.writer;
+        if(slot != NULL)
+        {
+            op->result = -EBUSY;
+            return false;
+        }
+        slot = op;
+        return true;
+    }
+
+    virtual bool Cancel(IoOp* op)
+    {
+        FdState& state = fds_[op->fd];
+        if(state.reader == op)
+        {
+            state.reader = NULL;
+        }
+        if(state.writer == op)
+        {
+            state.writer = NULL;
+        }
+        return true;
+    }
+
+    virtual int Wait(int timeout_ms, std::vector<IoOp*>* done)
+    {
+        struct epoll_event events[256];
+        int n = epoll_wait(epfd_, events, 256, timeout_ms);
+        if(n < 0)
+        {
+            return errno == EINTR ? 0 : -1;
+        }
+        for(int i = 0; i < n; i++)
+        {
+            int fd = events[i].data.fd;
+            if(fd == wakeup_fd_)
+            {
+                uint64_t value = 0;
+                ssize_t ret = read(wakeup_fd_, &value, sizeof(value));
+                (void)ret;
+                continue;
+            }
+            if((size_t)fd >= fds_.size())
+            {
+                continue;
+            }
+            //出错或者对端关闭时读写操作都重试一次,由系统调用返回具体的错误
+            uint32_t ev = events[i].events;
+            FdState& state = fds_[fd];
+            if(state.reader != NULL && (ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+            {
+                Retry(&state.reader, done);
+            }
+            if(state.writer != NULL && (ev & (EPOLLOUT | EPOLLHUP | EPOLLERR)))
+            {
+                Retry(&state.writer, done);
+            }
+        }
+        return n;
+    }
+
+    virtual void Wakeup()
+    {
+        uint64_t value = 1;
+        ssize_t ret = write(wakeup_fd_, &value, sizeof(value));
+        (void)ret;
+    }
+
+    virtual void Forget(int fd)
+    {
+        if((size_t)fd >= fds_.size() || !fds_[fd].registered)
+        {
+            return;
+        }
+        //fork出去的CGI子进程可能还短暂地持有同一个文件,close不一定会把它从epoll中移除
+        epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, NULL);
+        fds_[fd] = FdState();
+    }
+
+private:
+    struct FdState{
+        FdState() :registered(false), reader(NULL), writer(NULL) {}
+        bool registered;
+        IoOp* reader;
+        IoOp* writer;
+    };
+
+    void Retry(IoOp** slot, std::vector<IoOp*>* done)
+    {
+        IoOp* op = *slot;
+        int ret = PerformIo(op);
+        if(ret == -EAGAIN)
+        {
+            return;
+        }
+        *slot = NULL;
+        op->result = ret;
+        done->push_back(op);
+    }
+
+    int epfd_;
+    int wakeup_fd_;
+    std::vector<FdState> fds_;
+};
+
+IoAwaitable::IoAwaitable(EventLoop* loop, IoOpType type, int fd, int64_t deadline_ms)
+    :loop_(loop)
+    ,op_()
+{
+    op_.type = type;
+    op_.fd = fd;
+    op_.in_fd = -1;
+    op_.deadline_ms = deadline_ms;
+}
+
+bool IoAwaitable::await_suspend(std::coroutine_handle<> handle)
+{
+    op_.handle = handle;
+    return loop_->Submit(&op_);
+}
+
+EventLoop::EventLoop()
+    :stopping_(false)
+    ,roots_(0)
+{
+    pthread_mutex_init(&mutex_, NULL);
+}
+
+EventLoop::~EventLoop()
+{
+    for(size_t i = 0; i < free_conns_.size(); i++)
+    {
+        delete free_conns_[i];
+    }
+    pthread_mutex_destroy(&mutex_);
+}
+
+int EventLoop::Init(IoBackend backend)
+{
+    if(backend == BACKEND_URING)
+    {
+        UringPoller* uring = new UringPoller();
+        poller_.reset(uring);
+        if(uring->Init() == 0)
+        {
+            return 0;
+        }
+        LOG(WARNING) << "io_uring not available, fall back to epoll! " << strerror(errno) << "\n";
+    }
+    EpollPoller* poller = new EpollPoller();
+    poller_.reset(poller);
+    if(poller->Init() < 0)
+    {
+        LOG(ERROR) << "EventLoop init error! " << strerror(errno) << "\n";
+        return -1;
+    }
+    return 0;
+}
+
+const char* EventLoop::BackendName() const
+{
+    return poller_->Name();
+}
+
+EventLoop*& EventLoop::Current()
+{
+    static thread_local EventLoop* loop = NULL;
+    return loop;
+}
+
+void EventLoop::Run()
+{
+    Current() = this;
+    while(true)
+    {
+        RunPosted();
+        RunReady();
+        if(stopping_ && roots_ == 0)
+        {
+            break;
+        }
+        int timeout = -1;
+        pthread_mutex_lock(&mutex_);
+        bool posted = !posted_.empty();
+        pthread_mutex_unlock(&mutex_);
+        if(posted || !ready_.empty())
+        {
+            timeout = 0;
+        }
+        else if(!timers_.empty())
+        {
+            int64_t wait = timers_.begin()->first - TimeUtil::MonotonicMS();
+            timeout = wait > 0 ? (int)wait : 0;
+        }
+        done_.clear();
+        poller_->Wait(timeout, &done_);
+        for(size_t i = 0; i < done_.size(); i++)
+        {
+            IoOp* op = done_[i];
+            //后端取消的操作,原因是超时
+            Complete(op, op->timed_out && op->result == -ECANCELED ? -ETIMEDOUT : op->result);
+        }
+        ExpireTimers();
+    }
+    Current() = NULL;
+}
+
+void EventLoop::Stop()
+{
+    Post([this]{
+        stopping_ = true;
+        std::vector<IoOp*> accepts;
+        accepts.swap(accepts_);
+        for(size_t i = 0; i < accepts.size(); i++)
+        {
+            int listen_fd = accepts[i]->fd;
+            if(poller_->Cancel(accepts[i]))
+            {
+                Complete(accepts[i], -ECANCELED);
+            }
+            //监听socket是EPOLLEXCLUSIVE的,留在epoll中的话内核仍然会把新连接的唤醒交给这个正在退出的循环,
+            //别的worker收不到通知,新连接一直留在backlog中
+            poller_->Forget(listen_fd);
+        }
+    });
+}
+
+void EventLoop::Post(const std::function<void()>& fn)
+{
+    pthread_mutex_lock(&mutex_);
+    posted_.push_back(fn);
+    pthread_mutex_unlock(&mutex_);
+    if(Current() != this)
+    {
+        poller_->Wakeup();
+    }
+}
+
+void EventLoop::RunPosted()
+{
+    std::vector<std::function<void()> > posted;
+    pthread_mutex_lock(&mutex_);
+    posted.swap(posted_);
+    pthread_mutex_unlock(&mutex_);
+    for(size_t i = 0; i < posted.size(); i++)
+    {
+        posted[i]();
+    }
+}
+
+void EventLoop::RunReady()
+{
+    //恢复的协程可能又完成了别的操作,一直处理到没有为止
+    while(!ready_.empty())
+    {
+        std::vector<IoOp*> ready;
+        ready.swap(ready_);
+        for(size_t i = 0; i < ready.size(); i++)
+        {
+            IoOp* op = ready[i];
+            FramePool::Current() = op->pool;
+            Tracer::Current() = op->trace;
+            op->handle.resume();
+        }
+        FramePool::Current() = NULL;
+        Tracer::Current() = NULL;
+    }
+}
+
+void EventLoop::Spawn(Task<void>&& task, Connection* conn)
+{
+    ++roots_;
+    FramePool* old_pool = FramePool::Current();
+    TraceContext* old_trace = Tracer::Current();
+    Task<void> root(std::move(task));
+    root.Start(OnRootDone, conn != NULL ? (void*)conn : (void*)this);
+    FramePool::Current() = old_pool;
+    Tracer::Current() = old_trace;
+}
+
+// 根协程结束,它的帧已经释放了,连接对象可以回收
+void EventLoop::OnRootDone(void* arg)
+{
+    EventLoop* loop = Current();
+    --loop->roots_;
+    if(arg != loop)
+    {
+        Connection* conn = static_cast<Connection*>(arg);
+        loop->Close(conn->Fd());
+        conn->Reset(NULL, -1);
+        loop->free_conns_.push_back(conn);
+    }
+}
+
+Connection* EventLoop::NewConnection(int fd)
+{
+    Connection* conn = NULL;
+    if(free_conns_.empty())
+    {
+        conn = new Connection();
+    }
+    else
+    {
+        conn = free_conns_.back();
+        free_conns_.pop_back();
+    }
+    conn->Reset(this, fd);
+    return conn;
+}
+
+IoAwaitable EventLoop::Recv(int fd, void* buf, size_t len, int64_t deadline_ms)
+{
+    IoAwaitable awaitable(this, IO_RECV, fd, deadline_ms);
+    awaitable.Op()->buf = buf;
+    awaitable.Op()->len = len;
+    return awaitable;
+}
+
+IoAwaitable EventLoop::Send(int fd, const struct iovec* iov, int iovcnt, int64_t deadline_ms)
+{
+    IoAwaitable awaitable(this, IO_SEND, fd, deadline_ms);
+    awaitable.Op()->iov = iov;
+    awaitable.Op()->iovcnt = iovcnt;
+    return awaitable;
+}
+
+IoAwaitable EventLoop::Read(int fd, void* buf, size_t len, int64_t deadline_ms)
+{
+    IoAwaitable awaitable(this, IO_READ, fd, deadline_ms);
+    awaitable.Op()->buf = buf;
+    awaitable.Op()->len = len;
+    return awaitable;
+}
+
+IoAwaitable EventLoop::Write(int fd, const struct iovec* iov, int iovcnt, int64_t deadline_ms)
+{
+    IoAwaitable awaitable(this, IO_WRITE, fd, deadline_ms);
+    awaitable.Op()->iov = iov;
+    awaitable.Op()->iovcnt = iovcnt;
+    return awaitable;
+}
+
+IoAwaitable EventLoop::SendFile(int fd, int in_fd, off_t offset, size_t count, int64_t deadline_ms)
+{
+    IoAwaitable awaitable(this, IO_SENDFILE, fd, deadline_ms);
+    awaitable.Op()->in_fd = in_fd;
+    awaitable.Op()->offset = offset;
+    awaitable.Op()->len = count;
+    return awaitable;
+}
+
+IoAwaitable EventLoop::Accept(int listen_fd, struct sockaddr_in* peer)
+{
+    IoAwaitable awaitable(this, IO_ACCEPT, listen_fd, -1);
+    awaitable.Op()->addr = peer;
+    return awaitable;
+}
+
+IoAwaitable EventLoop::WaitReadable(int fd, int64_t deadline_ms)
+{
+    return IoAwaitable(this, IO_POLL_IN, fd, deadline_ms);
+}
+
+IoAwaitable EventLoop::OpenAt(const char* path, int flags)
+{
+    IoAwaitable awaitable(this, IO_OPENAT, -1, -1);
+    awaitable.Op()->path = path;
+    awaitable.Op()->flags = flags;
+    return awaitable;
+}
+
+IoAwaitable EventLoop::Statx(int dirfd, const char* path, int flags, struct statx* stx)
+{
+    IoAwaitable awaitable(this, IO_STATX, dirfd, -1);
+    awaitable.Op()->path = path;
+    awaitable.Op()->flags = flags;
+    awaitable.Op()->buf = stx;
+    return awaitable;
+}
+
+IoAwaitable EventLoop::SleepUntil(int64_t deadline_ms)
+{
+    return IoAwaitable(this, IO_TIMER, -1, deadline_ms);
+}
+
+IoAwaitable SleepFor(int64_t ms)
+{
+    EventLoop* loop = EventLoop::Current();
+    return loop->SleepUntil(TimeUtil::MonotonicMS() + ms);
+}
+
+void EventLoop::Close(int fd)
+{
+    poller_->Forget(fd);
+    close(fd);
+}
+
+bool EventLoop::Submit(IoOp* op)
+{
+    op->pool = FramePool::Current();
+    op->trace = Tracer::Current();
+    op->timed_out = false;
+    op->has_timer = false;
+    op->stage = 0;
+    op->backend = NULL;
+    if(op->type == IO_TIMER)
+    {
+        if(op->deadline_ms <= TimeUtil::MonotonicMS())
+        {
+            op->result = 0;
+            return false;
+        }
+        AddTimer(op);
+        return true;
+    }
+    if(op->type == IO_EVENT)
+    {
+        if(op->event->set_)
+        {
+            op->result = 0;
+            return false;
+        }
+        op->event->waiter_ = op;
+        if(op->deadline_ms >= 0)
+        {
+            AddTimer(op);
+        }
+        return true;
+    }
+    if(op->deadline_ms >= 0 && op->deadline_ms <= TimeUtil::MonotonicMS())
+    {
+        op->result = -ETIMEDOUT;
+        return false;
+    }
+    if(op->type == IO_ACCEPT && stopping_)
+    {
+        //Stop的时候accept协程可能正在退避,没有挂起的accept,监听socket同样要从后端中去掉
+        poller_->Forget(op->fd);
+        op->result = -ECANCELED;
+        return false;
+    }
+    if(!poller_->Submit(op))
+    {
+        return false;
+    }
+    if(op->deadline_ms >= 0)
+    {
+        AddTimer(op);
+    }
+    if(op->type == IO_ACCEPT)
+    {
+        accepts_.push_back(op);
+    }
+    return true;
+}
+
+void EventLoop::Complete(IoOp* op, int result)
+{
+    RemoveTimer(op);
+    if(op->type == IO_ACCEPT)
+    {
+        accepts_.erase(std::remove(accepts_.begin(), accepts_.end(), op), accepts_.end());
+    }
+    op->result = result;
+    ready_.push_back(op);
+}
+
+void EventLoop::AddTimer(IoOp* op)
+{
+    op->timer = timers_.insert(std::make_pair(op->deadline_ms, op));
+    op->has_timer = true;
+}
+
+void EventLoop::RemoveTimer(IoOp* op)
+{
+    if(op->has_timer)
+    {
+        timers_.erase(op->timer);
+        op->has_timer = false;
+    }
+}
+
+void EventLoop::ExpireTimers()
+{
+    int64_t now = TimeUtil::MonotonicMS();
+    while(!timers_.empty() && timers_.begin()->first <= now)
+    {
+        IoOp* op = timers_.begin()->second;
+        RemoveTimer(op);
+        if(op->type == IO_TIMER)
+        {
+            Complete(op, 0);
+        }
+        else if(op->type == IO_EVENT)
+        {
+            op->event->waiter_ = NULL;
+            Complete(op, -ETIMEDOUT);
+        }
+        else
+        {
+            op->timed_out = true;
+            if(poller_->Cancel(op))
+            {
+                Complete(op, -ETIMEDOUT);
+            }
+        }
+    }
+}
+
+LoopEvent::LoopEvent(EventLoop* loop)
+    :loop_(loop)
+    ,set_(false)
+    ,waiter_(NULL)
+{}
+
+void LoopEvent::Set()
+{
+    //总是经过事件循环,Set的调用者(例如正在执行Finish的leader)不会被重入
+    std::shared_ptr<LoopEvent> self = shared_from_this();
+    loop_->Post([self]{ self->Fire(); });
+}
+
+void LoopEvent::Fire()
+{
+    set_ = true;
+    if(waiter_ != NULL)
+    {
+        IoOp* op = waiter_;
+        waiter_ = NULL;
+        loop_->Complete(op, 0);
+    }
+}
+
+IoAwaitable LoopEvent::Wait(int64_t deadline_ms)
+{
+    IoAwaitable awaitable(loop_, IO_EVENT, -1, deadline_ms);
+    awaitable.Op()->event = this;
+    return awaitable;
+}
+}
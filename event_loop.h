@@ -0,0 +1,219 @@
+#pragma once
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <coroutine>
+#include <functional>
+#include <map>
+#include <memory>
+#include <vector>
+#include "coroutine.hpp"
+#include "trace.hpp"
+
+namespace http_server{
+
+class EventLoop;
+class LoopEvent;
+class Connection;
+
+enum IoOpType{
+    IO_RECV,       //从socket读
+    IO_SEND,       //向socket写(sendmsg)
+    IO_READ,       //从管道读
+    IO_WRITE,      //向管道写
+    IO_SENDFILE,   //从文件直接发送到socket
+    IO_ACCEPT,
+    IO_POLL_IN,    //等待fd可读,例如等待pidfd
+    IO_TIMER,      //只等待截止时间
+    IO_EVENT,      //等待LoopEvent
+    IO_OPENAT,     //打开文件
+    IO_STATX,      //获取文件信息
+};
+
+// 事件循环使用的IO后端
+enum IoBackend{
+    BACKEND_EPOLL,
+    BACKEND_URING,   //内核不支持时退回到epoll
+};
+
+// 一次异步操作,放在等待它的协程的帧中,完成之后恢复这个协程
+struct IoOp{
+    IoOpType type;
+    int fd;
+    void* buf;
+    size_t len;
+    const struct iovec* iov;
+    int iovcnt;
+    int in_fd;                  //IO_SENDFILE的源文件
+    off_t offset;
+    struct sockaddr_in* addr;   //IO_ACCEPT的对端地址
+    const char* path;           //IO_OPENAT/IO_STATX的路径
+    int flags;                  //IO_OPENAT的open flags,IO_STATX的AT_*标志
+    LoopEvent* event;           //IO_EVENT等待的事件
+    int64_t deadline_ms;        //单调时钟的毫秒数,-1表示不限
+    //完成时的返回值,和对应的系统调用一样,失败时为-errno,超时为-ETIMEDOUT
+    int result;
+    //以下由事件循环使用
+    bool timed_out;
+    bool has_timer;
+    std::multimap<int64_t, IoOp*>::iterator timer;
+    std::coroutine_handle<> handle;
+    FramePool* pool;            //恢复协程时切换回挂起时的内存池和追踪请求
+    TraceContext* trace;
+    //以下由后端使用,在操作完成之前一直有效
+    int stage;
+    struct msghdr msg;
+    void* backend;
+};
+
+// co_await一个IO操作,结果为IoOp::result
+class IoAwaitable{
+public:
+    IoAwaitable(EventLoop* loop, IoOpType type, int fd, int64_t deadline_ms);
+
+    IoOp* Op()
+    {
+        return &op_;
+    }
+
+    bool await_ready() noexcept
+    {
+        return false;
+    }
+
+    // 能立即完成的操作不挂起
+    bool await_suspend(std::coroutine_handle<> handle);
+
+    int await_resume() noexcept
+    {
+        return op_.result;
+    }
+
+private:
+    EventLoop* loop_;
+    IoOp op_;
+};
+
+// 事件循环的IO后端
+// 提交的操作能立即完成时直接返回结果,否则挂起,完成之后由Wait返回
+class Poller{
+public:
+    virtual ~Poller() {}
+    virtual const char* Name() const = 0;
+    // 返回false表示已经完成,结果在op->result中
+    virtual bool Submit(IoOp* op) = 0;
+    // 取消一个还没有完成的操作,返回true表示已经取消,false表示取消之后还会由Wait返回(结果为-ECANCELED)
+    virtual bool Cancel(IoOp* op) = 0;
+    // 等待最多timeout_ms毫秒(-1表示一直等),完成的操作追加到done中
+    virtual int Wait(int timeout_ms, std::vector<IoOp*>* done) = 0;
+    // 让阻塞在Wait中的线程返回,可以在任意线程调用
+    virtual void Wakeup() = 0;
+    // fd即将被关闭,清掉它在后端中的状态
+    virtual void Forget(int fd) = 0;
+};
+
+// 单线程的事件循环,一个线程一个
+// 连接的处理逻辑是C++20的协程,读写socket、等待CGI、sleep时挂起到事件循环上,
+// 由事件循环在fd就绪(或者超时)时恢复,处理逻辑仍然是顺序的代码,但是一个线程可以同时服务大量连接
+// 除了Post和Stop,所有函数都只能在事件循环所在的线程中调用
+class EventLoop{
+public:
+    EventLoop();
+    ~EventLoop();
+
+    // 选择BACKEND_URING但是内核不支持时使用epoll,实际使用的后端见BackendName
+    int Init(IoBackend backend = BACKEND_EPOLL);
+    const char* BackendName() const;
+
+    // 执行直到Stop之后所有的根协程都结束
+    void Run();
+    // 不再接受新连接(正在等待的Accept返回-ECANCELED),可以在任意线程调用
+    void Stop();
+    bool IsStopping() const
+    {
+        return stopping_;
+    }
+    // 在事件循环线程中执行fn,可以在任意线程调用
+    void Post(const std::function<void()>& fn);
+    // 当前线程的事件循环,不在事件循环线程中时为NULL
+    static EventLoop*& Current();
+
+    // 启动一个根协程,协程的帧从conn的内存池中分配,结束之后释放conn
+    // conn为NULL时帧从全局堆上分配
+    void Spawn(Task<void>&& task, Connection* conn);
+
+    // 连接对象会被复用,读缓冲区和协程内存池不需要每次重新分配
+    Connection* NewConnection(int fd);
+
+    // 以下的IO操作deadline_ms为单调时钟的毫秒数,-1表示不限
+    IoAwaitable Recv(int fd, void* buf, size_t len, int64_t deadline_ms);
+    IoAwaitable Send(int fd, const struct iovec* iov, int iovcnt, int64_t deadline_ms);
+    IoAwaitable Read(int fd, void* buf, size_t len, int64_t deadline_ms);
+    IoAwaitable Write(int fd, const struct iovec* iov, int iovcnt, int64_t deadline_ms);
+    IoAwaitable SendFile(int fd, int in_fd, off_t offset, size_t count, int64_t deadline_ms);
+    // 返回新连接的fd(非阻塞,带CLOEXEC),对端地址放到peer中
+    IoAwaitable Accept(int listen_fd, struct sockaddr_in* peer);
+    IoAwaitable WaitReadable(int fd, int64_t deadline_ms);
+    // 返回打开的fd,path相对于当前目录
+    IoAwaitable OpenAt(const char* path, int flags);
+    // 获取基本的文件信息(STATX_BASIC_STATS),dirfd和flags的含义同statx
+    IoAwaitable Statx(int dirfd, const char* path, int flags, struct statx* stx);
+    IoAwaitable SleepUntil(int64_t deadline_ms);
+    // 关闭一个在事件循环中使用过的fd
+    void Close(int fd);
+
+    // 以下给IoAwaitable和LoopEvent使用
+    bool Submit(IoOp* op);
+    // 完成一个挂起的操作,协程在下一轮被恢复
+    void Complete(IoOp* op, int result);
+
+private:
+    EventLoop(const EventLoop&);
+    EventLoop& operator=(const EventLoop&);
+
+    static void OnRootDone(void* arg);
+    void AddTimer(IoOp* op);
+    void RemoveTimer(IoOp* op);
+    void ExpireTimers();
+    void RunReady();
+    void RunPosted();
+
+    std::unique_ptr<Poller> poller_;
+    bool stopping_;
+    size_t roots_;                     //还没有结束的根协程
+    std::multimap<int64_t, IoOp*> timers_;
+    std::vector<IoOp*> ready_;
+    std::vector<IoOp*> done_;
+    std::vector<IoOp*> accepts_;       //正在等待的Accept,Stop时取消
+    std::vector<Connection*> free_conns_;
+    pthread_mutex_t mutex_;            //保护posted_
+    std::vector<std::function<void()> > posted_;
+};
+
+// 让当前协程等待ms毫秒
+IoAwaitable SleepFor(int64_t ms);
+
+// 一次性的通知:一个协程等待,另一个地方(可以是别的线程)Set
+// 通过shared_ptr管理,等待超时之后才Set也是安全的
+class LoopEvent : public std::enable_shared_from_this<LoopEvent>{
+public:
+    explicit LoopEvent(EventLoop* loop);
+
+    // 可以在任意线程调用
+    void Set();
+    // 等到Set或者超时,Set过返回0,超时返回-ETIMEDOUT
+    IoAwaitable Wait(int64_t deadline_ms);
+
+private:
+    friend class EventLoop;
+    void Fire();
+
+    EventLoop* loop_;
+    bool set_;
+    IoOp* waiter_;
+};
+}
@@ -0,0 +1,381 @@
+#include "event_loop.h"
+#include "connection.h"
+#include "util.hpp"
+#include "unit_test.hpp"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <atomic>
+
+using namespace http_server;
+
+// 在loop中执行task,所有的根协程结束之后返回
+static void RunTasks(EventLoop* loop, Task<void> (*make)(EventLoop*, void*), void* arg)
+{
+    loop->Post([loop, make, arg]{
+        loop->Spawn(make(loop, arg), NULL);
+        loop->Stop();
+    });
+    loop->Run();
+}
+
+struct SleepCase{
+    int64_t elapsed;
+};
+
+static Task<void> SleepTask(EventLoop*, void* arg)
+{
+    SleepCase* c = static_cast<SleepCase*>(arg);
+    int64_t start = TimeUtil::MonotonicMS();
+    co_await SleepFor(50);
+    c->elapsed = TimeUtil::MonotonicMS() - start;
+}
+
+static void CheckSleep(IoBackend backend)
+{
+    EventLoop loop;
+    EXPECT_EQ(0, loop.Init(backend));
+    SleepCase c = {0};
+    RunTasks(&loop, SleepTask, &c);
+    EXPECT_TRUE(c.elapsed >= 50 && c.elapsed < 1000);
+}
+
+TEST(SleepForWaits)
+{
+    CheckSleep(BACKEND_EPOLL);
+    CheckSleep(BACKEND_URING);
+}
+
+struct LineCase{
+    int fds[2];
+    std::vector<int> rets;
+    std::vector<std::string> lines;
+    int64_t elapsed;
+};
+
+static Task<void> ReadLinesTask(EventLoop* loop, void* arg)
+{
+    LineCase* c = static_cast<LineCase*>(arg);
+    Connection* conn = loop->NewConnection(c->fds[0]);
+    conn->SetDeadline(TimeUtil::MonotonicMS() + 200);
+    int64_t start = TimeUtil::MonotonicMS();
+    std::string line;
+    while(true)
+    {
+        int ret = co_await conn->ReadLine(&line, 16);
+        c->rets.push_back(ret);
+        c->lines.push_back(line);
+        if(ret < 0)
+        {
+            break;
+        }
+    }
+    c->elapsed = TimeUtil::MonotonicMS() - start;
+    loop->Close(c->fds[0]);
+}
+
+static void CheckReadLine(IoBackend backend)
+{
+    EventLoop loop;
+    EXPECT_EQ(0, loop.Init(backend));
+    LineCase c;
+    EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, c.fds));
+    std::string data = "abc\r\ndef\n\nghi\r" + std::string(20, 'x') + "\n";
+    EXPECT_EQ((ssize_t)data.size(), write(c.fds[1], data.data(), data.size()));
+    RunTasks(&loop, ReadLinesTask, &c);
+    EXPECT_EQ(size_t(5), c.rets.size());
+    EXPECT_EQ("abc", c.lines[0]);
+    EXPECT_EQ("def", c.lines[1]);
+    EXPECT_EQ("", c.lines[2]);
+    EXPECT_EQ("ghi", c.lines[3]);
+    //超过16个字节的行直接失败,不用等到截止时间
+    EXPECT_EQ(-1, c.rets[4]);
+    EXPECT_TRUE(c.elapsed < 200);
+    close(c.fds[1]);
+}
+
+TEST(ReadLineSplitsAndCapsLength)
+{
+    CheckReadLine(BACKEND_EPOLL);
+    CheckReadLine(BACKEND_URING);
+}
+
+// 每隔30ms发一个字节,永远不发换行
+static Task<void> DripTask(EventLoop* loop, void* arg)
+{
+    LineCase* c = static_cast<LineCase*>(arg);
+    for(int i = 0; i < 20; i++)
+    {
+        struct iovec iov = {(void*)"a", 1};
+        if(co_await loop->Send(c->fds[1], &iov, 1, -1) < 0)
+        {
+            break;
+        }
+        co_await SleepFor(30);
+    }
+}
+
+static Task<void> SlowClientTasks(EventLoop* loop, void* arg)
+{
+    loop->Spawn(DripTask(loop, arg), NULL);
+    co_await ReadLinesTask(loop, arg);
+}
+
+static void CheckReadDeadline(IoBackend backend)
+{
+    EventLoop loop;
+    EXPECT_EQ(0, loop.Init(backend));
+    LineCase c;
+    EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, c.fds));
+    RunTasks(&loop, SlowClientTasks, &c);
+    //每次recv都有进展,但是整行必须在200ms之内读完
+    EXPECT_EQ(size_t(1), c.rets.size());
+    EXPECT_EQ(-1, c.rets[0]);
+    EXPECT_TRUE(c.elapsed >= 200 && c.elapsed < 500);
+    close(c.fds[1]);
+}
+
+TEST(ReadDeadlineCoversWholeLine)
+{
+    CheckReadDeadline(BACKEND_EPOLL);
+    CheckReadDeadline(BACKEND_URING);
+}
+
+struct EventCase{
+    std::shared_ptr<LoopEvent> event;
+    int set_ret;
+    int timeout_ret;
+};
+
+static void* SetLater(void* arg)
+{
+    EventCase* c = static_cast<EventCase*>(arg);
+    usleep(20 * 1000);
+    c->event->Set();
+    return NULL;
+}
+
+static Task<void> EventTask(EventLoop* loop, void* arg)
+{
+    EventCase* c = static_cast<EventCase*>(arg);
+    c->event = std::make_shared<LoopEvent>(loop);
+    pthread_t tid;
+    pthread_create(&tid, NULL, SetLater, c);
+    c->set_ret = co_await c->event->Wait(TimeUtil::MonotonicMS() + 5000);
+    pthread_join(tid, NULL);
+    std::shared_ptr<LoopEvent> never = std::make_shared<LoopEvent>(loop);
+    c->timeout_ret = co_await never->Wait(TimeUtil::MonotonicMS() + 20);
+}
+
+static void CheckLoopEvent(IoBackend backend)
+{
+    EventLoop loop;
+    EXPECT_EQ(0, loop.Init(backend));
+    EventCase c;
+    c.set_ret = 1;
+    c.timeout_ret = 1;
+    RunTasks(&loop, EventTask, &c);
+    EXPECT_EQ(0, c.set_ret);
+    EXPECT_EQ(-ETIMEDOUT, c.timeout_ret);
+}
+
+TEST(LoopEventSetFromOtherThread)
+{
+    CheckLoopEvent(BACKEND_EPOLL);
+    CheckLoopEvent(BACKEND_URING);
+}
+
+struct FileCase{
+    int fds[2];
+    int open_ret;
+    int missing_ret;
+    int statx_ret;
+    struct statx stx;
+    int sent;
+    std::string received;
+};
+
+// 打开文件、获取大小,再整个发送到socket
+static Task<void> FileTask(EventLoop* loop, void* arg)
+{
+    FileCase* c = static_cast<FileCase*>(arg);
+    c->missing_ret = co_await loop->OpenAt("no_such_file", O_RDONLY | O_CLOEXEC);
+    int fd = co_await loop->OpenAt("event_loop_test.cc", O_RDONLY | O_CLOEXEC);
+    c->open_ret = fd;
+    if(fd < 0)
+    {
+        co_return;
+    }
+    c->statx_ret = co_await loop->Statx(fd, "", AT_EMPTY_PATH, &c->stx);
+    Connection* conn = loop->NewConnection(c->fds[0]);
+    c->sent = co_await conn->SendFile(fd, 0, c->stx.stx_size);
+    loop->Close(fd);
+    loop->Close(c->fds[0]);
+}
+
+static void* ReadAll(void* arg)
+{
+    FileCase* c = static_cast<FileCase*>(arg);
+    char buf[4096];
+    ssize_t n = 0;
+    while((n = read(c->fds[1], buf, sizeof(buf))) > 0)
+    {
+        c->received.append(buf, n);
+    }
+    return NULL;
+}
+
+static void CheckFileIo(IoBackend backend)
+{
+    EventLoop loop;
+    EXPECT_EQ(0, loop.Init(backend));
+    FileCase c;
+    c.open_ret = c.missing_ret = c.statx_ret = c.sent = -1;
+    EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, c.fds));
+    fcntl(c.fds[0], F_SETFL, O_NONBLOCK);
+    //读的一端在另一个线程,发送的数据比socket缓冲区大
+    pthread_t tid;
+    pthread_create(&tid, NULL, ReadAll, &c);
+    RunTasks(&loop, FileTask, &c);
+    pthread_join(tid, NULL);
+    struct stat st;
+    EXPECT_EQ(0, stat("event_loop_test.cc", &st));
+    EXPECT_TRUE(c.open_ret >= 0);
+    EXPECT_EQ(0, c.statx_ret);
+    EXPECT_EQ((uint64_t)st.st_size, (uint64_t)c.stx.stx_size);
+    EXPECT_EQ(0, c.sent);
+    EXPECT_EQ((size_t)st.st_size, c.received.size());
+    EXPECT_EQ(-ENOENT, c.missing_ret);
+    close(c.fds[1]);
+}
+
+TEST(FileIoThroughLoop)
+{
+    CheckFileIo(BACKEND_EPOLL);
+    CheckFileIo(BACKEND_URING);
+}
+
+TEST(UringBackendSelected)
+{
+    //测试环境的内核支持io_uring时应该真正用上,不支持时退回到epoll
+    EventLoop loop;
+    EXPECT_EQ(0, loop.Init(BACKEND_URING));
+    std::string name = loop.BackendName();
+    EXPECT_TRUE(name == "io_uring" || name == "epoll");
+}
+
+struct ShareCase{
+    int listen_fd;
+    std::atomic<EventLoop*> accepted_by;
+};
+
+static Task<void> AcceptOnceTask(EventLoop* loop, void* arg)
+{
+    ShareCase* c = static_cast<ShareCase*>(arg);
+    struct sockaddr_in peer;
+    int fd = co_await loop->Accept(c->listen_fd, &peer);
+    if(fd >= 0)
+    {
+        c->accepted_by = loop;
+        loop->Close(fd);
+    }
+}
+
+// 已经Stop的循环还有没结束的连接,继续运行一段时间
+static Task<void> LingerTask(EventLoop*, void*)
+{
+    co_await SleepFor(600);
+}
+
+static void* RunLoop(void* arg)
+{
+    static_cast<EventLoop*>(arg)->Run();
+    return NULL;
+}
+
+static void CheckStoppedLoopReleasesListener(IoBackend backend)
+{
+    ShareCase c;
+    c.accepted_by = NULL;
+    c.listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    EXPECT_EQ(0, bind(c.listen_fd, (struct sockaddr*)&addr, sizeof(addr)));
+    EXPECT_EQ(0, listen(c.listen_fd, 16));
+    socklen_t len = sizeof(addr);
+    getsockname(c.listen_fd, (struct sockaddr*)&addr, &len);
+
+    EventLoop stopped;
+    EventLoop running;
+    EXPECT_EQ(0, stopped.Init(backend));
+    EXPECT_EQ(0, running.Init(backend));
+    stopped.Post([&stopped, &c]{
+        stopped.Spawn(AcceptOnceTask(&stopped, &c), NULL);
+        stopped.Spawn(LingerTask(&stopped, &c), NULL);
+    });
+    running.Post([&running, &c]{
+        running.Spawn(AcceptOnceTask(&running, &c), NULL);
+    });
+    //先等待的循环排在监听socket等待队列的前面,内核优先唤醒它
+    pthread_t tids[2];
+    pthread_create(&tids[0], NULL, RunLoop, &stopped);
+    usleep(30 * 1000);
+    pthread_create(&tids[1], NULL, RunLoop, &running);
+    usleep(30 * 1000);
+    stopped.Stop();
+    usleep(30 * 1000);
+
+    int client = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    EXPECT_EQ(0, connect(client, (struct sockaddr*)&addr, sizeof(addr)));
+    int64_t start = TimeUtil::MonotonicMS();
+    while(c.accepted_by == NULL && TimeUtil::MonotonicMS() - start < 300)
+    {
+        usleep(1000);
+    }
+    EXPECT_TRUE(c.accepted_by == &running);
+    running.Stop();
+    pthread_join(tids[0], NULL);
+    pthread_join(tids[1], NULL);
+    close(client);
+    close(c.listen_fd);
+}
+
+TEST(StoppedLoopReleasesListener)
+{
+    CheckStoppedLoopReleasesListener(BACKEND_EPOLL);
+    CheckStoppedLoopReleasesListener(BACKEND_URING);
+}
+
+TEST(FramePoolReusesMemory)
+{
+    FramePool pool;
+    FramePoolScope scope(&pool);
+    void* a = FramePool::Allocate(100);
+    void* b = FramePool::Allocate(100);
+    EXPECT_TRUE((char*)b > (char*)a);
+    FramePool::Deallocate(b, 100);
+    //后进先出的释放马上可以复用
+    void* c = FramePool::Allocate(100);
+    EXPECT_TRUE(b == c);
+    //放不下的帧从全局堆上分配,释放时能正确区分
+    void* big = FramePool::Allocate(16 * 1024);
+    EXPECT_TRUE((char*)big < (char*)a || (char*)big >= (char*)a + 8192);
+    FramePool::Deallocate(big, 16 * 1024);
+    FramePool::Deallocate(c, 100);
+    FramePool::Deallocate(a, 100);
+    //全部释放之后从头开始
+    EXPECT_TRUE(FramePool::Allocate(100) == a);
+}
+
+int main()
+{
+    return unit_test::RunAll();
+}
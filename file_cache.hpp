@@ -0,0 +1,257 @@
+#pragma once
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/resource.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include "util.hpp"
+
+namespace http_server{
+
+// 处理url路径的工具类
+class PathUtil{
+public:
+    // 把url_path规范化成以/开头的路径
+    // 1.对%xx进行解码
+    // 2.去掉多余的/和.,处理..
+    // 3.如果..越过了根目录或者路径中包含\0,认为是非法路径,返回-1
+    // 原路径以/结尾时,规范化之后也保留结尾的/
+    static int Normalize(const std::string& url_path, std::string* output)
+    {
+        std::string decoded;
+        if(UrlDecode(url_path, &decoded) < 0)
+        {
+            return -1;
+        }
+        if(decoded.empty() || decoded[0] != '/')
+        {
+            return -1;
+        }
+        std::vector<std::string> parts;
+        size_t start = 1;
+        while(start <= decoded.size())
+        {
+            size_t end = decoded.find('/', start);
+            if(end == std::string::npos)
+            {
+                end = decoded.size();
+            }
+            std::string part = decoded.substr(start, end - start);
+            start = end + 1;
+            if(part.empty() || part == ".")
+            {
+                continue;
+            }
+            if(part == "..")
+            {
+                if(parts.empty())
+                {
+                    return -1;
+                }
+                parts.pop_back();
+                continue;
+            }
+            parts.push_back(part);
+        }
+        output->clear();
+        for(size_t i = 0; i < parts.size(); i++)
+        {
+            output->push_back('/');
+            (*output) += parts[i];
+        }
+        if(output->empty() || decoded[decoded.size() - 1] == '/')
+        {
+            output->push_back('/');
+        }
+        return 0;
+    }
+
+    static int UrlDecode(const std::string& input, std::string* output)
+    {
+        output->clear();
+        for(size_t i = 0; i < input.size(); i++)
+        {
+            char c = input[i];
+            if(c == '%')
+            {
+                if(i + 2 >= input.size() || !isxdigit(input[i+1]) || !isxdigit(input[i+2]))
+                {
+                    return -1;
+                }
+                c = (char)strtol(input.substr(i + 1, 2).c_str(), NULL, 16);
+                i += 2;
+            }
+            if(c == '\0')
+            {
+                return -1;
+            }
+            output->push_back(c);
+        }
+        return 0;
+    }
+};
+
+// 缓存中的一个已经打开的文件
+// 多个线程可能同时在发送同一个文件,通过shared_ptr管理,最后一个使用者释放时才关闭fd
+struct OpenFile{
+    OpenFile() :fd(-1) {}
+    ~OpenFile()
+    {
+        if(fd >= 0)
+        {
+            close(fd);
+        }
+    }
+    int fd;
+    std::string path;  //磁盘上的实际路径,目录已经被映射成目录下的index.html
+    struct stat st;
+    std::atomic<int64_t> check_time;  //上一次确认文件没有变化的时间(秒)
+};
+typedef std::shared_ptr<OpenFile> OpenFilePtr;
+
+// 静态文件的缓存,key是规范化之后的url_path
+// 命中时直接复用已经打开的fd和stat信息,不需要再stat/open
+// 超过ttl的表项在下一次命中时重新stat一次,文件被修改过就重新打开
+// 表项数量有上限,超过上限时淘汰最久没有使用的表项
+// 每个表项占用一个fd,上限默认取进程fd上限的四分之一,剩下的留给连接、管道和CGI
+class FileCache{
+public:
+    // max_size为0表示根据RLIMIT_NOFILE计算
+    FileCache(const std::string& root, size_t max_size = 0, int ttl = 2)
+        :root_(root)
+        ,max_size_(max_size > 0 ? max_size : DefaultMaxSize())
+        ,ttl_(ttl)
+    {
+        pthread_mutex_init(&mutex_, NULL);
+    }
+
+    ~FileCache()
+    {
+        pthread_mutex_destroy(&mutex_);
+    }
+
+    static size_t DefaultMaxSize()
+    {
+        struct rlimit limit;
+        if(getrlimit(RLIMIT_NOFILE, &limit) < 0 || limit.rlim_cur == RLIM_INFINITY)
+        {
+            return 1024;
+        }
+        size_t max_size = limit.rlim_cur / 4;
+        return max_size < 16 ? 16 : max_size;
+    }
+
+    // 缓存只负责查找和淘汰,stat/open由调用者完成(HttpServer::OpenStaticFile通过事件循环异步完成)
+    // 查找缓存,超过ttl没有确认过的表项need_check为true,调用者需要重新stat,
+    // 和IsSame比较之后更新check_time,或者Erase
+    OpenFilePtr Lookup(const std::string& clean_path, int64_t now, bool* need_check)
+    {
+        *need_check = false;
+        pthread_mutex_lock(&mutex_);
+        Map::iterator it = map_.find(clean_path);
+        if(it == map_.end())
+        {
+            pthread_mutex_unlock(&mutex_);
+            return OpenFilePtr();
+        }
+        //移动到链表头部,表示最近使用过
+        lru_.splice(lru_.begin(), lru_, it->second);
+        OpenFilePtr file = it->second->second;
+        pthread_mutex_unlock(&mutex_);
+        *need_check = now - file->check_time.load(std::memory_order_relaxed) >= ttl_;
+        return file;
+    }
+
+    // 放入一个新打开的文件,返回值就是file
+    OpenFilePtr Insert(const std::string& clean_path, const OpenFilePtr& file, int64_t now)
+    {
+        file->check_time.store(now, std::memory_order_relaxed);
+        pthread_mutex_lock(&mutex_);
+        Map::iterator it = map_.find(clean_path);
+        if(it != map_.end())
+        {
+            //别的线程已经先一步放进去了
+            lru_.erase(it->second);
+            map_.erase(it);
+        }
+        lru_.push_front(Entry(clean_path, file));
+        map_[clean_path] = lru_.begin();
+        while(map_.size() > max_size_)
+        {
+            map_.erase(lru_.back().first);
+            lru_.pop_back();
+        }
+        pthread_mutex_unlock(&mutex_);
+        return file;
+    }
+
+    // 文件已经被修改或者删除,从缓存中去掉(已经被替换成别的表项时不动)
+    void Erase(const std::string& clean_path, const OpenFilePtr& file)
+    {
+        pthread_mutex_lock(&mutex_);
+        Map::iterator it = map_.find(clean_path);
+        if(it != map_.end() && it->second->second == file)
+        {
+            lru_.erase(it->second);
+            map_.erase(it);
+        }
+        pthread_mutex_unlock(&mutex_);
+    }
+
+    // 打开之前的磁盘路径,以/结尾的路径直接映射成index.html,
+    // 其他目录要打开之后才知道,由调用者在后面加上/index.html
+    std::string DiskPath(const std::string& clean_path)
+    {
+        std::string path = root_ + clean_path;
+        if(path[path.size() - 1] == '/')
+        {
+            path += "index.html";
+        }
+        return path;
+    }
+
+    // 文件自从打开之后有没有被修改或者替换,st是刚刚获取的信息
+    static bool IsSame(const OpenFilePtr& file, const struct stat& st)
+    {
+        return st.st_ino == file->st.st_ino && st.st_dev == file->st.st_dev
+            && st.st_size == file->st.st_size && st.st_mtime == file->st.st_mtime;
+    }
+
+    // statx的结果转换成缓存中使用的struct stat,只转换用到的字段
+    static void StatxToStat(const struct statx& stx, struct stat* st)
+    {
+        memset(st, 0, sizeof(*st));
+        st->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+        st->st_ino = stx.stx_ino;
+        st->st_mode = stx.stx_mode;
+        st->st_size = stx.stx_size;
+        st->st_mtime = stx.stx_mtime.tv_sec;
+    }
+
+private:
+    FileCache(const FileCache&);
+    FileCache& operator=(const FileCache&);
+
+    typedef std::pair<std::string, OpenFilePtr> Entry;
+    typedef std::list<Entry> List;
+    typedef std::unordered_map<std::string, List::iterator> Map;
+
+    std::string root_;
+    size_t max_size_;
+    int ttl_;
+    List lru_;
+    Map map_;
+    pthread_mutex_t mutex_;
+};
+}
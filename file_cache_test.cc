@@ -0,0 +1,264 @@
+#include "file_cache.hpp"
+#include "unit_test.hpp"
+
+using namespace http_server;
+
+static std::string Normalize(const std::string& url_path)
+{
+    std::string output;
+    if(PathUtil::Normalize(url_path, &output) < 0)
+    {
+        return "<invalid>";
+    }
+    return output;
+}
+
+TEST(NormalizeCollapsesSlashesAndDots)
+{
+    EXPECT_EQ("/", Normalize("/"));
+    EXPECT_EQ("/a/b", Normalize("//a///b"));
+    EXPECT_EQ("/a/c", Normalize("/a/./b/../c"));
+    EXPECT_EQ("/", Normalize("/a/.."));
+    EXPECT_EQ("/", Normalize("/./"));
+}
+
+TEST(NormalizeKeepsTrailingSlash)
+{
+    EXPECT_EQ("/a/", Normalize("/a/"));
+    EXPECT_EQ("/a/", Normalize("/a/b/../"));
+    EXPECT_EQ("/a", Normalize("/a/."));
+    EXPECT_EQ("/a", Normalize("/a"));
+}
+
+TEST(NormalizeRejectsEscapingRoot)
+{
+    EXPECT_EQ("<invalid>", Normalize("/.."));
+    EXPECT_EQ("<invalid>", Normalize("/../cgi_main"));
+    EXPECT_EQ("<invalid>", Normalize("/a/../../etc/passwd"));
+    EXPECT_EQ("<invalid>", Normalize("/a/../.."));
+    //..在解码之后才处理,编码过的..同样不能越过根目录
+    EXPECT_EQ("<invalid>", Normalize("/%2e%2e/etc/passwd"));
+    EXPECT_EQ("<invalid>", Normalize("/%2E%2e"));
+    EXPECT_EQ("<invalid>", Normalize("/a%2f..%2f..%2fb"));
+    //不越过根目录的..是合法的
+    EXPECT_EQ("/b", Normalize("/a/%2e%2e/b"));
+}
+
+TEST(NormalizeRejectsNulAndBadEscapes)
+{
+    EXPECT_EQ("<invalid>", Normalize("/index.html%00.png"));
+    EXPECT_EQ("<invalid>", Normalize("/%00"));
+    EXPECT_EQ("<invalid>", Normalize("/a%2"));
+    EXPECT_EQ("<invalid>", Normalize("/a%"));
+    EXPECT_EQ("<invalid>", Normalize("/a%zz"));
+    EXPECT_EQ("<invalid>", Normalize(""));
+    EXPECT_EQ("<invalid>", Normalize("index.html"));
+}
+
+TEST(NormalizeDecodesEscapes)
+{
+    EXPECT_EQ("/a b/c", Normalize("/a%20b/c"));
+    EXPECT_EQ("/A", Normalize("/%41"));
+    EXPECT_EQ("/a/b", Normalize("/a%2Fb"));
+}
+
+TEST(DefaultMaxSizeFollowsRlimit)
+{
+    struct rlimit old_limit;
+    getrlimit(RLIMIT_NOFILE, &old_limit);
+    struct rlimit limit = old_limit;
+    limit.rlim_cur = 1024;
+    if(limit.rlim_max != RLIM_INFINITY && limit.rlim_max < limit.rlim_cur)
+    {
+        limit.rlim_cur = limit.rlim_max;
+    }
+    setrlimit(RLIMIT_NOFILE, &limit);
+    EXPECT_EQ((size_t)limit.rlim_cur / 4, FileCache::DefaultMaxSize());
+    limit.rlim_cur = 32;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    EXPECT_EQ((size_t)16, FileCache::DefaultMaxSize());
+    setrlimit(RLIMIT_NOFILE, &old_limit);
+}
+
+// 和HttpServer::OpenStaticFile使用缓存的方式相同,只是stat/open是同步完成的
+static OpenFilePtr OpenCached(FileCache* cache, const std::string& clean_path, int64_t now)
+{
+    bool need_check = false;
+    OpenFilePtr file = cache->Lookup(clean_path, now, &need_check);
+    if(file && need_check)
+    {
+        struct stat st;
+        if(stat(file->path.c_str(), &st) == 0 && FileCache::IsSame(file, st))
+        {
+            file->check_time.store(now, std::memory_order_relaxed);
+            return file;
+        }
+        cache->Erase(clean_path, file);
+        file.reset();
+    }
+    if(file)
+    {
+        return file;
+    }
+    file = std::make_shared<OpenFile>();
+    file->path = cache->DiskPath(clean_path);
+    for(int i = 0; i < 2; i++)
+    {
+        file->fd = open(file->path.c_str(), O_RDONLY | O_CLOEXEC);
+        if(file->fd < 0 || fstat(file->fd, &file->st) < 0)
+        {
+            return OpenFilePtr();
+        }
+        if(!S_ISDIR(file->st.st_mode))
+        {
+            break;
+        }
+        close(file->fd);
+        file->fd = -1;
+        file->path += "/index.html";
+    }
+    if(!S_ISREG(file->st.st_mode))
+    {
+        return OpenFilePtr();
+    }
+    return cache->Insert(clean_path, file, now);
+}
+
+static void WriteFile(const std::string& path, const char* content)
+{
+    FILE* fp = fopen(path.c_str(), "w");
+    fputs(content, fp);
+    fclose(fp);
+}
+
+TEST(OpensFilesAndDirectoryIndex)
+{
+    char root[] = "/tmp/file_cache_test.XXXXXX";
+    EXPECT_TRUE(mkdtemp(root) != NULL);
+    std::string dir = root;
+    WriteFile(dir + "/index.html", "hello");
+    mkdir((dir + "/sub").c_str(), 0755);
+    WriteFile(dir + "/sub/index.html", "sub");
+
+    FileCache cache(dir, 4);
+    OpenFilePtr file = OpenCached(&cache, "/", 100);
+    EXPECT_TRUE(file && file->st.st_size == 5);
+    EXPECT_EQ(dir + "/index.html", file->path);
+    //不以/结尾的目录打开之后才发现是目录,再打开目录下的index.html
+    file = OpenCached(&cache, "/sub", 100);
+    EXPECT_TRUE(file && file->st.st_size == 3);
+    EXPECT_EQ(dir + "/sub/index.html", file->path);
+    EXPECT_TRUE(OpenCached(&cache, "/index.html", 100) != NULL);
+    EXPECT_TRUE(OpenCached(&cache, "/missing.html", 100) == NULL);
+    //空目录没有index.html
+    mkdir((dir + "/empty").c_str(), 0755);
+    EXPECT_TRUE(OpenCached(&cache, "/empty/", 100) == NULL);
+    //ttl之内命中时直接复用同一个表项
+    EXPECT_TRUE(OpenCached(&cache, "/sub", 101) == file);
+
+    rmdir((dir + "/empty").c_str());
+    unlink((dir + "/sub/index.html").c_str());
+    rmdir((dir + "/sub").c_str());
+    unlink((dir + "/index.html").c_str());
+    rmdir(root);
+}
+
+TEST(ReopensModifiedFileAfterTtl)
+{
+    char root[] = "/tmp/file_cache_test.XXXXXX";
+    EXPECT_TRUE(mkdtemp(root) != NULL);
+    std::string dir = root;
+    std::string path = dir + "/a.html";
+    WriteFile(path, "hello");
+
+    FileCache cache(dir, 4, 2);
+    OpenFilePtr file = OpenCached(&cache, "/a.html", 100);
+    EXPECT_TRUE(file && file->st.st_size == 5);
+    //超过ttl但文件没有变化,确认之后继续使用原来的表项
+    EXPECT_TRUE(OpenCached(&cache, "/a.html", 102) == file);
+    WriteFile(path, "hello world");
+    //ttl之内不会发现文件的变化
+    EXPECT_TRUE(OpenCached(&cache, "/a.html", 103) == file);
+    OpenFilePtr reopened = OpenCached(&cache, "/a.html", 104);
+    EXPECT_TRUE(reopened && reopened != file && reopened->st.st_size == 11);
+    //文件被删除之后不再返回
+    unlink(path.c_str());
+    EXPECT_TRUE(OpenCached(&cache, "/a.html", 106) == NULL);
+
+    rmdir(root);
+}
+
+TEST(EvictsLeastRecentlyUsed)
+{
+    char root[] = "/tmp/file_cache_test.XXXXXX";
+    EXPECT_TRUE(mkdtemp(root) != NULL);
+    std::string dir = root;
+    WriteFile(dir + "/a", "a");
+    WriteFile(dir + "/b", "b");
+    WriteFile(dir + "/c", "c");
+
+    FileCache cache(dir, 2);
+    OpenFilePtr a = OpenCached(&cache, "/a", 100);
+    OpenCached(&cache, "/b", 100);
+    //访问a之后b是最久没有使用的,放入c时淘汰b
+    EXPECT_TRUE(OpenCached(&cache, "/a", 100) == a);
+    OpenCached(&cache, "/c", 100);
+    bool need_check = false;
+    EXPECT_TRUE(cache.Lookup("/a", 100, &need_check) == a);
+    EXPECT_TRUE(cache.Lookup("/b", 100, &need_check) == NULL);
+    EXPECT_TRUE(cache.Lookup("/c", 100, &need_check) != NULL);
+
+    unlink((dir + "/a").c_str());
+    unlink((dir + "/b").c_str());
+    unlink((dir + "/c").c_str());
+    rmdir(root);
+}
+
+TEST(LookupAsksForRecheckAfterTtl)
+{
+    char root[] = "/tmp/file_cache_test.XXXXXX";
+    EXPECT_TRUE(mkdtemp(root) != NULL);
+    std::string dir = root;
+    std::string path = dir + "/a.html";
+    FILE* fp = fopen(path.c_str(), "w");
+    fputs("hello", fp);
+    fclose(fp);
+
+    FileCache cache(dir, 4, 2);
+    EXPECT_EQ(path, cache.DiskPath("/a.html"));
+    EXPECT_EQ(dir + "/b/index.html", cache.DiskPath("/b/"));
+    bool need_check = true;
+    EXPECT_TRUE(cache.Lookup("/a.html", 100, &need_check) == NULL);
+    //调用者自己打开文件之后放进缓存
+    OpenFilePtr file = std::make_shared<OpenFile>();
+    file->path = path;
+    file->fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    EXPECT_EQ(0, fstat(file->fd, &file->st));
+    cache.Insert("/a.html", file, 100);
+    EXPECT_TRUE(cache.Lookup("/a.html", 101, &need_check) == file);
+    EXPECT_TRUE(!need_check);
+    EXPECT_TRUE(cache.Lookup("/a.html", 102, &need_check) == file);
+    EXPECT_TRUE(need_check);
+    //statx的结果和打开时的stat一致
+    struct statx stx;
+    EXPECT_EQ(0, statx(AT_FDCWD, path.c_str(), 0, STATX_BASIC_STATS, &stx));
+    struct stat st;
+    FileCache::StatxToStat(stx, &st);
+    EXPECT_TRUE(FileCache::IsSame(file, st));
+    //文件被修改之后不再一致,从缓存中去掉
+    fp = fopen(path.c_str(), "a");
+    fputs(" world", fp);
+    fclose(fp);
+    EXPECT_EQ(0, stat(path.c_str(), &st));
+    EXPECT_TRUE(!FileCache::IsSame(file, st));
+    cache.Erase("/a.html", file);
+    EXPECT_TRUE(cache.Lookup("/a.html", 102, &need_check) == NULL);
+
+    unlink(path.c_str());
+    rmdir(root);
+}
+
+int main()
+{
+    return unit_test::RunAll();
+}
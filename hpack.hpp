@@ -0,0 +1,599 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <utility>
+
+namespace http_server{
+
+// HPACK(RFC 7541)的实现,HTTP/2用它来压缩header
+// 解码器完整支持静态表、动态表、Huffman编码和动态表大小的更新
+// 编码器完全匹配的header直接输出表的下标,其余的header按字面值输出,
+// 值得重复使用的header(例如content-type)会加入动态表,后续的响应只需要一个字节
+typedef std::pair<std::string, std::string> HeaderField;
+typedef std::vector<HeaderField> HeaderList;
+
+// HPACK的静态表,下标从1开始
+static const char* const kHpackStaticTable[][2] = {
+    {"", ""},
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+static const size_t kHpackStaticTableSize = sizeof(kHpackStaticTable) / sizeof(kHpackStaticTable[0]) - 1;
+
+// HPACK的Huffman编码表,按字节值排列,每一项是{编码,编码的位数}
+static const uint32_t kHpackHuffmanCodes[256][2] = {
+    {0x00001ff8, 13}, {0x007fffd8, 23}, {0x0fffffe2, 28}, {0x0fffffe3, 28},
+    {0x0fffffe4, 28}, {0x0fffffe5, 28}, {0x0fffffe6, 28}, {0x0fffffe7, 28},
+    {0x0fffffe8, 28}, {0x00ffffea, 24}, {0x3ffffffc, 30}, {0x0fffffe9, 28},
+    {0x0fffffea, 28}, {0x3ffffffd, 30}, {0x0fffffeb, 28}, {0x0fffffec, 28},
+    {0x0fffffed, 28}, {0x0fffffee, 28}, {0x0fffffef, 28}, {0x0ffffff0, 28},
+    {0x0ffffff1, 28}, {0x0ffffff2, 28}, {0x3ffffffe, 30}, {0x0ffffff3, 28},
+    {0x0ffffff4, 28}, {0x0ffffff5, 28}, {0x0ffffff6, 28}, {0x0ffffff7, 28},
+    {0x0ffffff8, 28}, {0x0ffffff9, 28}, {0x0ffffffa, 28}, {0x0ffffffb, 28},
+    {0x00000014,  6}, {0x000003f8, 10}, {0x000003f9, 10}, {0x00000ffa, 12},
+    {0x00001ff9, 13}, {0x00000015,  6}, {0x000000f8,  8}, {0x000007fa, 11},
+    {0x000003fa, 10}, {0x000003fb, 10}, {0x000000f9,  8}, {0x000007fb, 11},
+    {0x000000fa,  8}, {0x00000016,  6}, {0x00000017,  6}, {0x00000018,  6},
+    {0x00000000,  5}, {0x00000001,  5}, {0x00000002,  5}, {0x00000019,  6},
+    {0x0000001a,  6}, {0x0000001b,  6}, {0x0000001c,  6}, {0x0000001d,  6},
+    {0x0000001e,  6}, {0x0000001f,  6}, {0x0000005c,  7}, {0x000000fb,  8},
+    {0x00007ffc, 15}, {0x00000020,  6}, {0x00000ffb, 12}, {0x000003fc, 10},
+    {0x00001ffa, 13}, {0x00000021,  6}, {0x0000005d,  7}, {0x0000005e,  7},
+    {0x0000005f,  7}, {0x00000060,  7}, {0x00000061,  7}, {0x00000062,  7},
+    {0x00000063,  7}, {0x00000064,  7}, {0x00000065,  7}, {0x00000066,  7},
+    {0x00000067,  7}, {0x00000068,  7}, {0x00000069,  7}, {0x0000006a,  7},
+    {0x0000006b,  7}, {0x0000006c,  7}, {0x0000006d,  7}, {0x0000006e,  7},
+    {0x0000006f,  7}, {0x00000070,  7}, {0x00000071,  7}, {0x00000072,  7},
+    {0x000000fc,  8}, {0x00000073,  7}, {0x000000fd,  8}, {0x00001ffb, 13},
+    {0x0007fff0, 19}, {0x00001ffc, 13}, {0x00003ffc, 14}, {0x00000022,  6},
+    {0x00007ffd, 15}, {0x00000003,  5}, {0x00000023,  6}, {0x00000004,  5},
+    {0x00000024,  6}, {0x00000005,  5}, {0x00000025,  6}, {0x00000026,  6},
+    {0x00000027,  6}, {0x00000006,  5}, {0x00000074,  7}, {0x00000075,  7},
+    {0x00000028,  6}, {0x00000029,  6}, {0x0000002a,  6}, {0x00000007,  5},
+    {0x0000002b,  6}, {0x00000076,  7}, {0x0000002c,  6}, {0x00000008,  5},
+    {0x00000009,  5}, {0x0000002d,  6}, {0x00000077,  7}, {0x00000078,  7},
+    {0x00000079,  7}, {0x0000007a,  7}, {0x0000007b,  7}, {0x00007ffe, 15},
+    {0x000007fc, 11}, {0x00003ffd, 14}, {0x00001ffd, 13}, {0x0ffffffc, 28},
+    {0x000fffe6, 20}, {0x003fffd2, 22}, {0x000fffe7, 20}, {0x000fffe8, 20},
+    {0x003fffd3, 22}, {0x003fffd4, 22}, {0x003fffd5, 22}, {0x007fffd9, 23},
+    {0x003fffd6, 22}, {0x007fffda, 23}, {0x007fffdb, 23}, {0x007fffdc, 23},
+    {0x007fffdd, 23}, {0x007fffde, 23}, {0x00ffffeb, 24}, {0x007fffdf, 23},
+    {0x00ffffec, 24}, {0x00ffffed, 24}, {0x003fffd7, 22}, {0x007fffe0, 23},
+    {0x00ffffee, 24}, {0x007fffe1, 23}, {0x007fffe2, 23}, {0x007fffe3, 23},
+    {0x007fffe4, 23}, {0x001fffdc, 21}, {0x003fffd8, 22}, {0x007fffe5, 23},
+    {0x003fffd9, 22}, {0x007fffe6, 23}, {0x007fffe7, 23}, {0x00ffffef, 24},
+    {0x003fffda, 22}, {0x001fffdd, 21}, {0x000fffe9, 20}, {0x003fffdb, 22},
+    {0x003fffdc, 22}, {0x007fffe8, 23}, {0x007fffe9, 23}, {0x001fffde, 21},
+    {0x007fffea, 23}, {0x003fffdd, 22}, {0x003fffde, 22}, {0x00fffff0, 24},
+    {0x001fffdf, 21}, {0x003fffdf, 22}, {0x007fffeb, 23}, {0x007fffec, 23},
+    {0x001fffe0, 21}, {0x001fffe1, 21}, {0x003fffe0, 22}, {0x001fffe2, 21},
+    {0x007fffed, 23}, {0x003fffe1, 22}, {0x007fffee, 23}, {0x007fffef, 23},
+    {0x000fffea, 20}, {0x003fffe2, 22}, {0x003fffe3, 22}, {0x003fffe4, 22},
+    {0x007ffff0, 23}, {0x003fffe5, 22}, {0x003fffe6, 22}, {0x007ffff1, 23},
+    {0x03ffffe0, 26}, {0x03ffffe1, 26}, {0x000fffeb, 20}, {0x0007fff1, 19},
+    {0x003fffe7, 22}, {0x007ffff2, 23}, {0x003fffe8, 22}, {0x01ffffec, 25},
+    {0x03ffffe2, 26}, {0x03ffffe3, 26}, {0x03ffffe4, 26}, {0x07ffffde, 27},
+    {0x07ffffdf, 27}, {0x03ffffe5, 26}, {0x00fffff1, 24}, {0x01ffffed, 25},
+    {0x0007fff2, 19}, {0x001fffe3, 21}, {0x03ffffe6, 26}, {0x07ffffe0, 27},
+    {0x07ffffe1, 27}, {0x03ffffe7, 26}, {0x07ffffe2, 27}, {0x00fffff2, 24},
+    {0x001fffe4, 21}, {0x001fffe5, 21}, {0x03ffffe8, 26}, {0x03ffffe9, 26},
+    {0x0ffffffd, 28}, {0x07ffffe3, 27}, {0x07ffffe4, 27}, {0x07ffffe5, 27},
+    {0x000fffec, 20}, {0x00fffff3, 24}, {0x000fffed, 20}, {0x001fffe6, 21},
+    {0x003fffe9, 22}, {0x001fffe7, 21}, {0x001fffe8, 21}, {0x007ffff3, 23},
+    {0x003fffea, 22}, {0x003fffeb, 22}, {0x01ffffee, 25}, {0x01ffffef, 25},
+    {0x00fffff4, 24}, {0x00fffff5, 24}, {0x03ffffea, 26}, {0x007ffff4, 23},
+    {0x03ffffeb, 26}, {0x07ffffe6, 27}, {0x03ffffec, 26}, {0x03ffffed, 26},
+    {0x07ffffe7, 27}, {0x07ffffe8, 27}, {0x07ffffe9, 27}, {0x07ffffea, 27},
+    {0x07ffffeb, 27}, {0x0ffffffe, 28}, {0x07ffffec, 27}, {0x07ffffed, 27},
+    {0x07ffffee, 27}, {0x07ffffef, 27}, {0x07fffff0, 27}, {0x03ffffee, 26},
+};
+
+// Huffman解码用的二叉树,第一次使用时根据编码表构造
+class HuffmanDecoder{
+public:
+    static const HuffmanDecoder& Instance()
+    {
+        static HuffmanDecoder decoder;
+        return decoder;
+    }
+
+    int Decode(const unsigned char* data, size_t len, std::string* output) const
+    {
+        int node = 0;
+        int depth = 0;          //当前位置离上一个完整字符有多少位
+        bool all_ones = true;   //这些位是不是全是1
+        for(size_t i = 0; i < len; i++)
+        {
+            for(int bit = 7; bit >= 0; bit--)
+            {
+                int b = (data[i] >> bit) & 1;
+                node = nodes_[node].child[b];
+                if(node < 0)
+                {
+                    //走到了不存在的分支,也就是EOS
+                    return -1;
+                }
+                ++depth;
+                all_ones = all_ones && b == 1;
+                if(nodes_[node].symbol >= 0)
+                {
+                    output->push_back((char)nodes_[node].symbol);
+                    node = 0;
+                    depth = 0;
+                    all_ones = true;
+                }
+            }
+        }
+        //结尾的填充必须是不超过7位的EOS前缀(全1)
+        if(depth > 7 || !all_ones)
+        {
+            return -1;
+        }
+        return 0;
+    }
+
+private:
+    struct Node{
+        int child[2];
+        int symbol;
+    };
+
+    HuffmanDecoder()
+    {
+        Node root = {{-1, -1}, -1};
+        nodes_.push_back(root);
+        for(int symbol = 0; symbol < 256; symbol++)
+        {
+            uint32_t code = kHpackHuffmanCodes[symbol][0];
+            int len = kHpackHuffmanCodes[symbol][1];
+            int node = 0;
+            for(int bit = len - 1; bit >= 0; bit--)
+            {
+                int b = (code >> bit) & 1;
+                if(nodes_[node].child[b] < 0)
+                {
+                    Node child = {{-1, -1}, -1};
+                    nodes_.push_back(child);
+                    nodes_[node].child[b] = nodes_.size() - 1;
+                }
+                node = nodes_[node].child[b];
+            }
+            nodes_[node].symbol = symbol;
+        }
+    }
+
+    std::vector<Node> nodes_;
+};
+
+// HPACK的动态表,新加入的header下标最小,超过容量时从最老的header开始淘汰
+// 每个header占用的大小是name和value的长度再加32
+class HpackDynamicTable{
+public:
+    HpackDynamicTable()
+        :size_(0)
+        ,capacity_(4096)
+    {}
+
+    void SetCapacity(size_t capacity)
+    {
+        capacity_ = capacity;
+        Evict(0);
+    }
+
+    size_t Capacity() const
+    {
+        return capacity_;
+    }
+
+    void Add(const std::string& name, const std::string& value)
+    {
+        size_t entry_size = name.size() + value.size() + 32;
+        //比整个表都大的header会把表清空,自身也不会加入
+        Evict(entry_size);
+        if(entry_size <= capacity_)
+        {
+            fields_.push_front(HeaderField(name, value));
+            size_ += entry_size;
+        }
+    }
+
+    size_t Count() const
+    {
+        return fields_.size();
+    }
+
+    // 下标从0开始,0是最新加入的header
+    const HeaderField& Get(size_t index) const
+    {
+        return fields_[index];
+    }
+
+private:
+    void Evict(size_t need)
+    {
+        while(!fields_.empty() && size_ + need > capacity_)
+        {
+            size_ -= fields_.back().first.size() + fields_.back().second.size() + 32;
+            fields_.pop_back();
+        }
+    }
+
+    std::deque<HeaderField> fields_;
+    size_t size_;
+    size_t capacity_;
+};
+
+// HPACK解码器,每个连接一个,连接上所有header块必须按顺序解码
+class HpackDecoder{
+public:
+    // Decode的返回值,解码出来的header超过了SetMaxHeaderListSize设置的上限
+    static const int kHeaderListTooLarge = -2;
+
+    HpackDecoder()
+        :max_capacity_(4096)
+        ,max_list_size_((size_t)-1)
+    {}
+
+    // 一个header块解码之后的大小上限,按照RFC 7540的算法,每个header计name和value的长度再加32
+    // 很小的header块可以通过反复引用动态表中的大header展开成非常大的header列表,必须边解码边检查
+    void SetMaxHeaderListSize(size_t size)
+    {
+        max_list_size_ = size;
+    }
+
+    // 解码一个完整的header块
+    // 返回-1表示出错(连接必须以COMPRESSION_ERROR关闭)
+    // 返回kHeaderListTooLarge表示超过了大小上限,动态表的状态已经不完整,连接同样必须关闭
+    int Decode(const std::string& block, HeaderList* headers)
+    {
+        const unsigned char* p = (const unsigned char*)block.data();
+        const unsigned char* end = p + block.size();
+        bool allow_size_update = true;
+        size_t list_size = 0;
+        while(p < end)
+        {
+            uint8_t first = *p;
+            if(first & 0x80)
+            {
+                //6.1 完整的header在表中
+                uint64_t index = 0;
+                if(DecodeInt(&p, end, 7, &index) < 0 || index == 0)
+                {
+                    return -1;
+                }
+                HeaderField field;
+                if(Lookup(index, &field) < 0)
+                {
+                    return -1;
+                }
+                list_size += field.first.size() + field.second.size() + 32;
+                if(list_size > max_list_size_)
+                {
+                    return kHeaderListTooLarge;
+                }
+                headers->push_back(field);
+            }
+            else if((first & 0xE0) == 0x20)
+            {
+                //6.3 动态表大小更新,只能出现在header块的开头
+                uint64_t capacity = 0;
+                if(!allow_size_update || DecodeInt(&p, end, 5, &capacity) < 0 || capacity > max_capacity_)
+                {
+                    return -1;
+                }
+                table_.SetCapacity(capacity);
+                continue;
+            }
+            else
+            {
+                //6.2 字面值,01xxxxxx加入动态表,0000xxxx不加入,0001xxxx永不加入
+                int prefix = (first & 0x40) ? 6 : 4;
+                bool indexing = (first & 0x40) != 0;
+                uint64_t index = 0;
+                if(DecodeInt(&p, end, prefix, &index) < 0)
+                {
+                    return -1;
+                }
+                HeaderField field;
+                if(index > 0)
+                {
+                    if(Lookup(index, &field) < 0)
+                    {
+                        return -1;
+                    }
+                }
+                else if(DecodeString(&p, end, &field.first) < 0)
+                {
+                    return -1;
+                }
+                if(DecodeString(&p, end, &field.second) < 0)
+                {
+                    return -1;
+                }
+                if(indexing)
+                {
+                    table_.Add(field.first, field.second);
+                }
+                list_size += field.first.size() + field.second.size() + 32;
+                if(list_size > max_list_size_)
+                {
+                    return kHeaderListTooLarge;
+                }
+                headers->push_back(field);
+            }
+            allow_size_update = false;
+        }
+        return 0;
+    }
+
+    static int DecodeInt(const unsigned char** p, const unsigned char* end, int prefix, uint64_t* value)
+    {
+        if(*p >= end)
+        {
+            return -1;
+        }
+        uint64_t max_prefix = (1 << prefix) - 1;
+        *value = **p & max_prefix;
+        ++*p;
+        if(*value < max_prefix)
+        {
+            return 0;
+        }
+        int shift = 0;
+        while(true)
+        {
+            if(*p >= end || shift > 28)
+            {
+                return -1;
+            }
+            uint8_t b = **p;
+            ++*p;
+            *value += (uint64_t)(b & 0x7F) << shift;
+            shift += 7;
+            if((b & 0x80) == 0)
+            {
+                return 0;
+            }
+        }
+    }
+
+    static int DecodeString(const unsigned char** p, const unsigned char* end, std::string* output)
+    {
+        if(*p >= end)
+        {
+            return -1;
+        }
+        bool huffman = (**p & 0x80) != 0;
+        uint64_t len = 0;
+        if(DecodeInt(p, end, 7, &len) < 0 || len > (uint64_t)(end - *p))
+        {
+            return -1;
+        }
+        output->clear();
+        int ret = 0;
+        if(huffman)
+        {
+            ret = HuffmanDecoder::Instance().Decode(*p, len, output);
+        }
+        else
+        {
+            output->assign((const char*)*p, len);
+        }
+        *p += len;
+        return ret;
+    }
+
+private:
+    int Lookup(uint64_t index, HeaderField* field) const
+    {
+        if(index <= kHpackStaticTableSize)
+        {
+            field->first = kHpackStaticTable[index][0];
+            field->second = kHpackStaticTable[index][1];
+            return 0;
+        }
+        index -= kHpackStaticTableSize + 1;
+        if(index >= table_.Count())
+        {
+            return -1;
+        }
+        *field = table_.Get(index);
+        return 0;
+    }
+
+    HpackDynamicTable table_;
+    size_t max_capacity_;  //我们通过SETTINGS_HEADER_TABLE_SIZE告诉对方的上限
+    size_t max_list_size_; //我们通过SETTINGS_MAX_HEADER_LIST_SIZE告诉对方的上限
+};
+
+// HPACK编码器,每个连接一个
+class HpackEncoder{
+public:
+    HpackEncoder()
+        :pending_update_(false)
+    {}
+
+    // 对方通过SETTINGS_HEADER_TABLE_SIZE修改了动态表的上限
+    // 编码器最多使用4096字节,变化之后需要在下一个header块的开头通知对方
+    void SetMaxCapacity(size_t capacity)
+    {
+        if(capacity > 4096)
+        {
+            capacity = 4096;
+        }
+        if(capacity != table_.Capacity())
+        {
+            table_.SetCapacity(capacity);
+            pending_update_ = true;
+        }
+    }
+
+    void Encode(const HeaderList& headers, std::string* output)
+    {
+        if(pending_update_)
+        {
+            EncodeInt(table_.Capacity(), 5, 0x20, output);
+            pending_update_ = false;
+        }
+        for(size_t i = 0; i < headers.size(); i++)
+        {
+            const std::string& name = headers[i].first;
+            const std::string& value = headers[i].second;
+            size_t name_index = 0;
+            size_t index = Find(name, value, &name_index);
+            if(index > 0)
+            {
+                EncodeInt(index, 7, 0x80, output);
+                continue;
+            }
+            if(ShouldIndex(name))
+            {
+                EncodeInt(name_index, 6, 0x40, output);
+                table_.Add(name, value);
+            }
+            else
+            {
+                EncodeInt(name_index, 4, 0x00, output);
+            }
+            if(name_index == 0)
+            {
+                EncodeString(name, output);
+            }
+            EncodeString(value, output);
+        }
+    }
+
+    static void EncodeInt(uint64_t value, int prefix, uint8_t flags, std::string* output)
+    {
+        uint64_t max_prefix = (1 << prefix) - 1;
+        if(value < max_prefix)
+        {
+            output->push_back((char)(flags | value));
+            return;
+        }
+        output->push_back((char)(flags | max_prefix));
+        value -= max_prefix;
+        while(value >= 0x80)
+        {
+            output->push_back((char)(0x80 | (value & 0x7F)));
+            value >>= 7;
+        }
+        output->push_back((char)value);
+    }
+
+    // 字符串按原样输出,不使用Huffman编码
+    static void EncodeString(const std::string& str, std::string* output)
+    {
+        EncodeInt(str.size(), 7, 0x00, output);
+        (*output) += str;
+    }
+
+private:
+    // 返回完全匹配的表下标,没有的话返回0,name_index为只匹配name的下标
+    size_t Find(const std::string& name, const std::string& value, size_t* name_index) const
+    {
+        *name_index = 0;
+        for(size_t i = 1; i <= kHpackStaticTableSize; i++)
+        {
+            if(name == kHpackStaticTable[i][0])
+            {
+                if(value == kHpackStaticTable[i][1])
+                {
+                    return i;
+                }
+                if(*name_index == 0)
+                {
+                    *name_index = i;
+                }
+            }
+        }
+        for(size_t i = 0; i < table_.Count(); i++)
+        {
+            const HeaderField& field = table_.Get(i);
+            if(field.first == name)
+            {
+                if(field.second == value)
+                {
+                    return kHpackStaticTableSize + 1 + i;
+                }
+                if(*name_index == 0)
+                {
+                    *name_index = kHpackStaticTableSize + 1 + i;
+                }
+            }
+        }
+        return 0;
+    }
+
+    // 每个响应都不一样的header(content-length、etag)加入动态表没有意义
+    static bool ShouldIndex(const std::string& name)
+    {
+        return name == "content-type" || name == "vary" || name == "content-encoding"
+            || name == "retry-after" || name == "cache-control";
+    }
+
+    HpackDynamicTable table_;
+    bool pending_update_;
+};
+}
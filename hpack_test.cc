@@ -0,0 +1,204 @@
+#include "hpack.hpp"
+#include "unit_test.hpp"
+#include <stdlib.h>
+
+using namespace http_server;
+
+// 十六进制字符串转换成字节,方便直接抄写RFC 7541附录C中的例子
+static std::string Hex(const char* hex)
+{
+    std::string output;
+    for(const char* p = hex; p[0] != '\0' && p[1] != '\0'; p += 2)
+    {
+        output.push_back((char)strtol(std::string(p, 2).c_str(), NULL, 16));
+    }
+    return output;
+}
+
+static std::string Join(const HeaderList& headers)
+{
+    std::string output;
+    for(size_t i = 0; i < headers.size(); i++)
+    {
+        output += headers[i].first + ": " + headers[i].second + "\n";
+    }
+    return output;
+}
+
+// 解码一个header块,返回拼接起来的header,出错时返回<error>
+static std::string Decode(HpackDecoder* decoder, const char* hex)
+{
+    HeaderList headers;
+    if(decoder->Decode(Hex(hex), &headers) < 0)
+    {
+        return "<error>";
+    }
+    return Join(headers);
+}
+
+static std::string DecodeOnce(const char* hex)
+{
+    HpackDecoder decoder;
+    return Decode(&decoder, hex);
+}
+
+static const char* kRequest1 =
+    ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n";
+static const char* kRequest2 =
+    ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\ncache-control: no-cache\n";
+static const char* kRequest3 =
+    ":method: GET\n:scheme: https\n:path: /index.html\n:authority: www.example.com\ncustom-key: custom-value\n";
+static const char* kResponse1 =
+    ":status: 302\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\n"
+    "location: https://www.example.com\n";
+static const char* kResponse2 =
+    ":status: 307\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\n"
+    "location: https://www.example.com\n";
+static const char* kResponse3 =
+    ":status: 200\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:22 GMT\n"
+    "location: https://www.example.com\ncontent-encoding: gzip\n"
+    "set-cookie: foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1\n";
+
+TEST(RfcC2SingleFields)
+{
+    EXPECT_EQ("custom-key: custom-header\n",
+              DecodeOnce("400a637573746f6d2d6b65790d637573746f6d2d686561646572"));
+    EXPECT_EQ(":path: /sample/path\n", DecodeOnce("040c2f73616d706c652f70617468"));
+    EXPECT_EQ("password: secret\n", DecodeOnce("100870617373776f726406736563726574"));
+    EXPECT_EQ(":method: GET\n", DecodeOnce("82"));
+}
+
+TEST(RfcC3RequestsWithoutHuffman)
+{
+    HpackDecoder decoder;
+    EXPECT_EQ(kRequest1, Decode(&decoder, "828684410f7777772e6578616d706c652e636f6d"));
+    EXPECT_EQ(kRequest2, Decode(&decoder, "828684be58086e6f2d6361636865"));
+    EXPECT_EQ(kRequest3, Decode(&decoder, "828785bf400a637573746f6d2d6b65790c637573746f6d2d76616c7565"));
+}
+
+TEST(RfcC4RequestsWithHuffman)
+{
+    HpackDecoder decoder;
+    EXPECT_EQ(kRequest1, Decode(&decoder, "828684418cf1e3c2e5f23a6ba0ab90f4ff"));
+    EXPECT_EQ(kRequest2, Decode(&decoder, "828684be5886a8eb10649cbf"));
+    EXPECT_EQ(kRequest3, Decode(&decoder, "828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf"));
+}
+
+// C.5和C.6中动态表的大小是256,第一个header块前面加上一个大小更新(3fe101)
+TEST(RfcC5ResponsesWithoutHuffman)
+{
+    HpackDecoder decoder;
+    EXPECT_EQ(kResponse1, Decode(&decoder,
+        "3fe101"
+        "4803333032580770726976617465611d4d6f6e2c203231204f637420323031332032303a31333a323120474d54"
+        "6e1768747470733a2f2f7777772e6578616d706c652e636f6d"));
+    EXPECT_EQ(kResponse2, Decode(&decoder, "4803333037c1c0bf"));
+    //这个header块会淘汰掉动态表中最老的几项,之后的下标必须和编码方一致
+    EXPECT_EQ(kResponse3, Decode(&decoder,
+        "88c1611d4d6f6e2c203231204f637420323031332032303a31333a323220474d54c05a04677a6970"
+        "7738666f6f3d4153444a4b48514b425a584f5157454f50495541585157454f49553b206d61782d61"
+        "67653d333630303b2076657273696f6e3d31"));
+}
+
+TEST(RfcC6ResponsesWithHuffman)
+{
+    HpackDecoder decoder;
+    EXPECT_EQ(kResponse1, Decode(&decoder,
+        "3fe101"
+        "488264025885aec3771a4b6196d07abe941054d444a8200595040b8166e082a62d1bff6e919d29ad"
+        "171863c78f0b97c8e9ae82ae43d3"));
+    EXPECT_EQ(kResponse2, Decode(&decoder, "4883640effc1c0bf"));
+    EXPECT_EQ(kResponse3, Decode(&decoder,
+        "88c16196d07abe941054d444a8200595040b8166e084a62d1bffc05a839bd9ab77ad94e7821dd7f2"
+        "e6c7b335dfdfcd5b3960d5af27087f3672c1ab270fb5291f9587316065c003ed4ee5b1063d5007"));
+}
+
+TEST(HuffmanPadding)
+{
+    //'0'的编码是00000,后面3位填充全是1,合法
+    EXPECT_EQ("0: \n", DecodeOnce("00810700"));
+    //填充不是全1
+    EXPECT_EQ("<error>", DecodeOnce("00810000"));
+    EXPECT_EQ("<error>", DecodeOnce("00810600"));
+    //填充超过7位: '0'之后跟了11个1
+    EXPECT_EQ("<error>", DecodeOnce("008207ff00"));
+    //只有填充,整整一个字节的1也超过了7位
+    EXPECT_EQ("<error>", DecodeOnce("0081ff00"));
+    //30位全1是EOS,不能出现在字符串中
+    EXPECT_EQ("<error>", DecodeOnce("0084ffffffff00"));
+}
+
+TEST(MalformedBlocks)
+{
+    //下标0和超出范围的下标
+    EXPECT_EQ("<error>", DecodeOnce("80"));
+    EXPECT_EQ("<error>", DecodeOnce("be"));
+    //整数的续接字节太多
+    EXPECT_EQ("<error>", DecodeOnce("ffffffffffffff7f"));
+    //整数或者字符串被截断
+    EXPECT_EQ("<error>", DecodeOnce("ff"));
+    EXPECT_EQ("<error>", DecodeOnce("400a6375"));
+    EXPECT_EQ("<error>", DecodeOnce("40"));
+    //动态表大小更新只能出现在开头,并且不能超过SETTINGS_HEADER_TABLE_SIZE
+    EXPECT_EQ("<error>", DecodeOnce("823fe101"));
+    EXPECT_EQ("<error>", DecodeOnce("3fe21f"));
+    EXPECT_EQ(":method: GET\n", DecodeOnce("3fe10182"));
+}
+
+TEST(HeaderListSizeLimit)
+{
+    //加入一个4000字节的header,然后反复引用它
+    std::string block = Hex("4001") + "x";
+    std::string value(4000, 'v');
+    HpackEncoder::EncodeInt(value.size(), 7, 0, &block);
+    block += value;
+    for(int i = 0; i < 100; i++)
+    {
+        block.push_back((char)0xbe);
+    }
+    HpackDecoder unlimited;
+    HeaderList headers;
+    EXPECT_EQ(0, unlimited.Decode(block, &headers));
+    EXPECT_EQ((size_t)101, headers.size());
+
+    HpackDecoder decoder;
+    decoder.SetMaxHeaderListSize(64 * 1024);
+    headers.clear();
+    int ret = decoder.Decode(block, &headers);
+    int too_large = HpackDecoder::kHeaderListTooLarge;
+    EXPECT_EQ(too_large, ret);
+    //超过上限之前就停下来,不会把整个列表展开
+    EXPECT_TRUE(headers.size() * (4000 + 1 + 32) <= 64 * 1024);
+
+    //正好在上限之内的header块可以正常解码
+    HpackDecoder exact;
+    exact.SetMaxHeaderListSize(4 * (4000 + 1 + 32));
+    std::string small = block.substr(0, block.size() - 97);
+    headers.clear();
+    EXPECT_EQ(0, exact.Decode(small, &headers));
+    EXPECT_EQ((size_t)4, headers.size());
+}
+
+TEST(EncoderRoundTrip)
+{
+    HpackEncoder encoder;
+    HpackDecoder decoder;
+    HeaderList headers;
+    headers.push_back(HeaderField(":status", "200"));
+    headers.push_back(HeaderField("content-type", "text/html"));
+    headers.push_back(HeaderField("content-length", "12345"));
+    headers.push_back(HeaderField("x-custom", std::string(300, 'a')));
+    for(int round = 0; round < 3; round++)
+    {
+        std::string block;
+        encoder.Encode(headers, &block);
+        HeaderList decoded;
+        EXPECT_EQ(0, decoder.Decode(block, &decoded));
+        EXPECT_EQ(Join(headers), Join(decoded));
+    }
+}
+
+int main()
+{
+    return unit_test::RunAll();
+}
@@ -0,0 +1,1191 @@
+#include"http2_session.h"
+#include"http_server.h"
+#include"util.hpp"
+#include"connection.h"
+#include"event_loop.h"
+#include<errno.h>
+#include<string.h>
+#include<ctype.h>
+#include<algorithm>
+
+namespace http_server{
+
+// 客户端连接前言,prior knowledge方式下ReadOneRequest已经按HTTP/1.1的格式读掉了前面的部分
+static const char kClientPreface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+static const uint32_t kMaxFrameSize = 16384;       //我们能接收的最大帧
+static const uint32_t kMaxConcurrentStreams = 100;
+//一个连接上同时执行的处理协程,其余接收完整的stream排队等待
+static const size_t kMaxActiveHandlers = 16;
+static const uint32_t kDefaultWindow = 65535;
+static const int64_t kMaxWindow = 0x7FFFFFFF;
+static const size_t kMaxHeaderBlock = 64 * 1024;
+static const uint32_t kMaxHeaderListSize = 64 * 1024;  //解码之后的header列表的上限
+static const size_t kMaxRequestBody = 10 * 1024 * 1024;
+//接收方向的流量控制: 还没有交给处理逻辑的请求body整个连接最多缓存kMaxBufferedBody,
+//连接的接收窗口加上已经缓存的body不超过这个值,对方只能等缓存的请求被处理掉才能继续发送
+static const size_t kMaxBufferedBody = 16 * 1024 * 1024;
+static const int64_t kConnRecvWindow = 1024 * 1024;   //连接接收窗口的目标大小
+//连接不能无限期地保持
+//没有进行中的stream超过kIdleTimeoutMs(PING之类的帧不算),或者有stream但这么久没有收到任何帧,就关闭连接
+//连接建立超过kMaxLifetimeMs之后发送GOAWAY,不再接受新的stream,处理完已有的stream就关闭
+static const int64_t kIdleTimeoutMs = 10 * 1000;
+static const int64_t kMaxLifetimeMs = 120 * 1000;
+//一个帧的第一个字节到达之后,必须在这个时间内收完整个帧
+static const int64_t kFrameTimeoutMs = 10 * 1000;
+//等待新的帧时至少每隔这么久检查一次服务器是否在退出
+static const int64_t kStopCheckMs = 1000;
+//输出缓冲区超过这个大小就先写到socket,读协程也要等写协程把它写出去才继续读新的帧
+static const size_t kMaxOutBuffer = 64 * 1024;
+
+static uint32_t ReadUint32(const char* p)
+{
+    const unsigned char* u = (const unsigned char*)p;
+    return ((uint32_t)u[0] << 24) | ((uint32_t)u[1] << 16) | ((uint32_t)u[2] << 8) | u[3];
+}
+
+static void WriteUint32(uint32_t value, char* p)
+{
+    p[0] = (char)(value >> 24);
+    p[1] = (char)(value >> 16);
+    p[2] = (char)(value >> 8);
+    p[3] = (char)value;
+}
+
+// 构造9个字节的帧头: 长度(24位) 类型(8位) 标志(8位) stream id(31位)
+static void BuildFrameHead(size_t len, uint8_t type, uint8_t flags, uint32_t stream_id, char* head)
+{
+    head[0] = (char)(len >> 16);
+    head[1] = (char)(len >> 8);
+    head[2] = (char)len;
+    head[3] = (char)type;
+    head[4] = (char)flags;
+    WriteUint32(stream_id, head + 5);
+}
+
+// HTTP2-Settings中是base64url编码(不带填充)的SETTINGS帧payload
+static int Base64UrlDecode(const std::string& input, std::string* output)
+{
+    output->clear();
+    uint32_t buf = 0;
+    int bits = 0;
+    for(size_t i = 0; i < input.size(); i++)
+    {
+        char c = input[i];
+        int value = 0;
+        if(c >= 'A' && c <= 'Z') value = c - 'A';
+        else if(c >= 'a' && c <= 'z') value = c - 'a' + 26;
+        else if(c >= '0' && c <= '9') value = c - '0' + 52;
+        else if(c == '-' || c == '+') value = 62;
+        else if(c == '_' || c == '/') value = 63;
+        else if(c == '=') break;
+        else return -1;
+        buf = (buf << 6) | value;
+        bits += 6;
+        if(bits >= 8)
+        {
+            bits -= 8;
+            output->push_back((char)(buf >> bits));
+        }
+    }
+    return 0;
+}
+
+// HTTP/2的header名字都是小写的,转换成HTTP/1.1习惯的写法(content-length -> Content-Length)
+// 这样处理请求的代码按照原来的名字查找header就可以了
+static std::string CanonicalHeaderName(const std::string& name)
+{
+    std::string result = name;
+    bool upper = true;
+    for(size_t i = 0; i < result.size(); i++)
+    {
+        result[i] = upper ? toupper(result[i]) : tolower(result[i]);
+        upper = result[i] == '-';
+    }
+    return result;
+}
+
+static std::string LowerHeaderName(const std::string& name)
+{
+    std::string result = name;
+    for(size_t i = 0; i < result.size(); i++)
+    {
+        result[i] = tolower(result[i]);
+    }
+    return result;
+}
+
+// 这些header只对HTTP/1.1的连接有意义,HTTP/2中禁止出现
+static bool IsConnectionHeader(const std::string& name)
+{
+    return name == "connection" || name == "keep-alive" || name == "proxy-connection"
+        || name == "transfer-encoding" || name == "upgrade";
+}
+
+Http2Session::Stream::Stream()
+    :id(0)
+    ,send_window(kDefaultWindow)
+    ,recv_window(kDefaultWindow)
+    ,request_done(false)
+    ,handed(false)
+    ,data(NULL)
+    ,file_fd(-1)
+    ,body_len(0)
+    ,sent(0)
+    ,responding(false)
+    ,processing(false)
+    ,writing(false)
+    ,closed(false)
+{}
+
+Http2Session::Http2Session(HttpServer* server, Context* context)
+    :server_(server)
+    ,context_(context)
+    ,conn_(context->conn)
+    ,active_handlers_(0)
+    ,starting_(false)
+    ,writer_running_(false)
+    ,closing_(false)
+    ,failed_(false)
+    ,last_stream_id_(0)
+    ,conn_send_window_(kDefaultWindow)
+    ,conn_recv_window_(kDefaultWindow)
+    ,buffered_body_(0)
+    ,peer_initial_window_(kDefaultWindow)
+    ,peer_max_frame_size_(16384)
+    ,goaway_received_(false)
+    ,goaway_sent_(false)
+    ,start_ms_(TimeUtil::MonotonicMS())
+    ,idle_since_ms_(start_ms_)
+    ,header_stream_id_(0)
+    ,header_flags_(0)
+    ,header_refused_(false)
+{
+    decoder_.SetMaxHeaderListSize(kMaxHeaderListSize);
+}
+
+Http2Session::~Http2Session()
+{}
+
+bool Http2Session::IsUpgrade(const Context* context)
+{
+    const Header& header = context->req.header;
+    Header::const_iterator it = header.find("Upgrade");
+    return it != header.end() && it->second.find("h2c") != std::string::npos
+        && header.find("HTTP2-Settings") != header.end();
+}
+
+Task<int> Http2Session::Run()
+{
+    int ret = co_await Serve();
+    //不再处理新的请求,等正在执行的处理协程结束
+    //连接出错时输出缓冲区中可能还有GOAWAY,由写协程尽量发给对方
+    closing_ = true;
+    if(!writer_running_ && !failed_ && co_await FlushOut() < 0)
+    {
+        ret = -1;
+    }
+    Notify(&writer_event_);
+    while(active_handlers_ > 0 || writer_running_)
+    {
+        co_await WaitFor(&idle_event_);
+    }
+    co_return failed_ ? -1 : ret;
+}
+
+Task<int> Http2Session::Serve()
+{
+    if(!context_->http2)
+    {
+        //1.从HTTP/1.1升级: 先回复101,升级请求本身成为stream 1,并且已经是half-closed(remote)状态
+        out_ = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+        std::string settings;
+        Header::const_iterator it = context_->req.header.find("HTTP2-Settings");
+        if(Base64UrlDecode(it->second, &settings) < 0 || ApplySettings(settings) < 0)
+        {
+            co_return -1;
+        }
+        if(SendSettings() < 0 || co_await FlushOut() < 0)
+        {
+            co_return -1;
+        }
+        //客户端收到101之后还是要发送完整的连接前言
+        std::string preface;
+        conn_->SetDeadline(TimeUtil::MonotonicMS() + kFrameTimeoutMs);
+        if(co_await conn_->ReadN(sizeof(kClientPreface) - 1, &preface) < 0 || preface != kClientPreface)
+        {
+            LOG(ERROR) << "Invalid HTTP/2 client preface after upgrade!\n";
+            co_return -1;
+        }
+        Stream* stream = NewStream(1);
+        stream->request_done = true;
+        stream->handed = true;
+        stream->context->req = context_->req;
+        last_stream_id_ = 1;
+        pending_streams_.push_back(1);
+    }
+    else if(SendSettings() < 0)
+    {
+        //2.prior knowledge,连接前言已经读完了
+        co_return -1;
+    }
+    //连接的接收窗口从默认的64KB扩大到kConnRecvWindow
+    if(ReplenishConnWindow() < 0)
+    {
+        co_return -1;
+    }
+    //握手完成之后的输出都交给写协程,它的帧从堆上分配,和读协程的生命周期无关
+    writer_running_ = true;
+    {
+        FramePoolScope scope(NULL);
+        conn_->Loop()->Spawn(WriteLoop(), NULL);
+    }
+    StartHandlers();
+
+    while(true)
+    {
+        if(failed_)
+        {
+            co_return -1;
+        }
+        //处理上一批帧产生的输出(SETTINGS ACK、WINDOW_UPDATE等)交给写协程
+        Notify(&writer_event_);
+        if(out_.size() >= kMaxOutBuffer)
+        {
+            //对方不读数据时不能无限地缓存要发给它的帧
+            co_await WaitFor(&drain_event_);
+            continue;
+        }
+        if((goaway_received_ || goaway_sent_) && streams_.empty())
+        {
+            co_return 0;
+        }
+        int64_t now = TimeUtil::MonotonicMS();
+        if(!streams_.empty())
+        {
+            idle_since_ms_ = now;
+        }
+        if(!goaway_sent_ && (now - start_ms_ >= kMaxLifetimeMs || conn_->Loop()->IsStopping()))
+        {
+            //告诉客户端已经处理到哪个stream了,之后的请求需要换一个连接重新发送
+            goaway_sent_ = true;
+            if(SendGoaway(H2_NO_ERROR) < 0)
+            {
+                co_return -1;
+            }
+            continue;
+        }
+        if(!conn_->HasBuffered())
+        {
+            //等待下一个帧,期间不占用事件循环线程
+            conn_->SetDeadline(std::min(idle_since_ms_ + kIdleTimeoutMs, now + kStopCheckMs));
+            int ret = co_await conn_->Read();
+            if(ret == -ETIMEDOUT)
+            {
+                if(TimeUtil::MonotonicMS() < idle_since_ms_ + kIdleTimeoutMs)
+                {
+                    continue;
+                }
+                SendGoaway(H2_NO_ERROR);
+                co_return 0;
+            }
+            if(ret <= 0)
+            {
+                co_return 0;
+            }
+        }
+        //把已经到达的帧都处理完再唤醒写协程,同时到达的多个请求就能交错发送
+        do
+        {
+            Http2Frame frame;
+            conn_->SetDeadline(TimeUtil::MonotonicMS() + kFrameTimeoutMs);
+            if(co_await ReadFrame(&frame) < 0)
+            {
+                co_return 0;
+            }
+            if(HandleFrame(&frame) < 0)
+            {
+                co_return -1;
+            }
+            StartHandlers();
+        }while(conn_->HasBuffered());
+    }
+    co_return 0;
+}
+
+// 创建一个新的stream,每个stream有自己的Context,和HTTP/1.1的一次请求一样
+Http2Session::Stream* Http2Session::NewStream(uint32_t id)
+{
+    Stream* stream = new Stream();
+    stream->id = id;
+    stream->send_window = peer_initial_window_;
+    stream->context.reset(new Context());
+    stream->context->conn = conn_;
+    stream->context->peer_ip = context_->peer_ip;
+    stream->context->server = server_;
+    streams_[id].reset(stream);
+    return stream;
+}
+
+Task<int> Http2Session::ReadFrame(Http2Frame* frame)
+{
+    std::string head;
+    if(co_await conn_->ReadN(9, &head) < 0)
+    {
+        co_return -1;
+    }
+    uint32_t length = ((uint32_t)(unsigned char)head[0] << 16)
+                    | ((uint32_t)(unsigned char)head[1] << 8) | (unsigned char)head[2];
+    frame->type = head[3];
+    frame->flags = head[4];
+    frame->stream_id = ReadUint32(head.data() + 5) & 0x7FFFFFFF;
+    if(length > kMaxFrameSize)
+    {
+        co_return ConnectionError(H2_FRAME_SIZE_ERROR);
+    }
+    co_return co_await conn_->ReadN(length, &frame->payload);
+}
+
+int Http2Session::HandleFrame(Http2Frame* frame)
+{
+    //HEADERS后面没有END_HEADERS时,下一个帧必须是同一个stream的CONTINUATION
+    if(header_stream_id_ != 0
+       && (frame->type != H2_CONTINUATION || frame->stream_id != header_stream_id_))
+    {
+        return ConnectionError(H2_PROTOCOL_ERROR);
+    }
+    switch(frame->type)
+    {
+    case H2_DATA:
+        return HandleData(frame);
+    case H2_HEADERS:
+        return HandleHeaders(frame);
+    case H2_CONTINUATION:
+        if(header_stream_id_ == 0)
+        {
+            return ConnectionError(H2_PROTOCOL_ERROR);
+        }
+        header_block_ += frame->payload;
+        if(header_block_.size() > kMaxHeaderBlock)
+        {
+            return ConnectionError(H2_ENHANCE_YOUR_CALM);
+        }
+        if(frame->flags & H2_FLAG_END_HEADERS)
+        {
+            return FinishHeaderBlock();
+        }
+        return 0;
+    case H2_PRIORITY:
+        //只按照轮转的方式发送,忽略优先级
+        if(frame->stream_id == 0 || frame->payload.size() != 5)
+        {
+            return ConnectionError(H2_PROTOCOL_ERROR);
+        }
+        return 0;
+    case H2_RST_STREAM:
+        if(frame->stream_id == 0 || frame->payload.size() != 4)
+        {
+            return ConnectionError(H2_PROTOCOL_ERROR);
+        }
+        EraseStream(frame->stream_id);
+        return ReplenishConnWindow();
+    case H2_SETTINGS:
+        return HandleSettings(*frame);
+    case H2_PING:
+        if(frame->stream_id != 0 || frame->payload.size() != 8)
+        {
+            return ConnectionError(H2_PROTOCOL_ERROR);
+        }
+        if(frame->flags & H2_FLAG_ACK)
+        {
+            return 0;
+        }
+        return SendFrame(H2_PING, H2_FLAG_ACK, 0, frame->payload.data(), frame->payload.size());
+    case H2_GOAWAY:
+        //不再接受新的stream,已经在处理的stream发送完再关闭连接
+        goaway_received_ = true;
+        return 0;
+    case H2_WINDOW_UPDATE:
+        return HandleWindowUpdate(*frame);
+    case H2_PUSH_PROMISE:
+        //客户端不能发送PUSH_PROMISE
+        return ConnectionError(H2_PROTOCOL_ERROR);
+    default:
+        //不认识的帧类型必须忽略
+        return 0;
+    }
+}
+
+// 去掉PADDED标志带来的填充,返回-1表示填充长度不合法
+static int StripPadding(Http2Frame* frame)
+{
+    if(!(frame->flags & H2_FLAG_PADDED))
+    {
+        return 0;
+    }
+    if(frame->payload.empty())
+    {
+        return -1;
+    }
+    size_t pad = (unsigned char)frame->payload[0];
+    if(pad + 1 > frame->payload.size())
+    {
+        return -1;
+    }
+    frame->payload = frame->payload.substr(1, frame->payload.size() - 1 - pad);
+    return 0;
+}
+
+int Http2Session::HandleHeaders(Http2Frame* frame)
+{
+    uint32_t id = frame->stream_id;
+    if(id == 0 || id % 2 == 0 || StripPadding(frame) < 0)
+    {
+        return ConnectionError(H2_PROTOCOL_ERROR);
+    }
+    if(frame->flags & H2_FLAG_PRIORITY)
+    {
+        if(frame->payload.size() < 5)
+        {
+            return ConnectionError(H2_PROTOCOL_ERROR);
+        }
+        frame->payload.erase(0, 5);
+    }
+    header_refused_ = false;
+    StreamMap::iterator it = streams_.find(id);
+    if(it == streams_.end())
+    {
+        //新的stream,id必须比之前的都大
+        if(id <= last_stream_id_)
+        {
+            return ConnectionError(H2_PROTOCOL_ERROR);
+        }
+        last_stream_id_ = id;
+        //header块仍然要解码,否则HPACK的动态表会和对方不一致
+        header_refused_ = goaway_received_ || goaway_sent_ || streams_.size() >= kMaxConcurrentStreams;
+        if(!header_refused_)
+        {
+            NewStream(id);
+        }
+    }
+    else if(it->second->request_done)
+    {
+        return ConnectionError(H2_STREAM_CLOSED);
+    }
+    header_stream_id_ = id;
+    header_flags_ = frame->flags;
+    header_block_ = frame->payload;
+    if(frame->flags & H2_FLAG_END_HEADERS)
+    {
+        return FinishHeaderBlock();
+    }
+    return 0;
+}
+
+int Http2Session::FinishHeaderBlock()
+{
+    uint32_t id = header_stream_id_;
+    header_stream_id_ = 0;
+    HeaderList headers;
+    int ret = decoder_.Decode(header_block_, &headers);
+    if(ret == HpackDecoder::kHeaderListTooLarge)
+    {
+        LOG(ERROR) << "HTTP/2 header list too large! stream=" << id << "\n";
+        return ConnectionError(H2_ENHANCE_YOUR_CALM);
+    }
+    if(ret < 0)
+    {
+        LOG(ERROR) << "HPACK decode error! stream=" << id << "\n";
+        return ConnectionError(H2_COMPRESSION_ERROR);
+    }
+    header_block_.clear();
+    if(header_refused_)
+    {
+        return SendRstStream(id, H2_REFUSED_STREAM);
+    }
+    Stream* stream = streams_[id].get();
+    //收到body之后的第二个header块是trailer,忽略里面的内容
+    if(stream->headers.empty())
+    {
+        stream->headers.swap(headers);
+    }
+    if(header_flags_ & H2_FLAG_END_STREAM)
+    {
+        stream->request_done = true;
+        pending_streams_.push_back(id);
+    }
+    return 0;
+}
+
+int Http2Session::HandleData(Http2Frame* frame)
+{
+    uint32_t id = frame->stream_id;
+    if(id == 0)
+    {
+        return ConnectionError(H2_PROTOCOL_ERROR);
+    }
+    //接收窗口按照整个帧的长度(包括填充)计算,对方必须遵守我们给出的窗口,否则缓存就没有上限了
+    uint32_t length = frame->payload.size();
+    if(StripPadding(frame) < 0)
+    {
+        return ConnectionError(H2_PROTOCOL_ERROR);
+    }
+    if(length > conn_recv_window_)
+    {
+        return ConnectionError(H2_FLOW_CONTROL_ERROR);
+    }
+    conn_recv_window_ -= length;
+    StreamMap::iterator it = streams_.find(id);
+    if(it == streams_.end() || it->second->request_done || it->second->headers.empty())
+    {
+        //数据直接丢弃,连接窗口的额度马上可以还给对方
+        if(SendRstStream(id, H2_STREAM_CLOSED) < 0)
+        {
+            return -1;
+        }
+        return ReplenishConnWindow();
+    }
+    Stream* stream = it->second.get();
+    std::string& body = stream->context->req.body;
+    uint32_t error = H2_NO_ERROR;
+    if(length > stream->recv_window)
+    {
+        error = H2_FLOW_CONTROL_ERROR;
+    }
+    else if(body.size() + frame->payload.size() > kMaxRequestBody)
+    {
+        error = H2_ENHANCE_YOUR_CALM;
+    }
+    if(error != H2_NO_ERROR)
+    {
+        EraseStream(id);
+        if(SendRstStream(id, error) < 0)
+        {
+            return -1;
+        }
+        return ReplenishConnWindow();
+    }
+    stream->recv_window -= length;
+    body += frame->payload;
+    buffered_body_ += frame->payload.size();
+    if(frame->flags & H2_FLAG_END_STREAM)
+    {
+        stream->request_done = true;
+        pending_streams_.push_back(id);
+    }
+    else
+    {
+        //stream的窗口在数据放进body之后才补充,最多补到body的上限为止
+        int64_t target = std::min<int64_t>(kDefaultWindow, kMaxRequestBody - body.size());
+        if(stream->recv_window < target / 2 || stream->recv_window == 0)
+        {
+            if(target > stream->recv_window && SendWindowUpdate(id, target - stream->recv_window) < 0)
+            {
+                return -1;
+            }
+            stream->recv_window = std::max(stream->recv_window, target);
+        }
+    }
+    //填充和已经缓存的body都算在连接的额度里,额度够的时候才补充连接窗口
+    return ReplenishConnWindow();
+}
+
+// 补充连接的接收窗口,保证窗口加上已经缓存的body不超过kMaxBufferedBody
+// 窗口剩下不到目标的一半时才发送WINDOW_UPDATE,避免每个DATA帧都回一个
+int Http2Session::ReplenishConnWindow()
+{
+    int64_t target = std::min<int64_t>(kConnRecvWindow, (int64_t)kMaxBufferedBody - (int64_t)buffered_body_);
+    if(target <= conn_recv_window_ || (conn_recv_window_ >= target / 2 && conn_recv_window_ > 0))
+    {
+        return 0;
+    }
+    uint32_t increment = target - conn_recv_window_;
+    conn_recv_window_ = target;
+    return SendWindowUpdate(0, increment);
+}
+
+// 删除一个stream,它还没有交给处理逻辑的body不再占用连接的额度
+// 处理协程或者写协程还在使用的stream只标记为closed,由它们用完之后删除
+void Http2Session::EraseStream(uint32_t id)
+{
+    StreamMap::iterator it = streams_.find(id);
+    if(it == streams_.end())
+    {
+        return;
+    }
+    Stream* stream = it->second.get();
+    if(!stream->handed)
+    {
+        stream->handed = true;
+        buffered_body_ -= stream->context->req.body.size();
+    }
+    if(stream->processing || stream->writing)
+    {
+        stream->closed = true;
+        return;
+    }
+    streams_.erase(it);
+}
+
+int Http2Session::HandleSettings(const Http2Frame& frame)
+{
+    if(frame.stream_id != 0)
+    {
+        return ConnectionError(H2_PROTOCOL_ERROR);
+    }
+    if(frame.flags & H2_FLAG_ACK)
+    {
+        if(!frame.payload.empty())
+        {
+            return ConnectionError(H2_FRAME_SIZE_ERROR);
+        }
+        return 0;
+    }
+    if(ApplySettings(frame.payload) < 0)
+    {
+        return -1;
+    }
+    return SendFrame(H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+}
+
+int Http2Session::ApplySettings(const std::string& payload)
+{
+    if(payload.size() % 6 != 0)
+    {
+        return ConnectionError(H2_FRAME_SIZE_ERROR);
+    }
+    for(size_t i = 0; i < payload.size(); i += 6)
+    {
+        uint16_t id = ((unsigned char)payload[i] << 8) | (unsigned char)payload[i + 1];
+        uint32_t value = ReadUint32(payload.data() + i + 2);
+        switch(id)
+        {
+        case H2_SETTINGS_HEADER_TABLE_SIZE:
+            encoder_.SetMaxCapacity(value);
+            break;
+        case H2_SETTINGS_ENABLE_PUSH:
+            if(value > 1)
+            {
+                return ConnectionError(H2_PROTOCOL_ERROR);
+            }
+            break;
+        case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+        {
+            if(value > kMaxWindow)
+            {
+                return ConnectionError(H2_FLOW_CONTROL_ERROR);
+            }
+            //修改初始窗口会影响所有已经存在的stream
+            int64_t delta = (int64_t)value - peer_initial_window_;
+            for(StreamMap::iterator it = streams_.begin(); it != streams_.end(); ++it)
+            {
+                it->second->send_window += delta;
+                if(it->second->send_window > kMaxWindow)
+                {
+                    return ConnectionError(H2_FLOW_CONTROL_ERROR);
+                }
+            }
+            peer_initial_window_ = value;
+            break;
+        }
+        case H2_SETTINGS_MAX_FRAME_SIZE:
+            if(value < 16384 || value > 16777215)
+            {
+                return ConnectionError(H2_PROTOCOL_ERROR);
+            }
+            peer_max_frame_size_ = value;
+            break;
+        default:
+            break;
+        }
+    }
+    return 0;
+}
+
+int Http2Session::HandleWindowUpdate(const Http2Frame& frame)
+{
+    if(frame.payload.size() != 4)
+    {
+        return ConnectionError(H2_FRAME_SIZE_ERROR);
+    }
+    uint32_t increment = ReadUint32(frame.payload.data()) & 0x7FFFFFFF;
+    if(frame.stream_id == 0)
+    {
+        if(increment == 0)
+        {
+            return ConnectionError(H2_PROTOCOL_ERROR);
+        }
+        conn_send_window_ += increment;
+        if(conn_send_window_ > kMaxWindow)
+        {
+            return ConnectionError(H2_FLOW_CONTROL_ERROR);
+        }
+        return 0;
+    }
+    StreamMap::iterator it = streams_.find(frame.stream_id);
+    if(it == streams_.end() || it->second->closed)
+    {
+        //已经发送完毕的stream还可能收到WINDOW_UPDATE,直接忽略
+        return 0;
+    }
+    it->second->send_window += increment;
+    if(increment == 0 || it->second->send_window > kMaxWindow)
+    {
+        uint32_t error = increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR;
+        EraseStream(frame.stream_id);
+        if(SendRstStream(frame.stream_id, error) < 0)
+        {
+            return -1;
+        }
+        return ReplenishConnWindow();
+    }
+    return 0;
+}
+
+// 启动等待处理的stream,同时执行的处理协程不超过kMaxActiveHandlers个
+// 处理协程的帧从堆上分配,读协程可以继续读帧,写协程可以继续发送其他stream的DATA
+void Http2Session::StartHandlers()
+{
+    if(starting_)
+    {
+        return;
+    }
+    starting_ = true;
+    while(!pending_streams_.empty() && active_handlers_ < kMaxActiveHandlers && !closing_ && !failed_)
+    {
+        uint32_t id = pending_streams_.front();
+        pending_streams_.pop_front();
+        StreamMap::iterator it = streams_.find(id);
+        if(it == streams_.end() || it->second->closed)
+        {
+            continue;
+        }
+        Stream* stream = it->second.get();
+        stream->processing = true;
+        ++active_handlers_;
+        FramePoolScope scope(NULL);
+        conn_->Loop()->Spawn(HandleStream(stream), NULL);
+    }
+    starting_ = false;
+}
+
+// 一个stream的处理协程,结束之后启动下一个排队的stream,并唤醒写协程发送响应
+Task<void> Http2Session::HandleStream(Stream* stream)
+{
+    int ret = co_await ProcessStream(stream);
+    if(ret < 0)
+    {
+        failed_ = true;
+    }
+    stream->processing = false;
+    if(stream->closed)
+    {
+        streams_.erase(stream->id);
+    }
+    --active_handlers_;
+    StartHandlers();
+    Notify(&writer_event_);
+    Notify(&idle_event_);
+}
+
+// 一个stream的请求已经完整接收,把它转换成Request交给HttpServer处理,然后发送响应的HEADERS
+Task<int> Http2Session::ProcessStream(Stream* stream)
+{
+    //每个stream作为一个请求追踪,从header块接收完整开始,到响应的HEADERS发出为止
+    Context* context = stream->context.get();
+    TraceRequest trace(&context->trace, Tracer::NowUs());
+    Request* req = &context->req;
+    //body交给处理逻辑之后不再算在缓存的额度里,连接窗口可以补充了
+    if(!stream->handed)
+    {
+        stream->handed = true;
+        buffered_body_ -= req->body.size();
+        if(ReplenishConnWindow() < 0)
+        {
+            co_return -1;
+        }
+    }
+    //升级上来的stream 1已经有了Request,其他的stream从header中构造
+    if(!stream->headers.empty())
+    {
+        for(size_t i = 0; i < stream->headers.size(); i++)
+        {
+            const HeaderField& field = stream->headers[i];
+            if(field.first == ":method")
+            {
+                req->method = field.second;
+            }
+            else if(field.first == ":path")
+            {
+                req->url = field.second;
+            }
+            else if(field.first == ":authority")
+            {
+                req->header["Host"] = field.second;
+            }
+            else if(!field.first.empty() && field.first[0] != ':')
+            {
+                std::string name = CanonicalHeaderName(field.first);
+                Header::iterator it = req->header.find(name);
+                if(it != req->header.end())
+                {
+                    //同名的header(例如拆开的cookie)合并成一个
+                    it->second += field.first == "cookie" ? "; " : ", ";
+                    it->second += field.second;
+                }
+                else
+                {
+                    req->header[name] = field.second;
+                }
+            }
+        }
+        if(req->method.empty() || req->url.empty()
+           || server_->ParseUrl(req->url, &req->url_path, &req->query_string) < 0)
+        {
+            EraseStream(stream->id);
+            co_return SendRstStream(stream->id, H2_PROTOCOL_ERROR);
+        }
+        //HTTP/2中的body长度由DATA帧决定,content-length是可选的,CGI需要这个字段
+        if(req->method == "POST" && req->header.find("Content-Length") == req->header.end())
+        {
+            req->header["Content-Length"] = std::to_string(req->body.size());
+        }
+    }
+    if(Tracer::IsActive())
+    {
+        Tracer::SetDetail("h2 " + req->method + " " + req->url);
+    }
+    if(co_await server_->HandlerRequest(context) < 0)
+    {
+        LOG(ERROR) << "HandlerRequest error! stream=" << stream->id << "\n";
+        context->resp = Response();
+        server_->Process404(context);
+    }
+
+    //计算的过程中对方取消了这个stream,或者连接已经要关闭了,响应不再发送
+    if(stream->closed || closing_)
+    {
+        EraseStream(stream->id);
+        co_return 0;
+    }
+    const Response& resp = context->resp;
+    if(resp.file)
+    {
+        stream->file_fd = resp.file->fd;
+        stream->body_len = resp.file->st.st_size;
+    }
+    else if(resp.mapped_body != NULL)
+    {
+        stream->data = resp.mapped_body;
+        stream->body_len = resp.mapped_len;
+    }
+    else if(resp.cgi_resp.empty())
+    {
+        stream->data = resp.body.data();
+        stream->body_len = resp.body.size();
+    }
+    HeaderList headers;
+    BuildResponseHeaders(stream, &headers);
+    stream->responding = true;
+    TraceSpan span("write_headers");
+    if(SendHeaders(stream->id, headers, stream->body_len == 0) < 0)
+    {
+        co_return -1;
+    }
+    if(stream->body_len == 0)
+    {
+        EraseStream(stream->id);
+    }
+    co_return 0;
+}
+
+// 把Response转换成HTTP/2的header列表
+// CGI程序的输出中header和body在一起,需要在这里拆开,body指向cgi_resp中空行之后的部分
+void Http2Session::BuildResponseHeaders(Stream* stream, HeaderList* headers)
+{
+    const Response& resp = stream->context->resp;
+    headers->push_back(HeaderField(":status", std::to_string(resp.code)));
+    Header header = resp.header;
+    if(!resp.cgi_resp.empty())
+    {
+        const std::string& output = resp.cgi_resp;
+        size_t start = 0;
+        while(start < output.size())
+        {
+            size_t end = output.find('\n', start);
+            if(end == std::string::npos)
+            {
+                end = output.size();
+            }
+            std::string line = output.substr(start, end - start);
+            start = end + 1;
+            if(!line.empty() && line[line.size() - 1] == '\r')
+            {
+                line.resize(line.size() - 1);
+            }
+            if(line.empty())
+            {
+                break;
+            }
+            size_t pos = line.find(':');
+            if(pos == std::string::npos)
+            {
+                continue;
+            }
+            size_t value_pos = line.find_first_not_of(' ', pos + 1);
+            header[line.substr(0, pos)] = value_pos == std::string::npos ? "" : line.substr(value_pos);
+        }
+        if(start > output.size())
+        {
+            start = output.size();
+        }
+        stream->data = output.data() + start;
+        stream->body_len = output.size() - start;
+        //CGI程序给出的长度不一定准确,以实际的body为准
+        header["Content-Length"] = std::to_string(stream->body_len);
+    }
+    for(Header::const_iterator it = header.begin(); it != header.end(); ++it)
+    {
+        std::string name = LowerHeaderName(it->first);
+        if(!IsConnectionHeader(name))
+        {
+            headers->push_back(HeaderField(name, it->second));
+        }
+    }
+}
+
+// 写协程: 只有它会写socket,有新的输出或者可以发送的DATA时被唤醒
+// Run结束时(closing_)只把输出缓冲区中剩下的帧写完,等所有的处理协程结束之后退出
+Task<void> Http2Session::WriteLoop()
+{
+    while(!failed_)
+    {
+        //g++ 12在返回Task<void>的协程中把co_await直接写在if条件里会破坏协程帧,先把结果取出来
+        int ret = co_await Flush();
+        if(ret < 0)
+        {
+            failed_ = true;
+            break;
+        }
+        Notify(&drain_event_);
+        if(!out_.empty() || HasDataToSend())
+        {
+            //写的过程中又有了新的输出或者窗口
+            continue;
+        }
+        if(closing_ && active_handlers_ == 0)
+        {
+            break;
+        }
+        co_await WaitFor(&writer_event_);
+    }
+    writer_running_ = false;
+    Notify(&drain_event_);
+    Notify(&idle_event_);
+}
+
+bool Http2Session::SendableStream(const Stream* stream)
+{
+    return !stream->closed && stream->responding && stream->sent < stream->body_len && stream->send_window > 0;
+}
+
+bool Http2Session::HasDataToSend() const
+{
+    if(closing_ || conn_send_window_ <= 0)
+    {
+        return false;
+    }
+    for(StreamMap::const_iterator it = streams_.begin(); it != streams_.end(); ++it)
+    {
+        if(SendableStream(it->second.get()))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 发送调度: 在所有还有数据没发完的stream之间轮转,每轮每个stream最多发一个DATA帧
+// 直到所有数据发送完毕,或者连接/stream的发送窗口用完
+// 发送的过程中会挂起,其他协程可能修改streams_,正在发送的stream标记为writing,不会被删除
+Task<int> Http2Session::Flush()
+{
+    bool progress = true;
+    while(progress && conn_send_window_ > 0 && !closing_)
+    {
+        progress = false;
+        StreamMap::iterator it = streams_.begin();
+        while(it != streams_.end() && conn_send_window_ > 0)
+        {
+            Stream* stream = it->second.get();
+            if(!SendableStream(stream))
+            {
+                ++it;
+                continue;
+            }
+            size_t len = stream->body_len - stream->sent;
+            len = std::min<size_t>(len, peer_max_frame_size_);
+            len = std::min<size_t>(len, stream->send_window);
+            len = std::min<size_t>(len, conn_send_window_);
+            bool end_stream = stream->sent + len == stream->body_len;
+            stream->writing = true;
+            int ret = co_await SendData(stream, len, end_stream);
+            stream->writing = false;
+            if(ret < 0)
+            {
+                co_return -1;
+            }
+            progress = true;
+            if(end_stream || stream->closed)
+            {
+                streams_.erase(it++);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+    co_return co_await FlushOut();
+}
+
+Task<int> Http2Session::FlushOut()
+{
+    if(out_.empty())
+    {
+        co_return 0;
+    }
+    //写的过程中读协程和处理协程还会追加新的帧,先换出来,新的帧留到下一次写
+    sending_.swap(out_);
+    struct iovec iov;
+    iov.iov_base = &sending_[0];
+    iov.iov_len = sending_.size();
+    int ret = co_await conn_->Write(&iov, 1);
+    sending_.clear();
+    co_return ret;
+}
+
+void Http2Session::Notify(std::shared_ptr<LoopEvent>* event)
+{
+    if(*event)
+    {
+        (*event)->Set();
+        event->reset();
+    }
+}
+
+IoAwaitable Http2Session::WaitFor(std::shared_ptr<LoopEvent>* event)
+{
+    *event = std::make_shared<LoopEvent>(conn_->Loop());
+    return (*event)->Wait(-1);
+}
+
+int Http2Session::SendFrame(uint8_t type, uint8_t flags, uint32_t stream_id, const char* payload, size_t len)
+{
+    char head[9];
+    BuildFrameHead(len, type, flags, stream_id, head);
+    out_.append(head, sizeof(head));
+    out_.append(payload, len);
+    return 0;
+}
+
+int Http2Session::SendSettings()
+{
+    char payload[12];
+    payload[0] = 0;
+    payload[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+    WriteUint32(kMaxConcurrentStreams, payload + 2);
+    payload[6] = 0;
+    payload[7] = H2_SETTINGS_MAX_HEADER_LIST_SIZE;
+    WriteUint32(kMaxHeaderListSize, payload + 8);
+    return SendFrame(H2_SETTINGS, 0, 0, payload, sizeof(payload));
+}
+
+// header块超过对方允许的最大帧长度时,拆成HEADERS + CONTINUATION
+int Http2Session::SendHeaders(uint32_t stream_id, const HeaderList& headers, bool end_stream)
+{
+    std::string block;
+    encoder_.Encode(headers, &block);
+    size_t offset = 0;
+    bool first = true;
+    do
+    {
+        size_t len = std::min<size_t>(block.size() - offset, peer_max_frame_size_);
+        uint8_t flags = offset + len == block.size() ? H2_FLAG_END_HEADERS : 0;
+        if(first && end_stream)
+        {
+            flags |= H2_FLAG_END_STREAM;
+        }
+        if(SendFrame(first ? H2_HEADERS : H2_CONTINUATION, flags, stream_id, block.data() + offset, len) < 0)
+        {
+            return -1;
+        }
+        offset += len;
+        first = false;
+    }while(offset < block.size());
+    return 0;
+}
+
+Task<int> Http2Session::SendData(Stream* stream, size_t len, bool end_stream)
+{
+    uint8_t flags = end_stream ? H2_FLAG_END_STREAM : 0;
+    int ret = 0;
+    if(stream->file_fd >= 0)
+    {
+        //文件中的数据不经过用户态,帧头和之前的帧写完之后直接sendfile
+        char head[9];
+        BuildFrameHead(len, H2_DATA, flags, stream->id, head);
+        out_.append(head, sizeof(head));
+        ret = co_await FlushOut();
+        if(ret == 0)
+        {
+            ret = co_await conn_->SendFile(stream->file_fd, stream->sent, len);
+        }
+    }
+    else
+    {
+        SendFrame(H2_DATA, flags, stream->id, stream->data + stream->sent, len);
+        if(out_.size() >= kMaxOutBuffer)
+        {
+            ret = co_await FlushOut();
+        }
+    }
+    if(ret < 0)
+    {
+        co_return -1;
+    }
+    stream->sent += len;
+    stream->send_window -= len;
+    conn_send_window_ -= len;
+    co_return 0;
+}
+
+int Http2Session::SendWindowUpdate(uint32_t stream_id, uint32_t increment)
+{
+    char payload[4];
+    WriteUint32(increment, payload);
+    return SendFrame(H2_WINDOW_UPDATE, 0, stream_id, payload, sizeof(payload));
+}
+
+int Http2Session::SendRstStream(uint32_t stream_id, uint32_t error)
+{
+    char payload[4];
+    WriteUint32(error, payload);
+    return SendFrame(H2_RST_STREAM, 0, stream_id, payload, sizeof(payload));
+}
+
+// 连接级别的错误: 发送GOAWAY之后关闭整个连接
+int Http2Session::ConnectionError(uint32_t error)
+{
+    LOG(ERROR) << "HTTP/2 connection error! error=" << error << "\n";
+    SendGoaway(error);
+    return -1;
+}
+
+int Http2Session::SendGoaway(uint32_t error)
+{
+    char payload[8];
+    WriteUint32(last_stream_id_, payload);
+    WriteUint32(error, payload + 4);
+    return SendFrame(H2_GOAWAY, 0, 0, payload, sizeof(payload));
+}
+}
@@ -0,0 +1,188 @@
+#pragma once
+#include <stdint.h>
+#include <sys/types.h>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "hpack.hpp"
+#include "coroutine.hpp"
+
+namespace http_server{
+
+struct Context;
+class HttpServer;
+class Connection;
+class LoopEvent;
+class IoAwaitable;
+
+// HTTP/2的帧类型
+enum Http2FrameType{
+    H2_DATA = 0x0,
+    H2_HEADERS = 0x1,
+    H2_PRIORITY = 0x2,
+    H2_RST_STREAM = 0x3,
+    H2_SETTINGS = 0x4,
+    H2_PUSH_PROMISE = 0x5,
+    H2_PING = 0x6,
+    H2_GOAWAY = 0x7,
+    H2_WINDOW_UPDATE = 0x8,
+    H2_CONTINUATION = 0x9,
+};
+
+// 帧的标志位,同一个值在不同类型的帧中含义不同
+enum Http2Flag{
+    H2_FLAG_END_STREAM = 0x1,
+    H2_FLAG_ACK = 0x1,
+    H2_FLAG_END_HEADERS = 0x4,
+    H2_FLAG_PADDED = 0x8,
+    H2_FLAG_PRIORITY = 0x20,
+};
+
+// RST_STREAM和GOAWAY中使用的错误码
+enum Http2Error{
+    H2_NO_ERROR = 0x0,
+    H2_PROTOCOL_ERROR = 0x1,
+    H2_INTERNAL_ERROR = 0x2,
+    H2_FLOW_CONTROL_ERROR = 0x3,
+    H2_STREAM_CLOSED = 0x5,
+    H2_FRAME_SIZE_ERROR = 0x6,
+    H2_REFUSED_STREAM = 0x7,
+    H2_COMPRESSION_ERROR = 0x9,
+    H2_ENHANCE_YOUR_CALM = 0xb,
+};
+
+enum Http2Setting{
+    H2_SETTINGS_HEADER_TABLE_SIZE = 0x1,
+    H2_SETTINGS_ENABLE_PUSH = 0x2,
+    H2_SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    H2_SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+    H2_SETTINGS_MAX_FRAME_SIZE = 0x5,
+    H2_SETTINGS_MAX_HEADER_LIST_SIZE = 0x6,
+};
+
+struct Http2Frame{
+    uint8_t type;
+    uint8_t flags;
+    uint32_t stream_id;
+    std::string payload;
+};
+
+// 一个明文HTTP/2(h2c)连接
+// 支持两种建立方式: 直接发送连接前言(prior knowledge)和通过Upgrade: h2c从HTTP/1.1升级
+// 每个stream的请求被转换成Request对象,交给HttpServer::HandlerRequest处理,
+// 所以静态文件、CGI等逻辑不需要做任何修改就可以服务HTTP/2的客户端
+// 一个连接上有三种协程:
+//   读协程(Run/Serve)只负责读取和处理帧,要发送的帧放到输出缓冲区中
+//   每个请求接收完整的stream在自己的协程中计算(最多同时kMaxActiveHandlers个),慢的请求不会挡住其他stream
+//   写协程(WriteLoop)是唯一写socket的地方,把输出缓冲区写出去,
+//   并且把响应的body按照流量控制窗口切分成DATA帧,在所有未发送完的stream之间轮流发送
+// 这些协程在同一个事件循环线程上交替执行,共享的状态不需要加锁
+// 连接空闲或者存活时间太长时会主动关闭,服务器退出时也会发送GOAWAY
+class Http2Session{
+public:
+    Http2Session(HttpServer* server, Context* context);
+    ~Http2Session();
+
+    // 处理整个连接,直到连接关闭或者出错
+    Task<int> Run();
+
+    // 判断一个HTTP/1.1请求是不是要求升级到h2c
+    static bool IsUpgrade(const Context* context);
+
+private:
+    Http2Session(const Http2Session&);
+    Http2Session& operator=(const Http2Session&);
+
+    struct Stream{
+        Stream();
+        uint32_t id;
+        int64_t send_window;
+        int64_t recv_window;         //对方还可以在这个stream上发送的字节数
+        bool request_done;           //已经收到了END_STREAM
+        bool handed;                 //body已经交给处理逻辑,不再算在buffered_body_中
+        std::unique_ptr<Context> context;
+        HeaderList headers;
+        //响应的body,来自内存(data)或者文件(file_fd),sent为已经发送的字节数
+        const char* data;
+        int file_fd;
+        size_t body_len;
+        size_t sent;
+        bool responding;             //响应的HEADERS已经发出
+        //处理协程或者写协程正在使用的stream不能马上删除,先标记为closed,用完之后再删除
+        bool processing;
+        bool writing;
+        bool closed;
+    };
+    typedef std::map<uint32_t, std::unique_ptr<Stream> > StreamMap;
+
+    Stream* NewStream(uint32_t id);
+    Task<int> Serve();
+    Task<int> ReadFrame(Http2Frame* frame);
+    int HandleFrame(Http2Frame* frame);
+    int HandleHeaders(Http2Frame* frame);
+    int HandleData(Http2Frame* frame);
+    int ReplenishConnWindow();
+    void EraseStream(uint32_t id);
+    int HandleSettings(const Http2Frame& frame);
+    int HandleWindowUpdate(const Http2Frame& frame);
+    int FinishHeaderBlock();
+    int ApplySettings(const std::string& payload);
+    void StartHandlers();
+    Task<void> HandleStream(Stream* stream);
+    Task<int> ProcessStream(Stream* stream);
+    void BuildResponseHeaders(Stream* stream, HeaderList* headers);
+    Task<void> WriteLoop();
+    static bool SendableStream(const Stream* stream);
+    bool HasDataToSend() const;
+    Task<int> Flush();
+    // 把输出缓冲区中的数据写到socket
+    Task<int> FlushOut();
+    // 唤醒等在event上的协程,没有协程在等时什么都不做
+    void Notify(std::shared_ptr<LoopEvent>* event);
+    IoAwaitable WaitFor(std::shared_ptr<LoopEvent>* event);
+
+    int SendFrame(uint8_t type, uint8_t flags, uint32_t stream_id, const char* payload, size_t len);
+    int SendSettings();
+    int SendHeaders(uint32_t stream_id, const HeaderList& headers, bool end_stream);
+    Task<int> SendData(Stream* stream, size_t len, bool end_stream);
+    int SendWindowUpdate(uint32_t stream_id, uint32_t increment);
+    int SendRstStream(uint32_t stream_id, uint32_t error);
+    int SendGoaway(uint32_t error);
+    int ConnectionError(uint32_t error);
+
+    HttpServer* server_;
+    Context* context_;
+    Connection* conn_;
+    std::string out_;              //还没有写到socket的帧
+    std::string sending_;          //写协程正在写的帧,写的过程中新的帧继续追加到out_
+    std::deque<uint32_t> pending_streams_;  //请求已经接收完整,等待处理的stream
+    size_t active_handlers_;       //正在执行的处理协程
+    bool starting_;                //正在StartHandlers中,处理协程结束时不再重入
+    bool writer_running_;
+    bool closing_;                 //读协程已经结束,不再处理新的请求,也不再发送DATA
+    bool failed_;                  //写socket失败,连接不能再用了
+    std::shared_ptr<LoopEvent> writer_event_;  //写协程等待新的输出
+    std::shared_ptr<LoopEvent> drain_event_;   //读协程等待输出缓冲区被写出去
+    std::shared_ptr<LoopEvent> idle_event_;    //Run等待所有的处理协程和写协程结束
+    HpackDecoder decoder_;
+    HpackEncoder encoder_;
+    StreamMap streams_;
+    uint32_t last_stream_id_;
+    int64_t conn_send_window_;
+    int64_t conn_recv_window_;     //对方还可以在这个连接上发送的字节数
+    size_t buffered_body_;         //已经收到但是还没有交给处理逻辑的请求body
+    uint32_t peer_initial_window_;
+    uint32_t peer_max_frame_size_;
+    bool goaway_received_;
+    bool goaway_sent_;             //连接到了存活时间的上限,已经发出了GOAWAY
+    int64_t start_ms_;
+    int64_t idle_since_ms_;        //最后一次有进行中的stream的时间
+    //正在接收的header块(HEADERS后面可能跟着若干CONTINUATION)
+    uint32_t header_stream_id_;
+    uint8_t header_flags_;
+    bool header_refused_;
+    std::string header_block_;
+};
+}
@@ -0,0 +1,192 @@
+#include "http_server.h"
+#include "http2_session.h"
+#include "hpack.hpp"
+#include "unit_test.hpp"
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+using namespace http_server;
+
+// 在临时目录下准备wwwroot: 一个静态文件和一个要执行1秒的CGI程序
+struct Site{
+    std::string root;
+    std::string old_cwd;
+};
+
+static void WriteFile(const std::string& path, const std::string& content, mode_t mode)
+{
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, mode);
+    write(fd, content.data(), content.size());
+    close(fd);
+}
+
+static void SetupSite(Site* site)
+{
+    char root[] = "/tmp/http2_session_test.XXXXXX";
+    EXPECT_TRUE(mkdtemp(root) != NULL);
+    site->root = root;
+    char cwd[4096];
+    site->old_cwd = getcwd(cwd, sizeof(cwd));
+    mkdir((site->root + "/wwwroot").c_str(), 0755);
+    WriteFile(site->root + "/wwwroot/fast.html", "fast", 0644);
+    WriteFile(site->root + "/wwwroot/slow", "#!/bin/sh\nsleep 1\nprintf 'Content-Type: text/plain\\r\\n\\r\\nslow'\n", 0755);
+    //服务器按照相对路径./wwwroot查找文件
+    EXPECT_EQ(0, chdir(site->root.c_str()));
+}
+
+static void TeardownSite(const Site& site)
+{
+    EXPECT_EQ(0, chdir(site.old_cwd.c_str()));
+    unlink((site.root + "/wwwroot/fast.html").c_str());
+    unlink((site.root + "/wwwroot/slow").c_str());
+    rmdir((site.root + "/wwwroot").c_str());
+    rmdir(site.root.c_str());
+}
+
+static std::string Frame(uint8_t type, uint8_t flags, uint32_t stream_id, const std::string& payload)
+{
+    std::string frame;
+    frame.push_back((char)(payload.size() >> 16));
+    frame.push_back((char)(payload.size() >> 8));
+    frame.push_back((char)payload.size());
+    frame.push_back((char)type);
+    frame.push_back((char)flags);
+    frame.push_back((char)(stream_id >> 24));
+    frame.push_back((char)(stream_id >> 16));
+    frame.push_back((char)(stream_id >> 8));
+    frame.push_back((char)stream_id);
+    return frame + payload;
+}
+
+static std::string GetRequest(HpackEncoder* encoder, uint32_t stream_id, const std::string& path)
+{
+    HeaderList headers;
+    headers.push_back(HeaderField(":method", "GET"));
+    headers.push_back(HeaderField(":path", path));
+    headers.push_back(HeaderField(":scheme", "http"));
+    headers.push_back(HeaderField(":authority", "test"));
+    std::string block;
+    encoder->Encode(headers, &block);
+    return Frame(H2_HEADERS, H2_FLAG_END_HEADERS | H2_FLAG_END_STREAM, stream_id, block);
+}
+
+// 客户端线程: 在同一个连接上先请求慢的CGI(stream 1),再请求静态文件(stream 3),然后发一个PING
+// 记录每个stream的响应HEADERS和PING ACK到达的时间
+struct ClientCase{
+    int fd;
+    int64_t start_ms;
+    int64_t slow_ms;
+    int64_t fast_ms;
+    int64_t ping_ms;
+};
+
+static bool ReadFull(int fd, char* buf, size_t len)
+{
+    size_t done = 0;
+    while(done < len)
+    {
+        ssize_t ret = read(fd, buf + done, len - done);
+        if(ret <= 0)
+        {
+            return false;
+        }
+        done += ret;
+    }
+    return true;
+}
+
+static void* ClientEntry(void* arg)
+{
+    ClientCase* c = static_cast<ClientCase*>(arg);
+    HpackEncoder encoder;
+    std::string out = Frame(H2_SETTINGS, 0, 0, "");
+    out += GetRequest(&encoder, 1, "/slow?x=1");
+    out += GetRequest(&encoder, 3, "/fast.html");
+    out += Frame(H2_PING, 0, 0, "12345678");
+    c->start_ms = TimeUtil::MonotonicMS();
+    write(c->fd, out.data(), out.size());
+    int ended = 0;
+    char head[9];
+    while(ended < 2 && ReadFull(c->fd, head, sizeof(head)))
+    {
+        size_t len = ((size_t)(unsigned char)head[0] << 16) | ((size_t)(unsigned char)head[1] << 8)
+                   | (unsigned char)head[2];
+        uint8_t type = head[3];
+        uint8_t flags = head[4];
+        uint32_t stream_id = ntohl(*(uint32_t*)(head + 5)) & 0x7FFFFFFF;
+        std::string payload(len, '\0');
+        if(len > 0 && !ReadFull(c->fd, &payload[0], len))
+        {
+            break;
+        }
+        int64_t now = TimeUtil::MonotonicMS() - c->start_ms;
+        if(type == H2_HEADERS && stream_id == 1)
+        {
+            c->slow_ms = now;
+        }
+        else if(type == H2_HEADERS && stream_id == 3)
+        {
+            c->fast_ms = now;
+        }
+        else if(type == H2_PING && (flags & H2_FLAG_ACK))
+        {
+            c->ping_ms = now;
+        }
+        if((type == H2_HEADERS || type == H2_DATA) && (flags & H2_FLAG_END_STREAM))
+        {
+            ++ended;
+        }
+    }
+    //关闭连接之后服务端的会话结束
+    close(c->fd);
+    return NULL;
+}
+
+static Task<void> ServeTask(HttpServer* server, Connection* conn, int* ret)
+{
+    Context context;
+    context.conn = conn;
+    context.peer_ip = htonl(INADDR_LOOPBACK);
+    context.http2 = true;
+    context.server = server;
+    Http2Session session(server, &context);
+    *ret = co_await session.Run();
+}
+
+TEST(SlowStreamDoesNotDelayOthers)
+{
+    Site site;
+    SetupSite(&site);
+    HttpServer server;
+    EventLoop loop;
+    EXPECT_EQ(0, loop.Init(BACKEND_EPOLL));
+    int fds[2];
+    EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds));
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    ClientCase c = {fds[1], 0, -1, -1, -1};
+    pthread_t client;
+    pthread_create(&client, NULL, ClientEntry, &c);
+    int ret = -2;
+    loop.Post([&]{
+        Connection* conn = loop.NewConnection(fds[0]);
+        loop.Spawn(ServeTask(&server, conn, &ret), conn);
+        loop.Stop();
+    });
+    loop.Run();
+    pthread_join(client, NULL);
+    //CGI要执行1秒,静态文件的响应和PING ACK不能等它
+    EXPECT_TRUE(c.slow_ms >= 900);
+    EXPECT_TRUE(c.fast_ms >= 0 && c.fast_ms < 500);
+    EXPECT_TRUE(c.ping_ms >= 0 && c.ping_ms < 500);
+    EXPECT_EQ(0, ret);
+    TeardownSite(site);
+}
+
+int main()
+{
+    return unit_test::RunAll();
+}
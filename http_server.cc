@@ -1,23 +1,197 @@
 #include"http_server.h"
 #include"util.hpp"
+#include"cgi_process.h"
 #include<stdio.h>
 #include<stdlib.h>
 #include<unistd.h>
+#include<string.h>
+#include<fcntl.h>
+#include<sys/stat.h>
 #include<sys/wait.h>
 #include<sys/socket.h>
 #include<netinet/in.h>
 #include<arpa/inet.h>
 #include<pthread.h>
+#include<signal.h>
+#include<errno.h>
 #include<sstream>
+#include<set>
+#include<memory>
+#include<vector>
 
 typedef struct sockaddr sockaddr;
 typedef struct sockaddr_in sockaddr_in;
 
 namespace http_server{
 
+//HTTP/1.1请求body的上限
+static const long long kMaxRequestBody = 10 * 1024 * 1024;
+//请求行和每一行header的长度上限,以及整个header部分的上限
+static const size_t kMaxLineSize = 8 * 1024;
+static const size_t kMaxHeaderSize = 64 * 1024;
+//从accept开始,必须在这个时间内读完请求行和所有header
+//body另外按照最低速率计算额外的时间,客户端每隔几秒发一个字节也不能无限期地占着连接
+static const int64_t kReadHeaderTimeoutMs = 10 * 1000;
+static const int64_t kMinBodyBytesPerSec = 64 * 1024;
+//CGI程序从fork到退出的时间上限,超时的CGI程序会被杀掉
+static const int64_t kCgiTimeoutMs = 30 * 1000;
+//平滑升级时通过环境变量传给新的可执行文件的监听socket和旧master的pid
+static const char* const kListenFdEnv = "HTTPSERVER_LISTEN_FD";
+static const char* const kOldMasterEnv = "HTTPSERVER_OLD_MASTER";
+
+HttpServer::HttpServer()
+    :thread_num_(0)
+    ,worker_num_(0)
+    ,backend_(BACKEND_EPOLL)
+    ,file_cache_("./wwwroot")
+{}
+
+void HttpServer::SetThreadNum(int thread_num)
+{
+    thread_num_ = thread_num;
+}
+
+void HttpServer::SetBackend(IoBackend backend)
+{
+    backend_ = backend;
+}
+
+void HttpServer::EnableCgiCache(const std::string& url_path, int default_ttl)
+{
+    std::string clean_path;
+    if(PathUtil::Normalize(url_path, &clean_path) == 0)
+    {
+        cgi_cache_.EnableRoute(clean_path, default_ttl);
+    }
+}
+
+int HttpServer::LoadBundle(const std::string& path)
+{
+    if(bundle_.Load(path) < 0)
+    {
+        LOG(ERROR) << "LoadBundle error! path=" << path << "\n";
+        return -1;
+    }
+    LOG(INFO) << "LoadBundle OK! " << bundle_.Size() << " paths\n";
+    return 0;
+}
+
+// 以下是master/worker多进程模式用到的信号标志,信号处理函数中只设置标志,由主循环处理
+static volatile sig_atomic_t g_quit = 0;      //SIGQUIT/SIGTERM:优雅退出
+static volatile sig_atomic_t g_upgrade = 0;   //SIGUSR2:平滑升级可执行文件
+static volatile sig_atomic_t g_child = 0;     //SIGCHLD:有worker退出了
+static volatile sig_atomic_t g_dump_trace = 0; //SIGUSR1:导出追踪记录
+
+static void OnSignal(int sig)
+{
+    if(sig == SIGQUIT || sig == SIGTERM)
+    {
+        g_quit = 1;
+    }
+    else if(sig == SIGUSR2)
+    {
+        g_upgrade = 1;
+    }
+    else if(sig == SIGCHLD)
+    {
+        g_child = 1;
+    }
+    else if(sig == SIGUSR1)
+    {
+        g_dump_trace = 1;
+    }
+}
+
+// 不带SA_RESTART,这样阻塞在系统调用中的主线程能被信号打断
+static void SetSignal(int sig, void (*handler)(int))
+{
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = handler;
+    sigemptyset(&act.sa_mask);
+    sigaction(sig, &act, NULL);
+}
+
+static void SetSignalMask(int how)
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGQUIT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(how, &set, NULL);
+}
+
+void HttpServer::EnableTrace(uint32_t sample_rate, uint32_t slow_ms)
+{
+    Tracer::Enable(sample_rate, slow_ms);
+}
+
+// 把追踪记录写到当前目录下的trace-<pid>.json中
+int HttpServer::DumpTraceFile()
+{
+    std::string json;
+    Tracer::Dump(&json);
+    std::string path = "trace-" + std::to_string(getpid()) + ".json";
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0)
+    {
+        LOG(ERROR) << "DumpTraceFile error! path=" << path << "\n";
+        return -1;
+    }
+    struct iovec iov = {const_cast<char*>(json.data()), json.size()};
+    int ret = FileUtil::WriteV(fd, &iov, 1);
+    close(fd);
+    LOG(INFO) << "DumpTraceFile OK! path=" << path << "\n";
+    return ret;
+}
+
+void HttpServer::SetWorkerNum(int worker_num)
+{
+    worker_num_ = worker_num;
+}
+
 int HttpServer::Start(const std::string& ip, short port)
 {
-    int listen_sock = socket(AF_INET,SOCK_STREAM,0);
+    // 客户端或者CGI子进程提前关闭时,继续写会触发SIGPIPE导致整个服务器退出
+    signal(SIGPIPE, SIG_IGN);
+
+    int listen_sock = CreateListenSocket(ip, port);
+    if(listen_sock < 0)
+    {
+        return -1;
+    }
+    // worker_num_为0时还是单进程的服务器,否则由master进程管理若干个worker进程
+    int ret = worker_num_ > 0 ? RunMaster(listen_sock) : RunWorker(listen_sock);
+    close(listen_sock);
+    return ret;
+}
+
+// 创建监听socket
+// 平滑升级时新的可执行文件从环境变量中拿到旧master的监听socket,直接使用而不是重新bind
+int HttpServer::CreateListenSocket(const std::string& ip, short port)
+{
+    const char* inherited = getenv(kListenFdEnv);
+    if(inherited != NULL)
+    {
+        int listen_sock = atoi(inherited);
+        unsetenv(kListenFdEnv);
+        int type = 0;
+        socklen_t len = sizeof(type);
+        if(getsockopt(listen_sock, SOL_SOCKET, SO_TYPE, &type, &len) < 0 || type != SOCK_STREAM)
+        {
+            LOG(ERROR) << "Inherited listen socket is invalid! fd=" << inherited << "\n";
+            return -1;
+        }
+        // 不能泄露给CGI子进程
+        fcntl(listen_sock, F_SETFD, FD_CLOEXEC);
+        LOG(INFO) << "Inherit listen socket OK! fd=" << listen_sock << "\n";
+        return listen_sock;
+    }
+
+    int listen_sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if(listen_sock < 0)
     {
         perror("socket");
@@ -37,79 +211,379 @@ int HttpServer::Start(const std::string& ip, short port)
     if(ret < 0)
     {
         perror("bind");
+        close(listen_sock);
         return -1;
     }
 
-    ret  = listen(listen_sock, 5);
+    ret  = listen(listen_sock, SOMAXCONN);
     if(ret < 0)
     {
         perror("listen");
+        close(listen_sock);
         return -1;
     }
-    LOG(INFO) << "ServerStart OK!\n";
+    return listen_sock;
+}
 
-    while(1)
+// master进程:不处理请求,只负责创建worker、在worker退出时重新创建、平滑升级和优雅退出
+// 所有worker共享同一个监听socket,由内核把新连接分给正在accept的worker
+// 某个请求导致worker崩溃时只影响这个worker上的连接,master会马上补上一个新的worker
+int HttpServer::RunMaster(int listen_sock)
+{
+    // 信号只在sigsuspend中处理,避免在检查标志和等待之间丢失信号
+    SetSignalMask(SIG_BLOCK);
+    SetSignal(SIGQUIT, OnSignal);
+    SetSignal(SIGTERM, OnSignal);
+    SetSignal(SIGUSR1, OnSignal);
+    SetSignal(SIGUSR2, OnSignal);
+    SetSignal(SIGCHLD, OnSignal);
+
+    std::set<pid_t> workers;
+    for(int i = 0; i < worker_num_; i++)
     {
-        // 基于多线程实现一个http服务器
-        // 为什么使用多线程？
-        // 因为线程比较轻量化,占用的资源较少(大量连接)
-        sockaddr_in peer;
-        socklen_t len = sizeof(peer);
-        int new_sock = accept(listen_sock,(sockaddr*)&peer,&len);
-        if(new_sock < 0)
+        pid_t pid = SpawnWorker(listen_sock);
+        if(pid < 0)
         {
-            perror("accept");
-            continue;
+            return -1;
         }
+        workers.insert(pid);
+    }
+    LOG(INFO) << "Master start OK! pid=" << getpid() << " workers=" << worker_num_ << "\n";
 
-        // 封装上下文信息
-        Context* context = new Context();
-        context->new_sock = new_sock;
-        context->server = this;
+    // 由旧的master升级上来的,新的worker已经在accept了,通知旧的master优雅退出
+    const char* old_master = getenv(kOldMasterEnv);
+    if(old_master != NULL)
+    {
+        kill(atoi(old_master), SIGQUIT);
+        unsetenv(kOldMasterEnv);
+    }
 
-        pthread_t tid;
-        //创建新线程，使用新线程完成这次的请求计算
-        pthread_create(&tid, NULL, ThreadEntry, reinterpret_cast<void*>(context));
-        //线程分离,不需要线程等待
-        //短连接，一来一回既断开连接
-        pthread_detach(tid);
+    sigset_t empty;
+    sigemptyset(&empty);
+    pid_t upgrade_pid = -1;
+    bool quitting = false;
+    while(!quitting || !workers.empty())
+    {
+        sigsuspend(&empty);
+        if(g_child)
+        {
+            g_child = 0;
+            int status = 0;
+            pid_t pid = 0;
+            while((pid = waitpid(-1, &status, WNOHANG)) > 0)
+            {
+                if(pid == upgrade_pid)
+                {
+                    // 新的可执行文件启动失败,旧的master继续工作
+                    LOG(ERROR) << "Upgrade failed! status=" << status << "\n";
+                    upgrade_pid = -1;
+                    continue;
+                }
+                if(workers.erase(pid) == 0)
+                {
+                    continue;
+                }
+                if(quitting)
+                {
+                    continue;
+                }
+                LOG(WARNING) << "Worker exited! pid=" << pid << " status=" << status << "\n";
+                // 避免worker启动就崩溃时master不停的fork
+                if(WIFSIGNALED(status) || WEXITSTATUS(status) != 0)
+                {
+                    sleep(1);
+                }
+                pid_t new_pid = SpawnWorker(listen_sock);
+                if(new_pid > 0)
+                {
+                    workers.insert(new_pid);
+                }
+            }
+        }
+        if(g_dump_trace)
+        {
+            // 追踪记录在各个worker进程中,让每个worker各自导出
+            g_dump_trace = 0;
+            for(std::set<pid_t>::iterator it = workers.begin(); it != workers.end(); ++it)
+            {
+                kill(*it, SIGUSR1);
+            }
+        }
+        if(g_upgrade)
+        {
+            g_upgrade = 0;
+            if(upgrade_pid < 0 && !quitting)
+            {
+                upgrade_pid = Upgrade(listen_sock);
+            }
+        }
+        if(g_quit && !quitting)
+        {
+            // 通知所有worker不再accept,处理完手上的请求之后退出
+            quitting = true;
+            for(std::set<pid_t>::iterator it = workers.begin(); it != workers.end(); ++it)
+            {
+                kill(*it, SIGQUIT);
+            }
+            LOG(INFO) << "Master quit, waiting " << workers.size() << " workers\n";
+        }
     }
-    close(listen_sock);
+    LOG(INFO) << "Master exit OK!\n";
     return 0;
 }
 
-//线程执行函数
-void* HttpServer::ThreadEntry(void* arg)
+// fork一个worker进程,返回worker的pid
+pid_t HttpServer::SpawnWorker(int listen_sock)
+{
+    //避免子进程把父进程缓冲区中还没有输出的日志再输出一遍
+    std::cout.flush();
+    pid_t pid = fork();
+    if(pid < 0)
+    {
+        perror("fork");
+        return -1;
+    }
+    if(pid == 0)
+    {
+        SetSignal(SIGUSR2, SIG_IGN);
+        SetSignal(SIGCHLD, SIG_DFL);
+        exit(RunWorker(listen_sock) < 0 ? 1 : 0);
+    }
+    return pid;
+}
+
+// 平滑升级:fork一个子进程exec新的可执行文件(命令行参数不变),把监听socket通过环境变量传过去
+// 新的master启动好自己的worker之后会给旧的master发SIGQUIT,整个过程中监听socket一直是打开的,
+// 已经在backlog里的连接和新来的连接都不会被拒绝
+pid_t HttpServer::Upgrade(int listen_sock)
 {
-    //reinterpret_cast指针转化为任意类型的指针,威力最为强大
-    Context* context = reinterpret_cast<Context*>(arg);
-    HttpServer* server = context->server;
-    //从文件描述符中读取数据,反序列化成Request对象
+    // 读取当前进程的命令行参数,/proc/self/exe指向的是旧的文件,所以使用argv[0]
+    //proc文件的大小是0,参数之间又用\0分隔,所以不能用FileUtil::ReadAll
+    std::string cmdline;
+    int fd = open("/proc/self/cmdline", O_RDONLY | O_CLOEXEC);
+    if(fd >= 0)
+    {
+        char buf[4096];
+        ssize_t read_size = 0;
+        while((read_size = read(fd, buf, sizeof(buf))) > 0)
+        {
+            cmdline.append(buf, read_size);
+        }
+        close(fd);
+    }
+    if(cmdline.empty())
+    {
+        LOG(ERROR) << "Upgrade error! read cmdline failed\n";
+        return -1;
+    }
+    std::vector<std::string> args;
+    size_t start = 0;
+    while(start < cmdline.size())
+    {
+        size_t end = cmdline.find('\0', start);
+        if(end == std::string::npos)
+        {
+            end = cmdline.size();
+        }
+        args.push_back(cmdline.substr(start, end - start));
+        start = end + 1;
+    }
+    std::vector<char*> argv;
+    for(size_t i = 0; i < args.size(); i++)
+    {
+        argv.push_back(const_cast<char*>(args[i].c_str()));
+    }
+    argv.push_back(NULL);
+
+    std::cout.flush();
+    pid_t pid = fork();
+    if(pid < 0)
+    {
+        perror("fork");
+        return -1;
+    }
+    if(pid == 0)
+    {
+        // exec之后信号处理函数会被重置,但是屏蔽字会保留
+        SetSignalMask(SIG_UNBLOCK);
+        fcntl(listen_sock, F_SETFD, 0);
+        setenv(kListenFdEnv, std::to_string(listen_sock).c_str(), 1);
+        setenv(kOldMasterEnv, std::to_string(getppid()).c_str(), 1);
+        execv(argv[0], &argv[0]);
+        perror("execv");
+        _exit(1);
+    }
+    LOG(INFO) << "Upgrade start! exec " << args[0] << " pid=" << pid << "\n";
+    return pid;
+}
+
+// 启动事件循环线程,每个事件循环都在监听socket上accept,连接由accept它的事件循环处理到底
+// 单进程模式下由Start直接调用,多进程模式下每个worker进程各自调用,各自有独立的事件循环
+// 主线程只负责处理信号,收到SIGQUIT/SIGTERM之后通知事件循环不再accept,处理完已经接收的连接再返回
+int HttpServer::RunWorker(int listen_sock)
+{
+    SetSignal(SIGQUIT, OnSignal);
+    SetSignal(SIGTERM, OnSignal);
+    SetSignal(SIGUSR1, OnSignal);
+    // 信号只在主线程的sigsuspend中处理:先屏蔽信号再创建事件循环线程,线程会继承屏蔽字
+    SetSignalMask(SIG_BLOCK);
+    // 每个连接的处理逻辑仍然是顺序的代码(协程),但是等待IO时挂起到事件循环上,
+    // 不会因为慢速的客户端占住线程,线程数量只和CPU核数有关,和连接数无关
+    int flags = fcntl(listen_sock, F_GETFL);
+    fcntl(listen_sock, F_SETFL, flags | O_NONBLOCK);
+    int thread_num = thread_num_ > 0 ? thread_num_ : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if(thread_num < 1)
+    {
+        thread_num = 1;
+    }
+    std::vector<std::unique_ptr<EventLoop> > loops;
+    std::vector<pthread_t> threads;
     int ret = 0;
-    ret = server->ReadOneRequest(context);
+    for(int i = 0; i < thread_num; i++)
+    {
+        EventLoop* loop = new EventLoop();
+        loops.push_back(std::unique_ptr<EventLoop>(loop));
+        if(loop->Init(backend_) < 0)
+        {
+            ret = -1;
+            break;
+        }
+        loop->Post([this, loop, listen_sock]{
+            loop->Spawn(AcceptLoop(loop, listen_sock), NULL);
+        });
+        pthread_t tid;
+        if(pthread_create(&tid, NULL, LoopEntry, loop) != 0)
+        {
+            ret = -1;
+            break;
+        }
+        threads.push_back(tid);
+    }
+    if(ret < 0)
+    {
+        LOG(ERROR) << "EventLoop start error!\n";
+    }
+    else
+    {
+        LOG(INFO) << "ServerStart OK! pid=" << getpid() << " loops=" << thread_num
+                  << " backend=" << loops[0]->BackendName() << "\n";
+        sigset_t empty;
+        sigemptyset(&empty);
+        while(!g_quit)
+        {
+            sigsuspend(&empty);
+            if(g_dump_trace)
+            {
+                g_dump_trace = 0;
+                DumpTraceFile();
+            }
+        }
+    }
+    //处理完已经接收的连接
+    for(size_t i = 0; i < threads.size(); i++)
+    {
+        loops[i]->Stop();
+    }
+    for(size_t i = 0; i < threads.size(); i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    LOG(INFO) << "Worker exit OK! pid=" << getpid() << "\n";
+    return ret;
+}
+
+void* HttpServer::LoopEntry(void* arg)
+{
+    EventLoop* loop = reinterpret_cast<EventLoop*>(arg);
+    loop->Run();
+    return NULL;
+}
+
+// 在监听socket上循环accept,每个连接启动一个协程处理
+Task<void> HttpServer::AcceptLoop(EventLoop* loop, int listen_sock)
+{
+    while(!loop->IsStopping())
+    {
+        sockaddr_in peer;
+        int new_sock = co_await loop->Accept(listen_sock, &peer);
+        uint64_t accept_us = Tracer::NowUs();
+        if(new_sock < 0)
+        {
+            if(new_sock == -ECANCELED || new_sock == -ECONNABORTED)
+            {
+                continue;
+            }
+            if(new_sock == -EMFILE || new_sock == -ENFILE)
+            {
+                //fd用完了,连接会留在backlog里,等一会儿已有的连接关闭之后再accept,避免空转
+                LOG(ERROR) << "accept: too many open files, backing off\n";
+            }
+            else
+            {
+                LOG(ERROR) << "accept error! " << strerror(-new_sock) << "\n";
+            }
+            co_await SleepFor(100);
+            continue;
+        }
+        //连接上所有协程的帧都从连接自己的内存池中分配,连接对象由事件循环回收复用
+        Connection* conn = loop->NewConnection(new_sock);
+        FramePoolScope scope(conn->Pool());
+        loop->Spawn(ServeConnection(conn, peer.sin_addr.s_addr, accept_us), conn);
+    }
+}
+
+void HttpServer::SetRateLimit(RouteClass rc, uint32_t burst, uint32_t rate)
+{
+    limiter_.SetLimit(rc, burst, rate);
+}
+
+// 处理一个连接:读取请求,计算响应,写回客户端
+// 短连接，一来一回既断开连接,协程结束之后由事件循环关闭socket
+Task<void> HttpServer::ServeConnection(Connection* conn, uint32_t peer_ip, uint64_t accept_us)
+{
+    // 封装上下文信息
+    Context context;
+    context.conn = conn;
+    context.peer_ip = peer_ip;
+    context.accept_us = accept_us;
+    context.server = this;
+    //请求从accept开始计时
+    Tracer::Begin(&context.trace, accept_us);
+    Tracer::Record("accept", accept_us, Tracer::NowUs());
+    //从socket中读取数据,反序列化成Request对象
+    int ret = co_await ReadOneRequest(&context);
     if(ret < 0)
     {
         LOG(ERROR) << "ReadOneRequest error!" << "\n";
         // 构造一个404的http Response对象
-        server->Process404(context);
-        goto END;
+        Process404(&context);
+    }
+    else if(context.http2 || Http2Session::IsUpgrade(&context))
+    {
+        //HTTP/2的连接(包括从HTTP/1.1升级上来的)交给Http2Session处理,直到连接关闭
+        //HTTP/2的每个stream单独作为一个请求追踪
+        Tracer::Cancel(&context.trace);
+        Http2Session session(this, &context);
+        co_await session.Run();
+        co_return;
     }
     //把request对象计算生成response对象
-    ret  = server->HandlerRequest(context);
-    if(ret < 0)
+    else if(co_await HandlerRequest(&context) < 0)
     {
         LOG(ERROR) << "HandlerRequest error!" << "\n";
         //用这个函数构造一个404的hhtp Response对象
-        server->Process404(context);
-        goto END;
+        Process404(&context);
     }
-END:
-    //处理失败的情况  
     //把response对象写回到客户端
-    server->WriteOneResponse(context);
-    close(context->new_sock);
-    delete context;
-    return NULL;
+    {
+        TraceSpan span("write");
+        co_await WriteOneResponse(&context);
+    }
+    if(Tracer::IsActive())
+    {
+        Tracer::SetDetail(context.req.method + " " + context.req.url + " " + std::to_string(context.resp.code));
+    }
+    Tracer::End(&context.trace);
 }
 
 // 构造一个状码为404的response对象
@@ -129,35 +603,78 @@ int HttpServer::Process404(Context* context)
     return 0;
 }
 
+// 构造一个状态码为429的response对象,客户端请求过于频繁时使用
+int HttpServer::Process429(Context* context)
+{
+    Response* resp = &context->resp;
+    resp->code = 429;
+    resp->desc = "Too Many Requests";
+    resp->body = "<head><meta http-equiv=\"content-type\""
+                 "content=\"text/html;charset=utf-8\"></head><h1>429!请求太频繁了,请稍后再试!</h1>";
+    std::stringstream ss;
+    ss << resp->body.size();
+    std::string size;
+    ss >> size;
+    resp->header["Content-Length"] = size;
+    resp->header["Retry-After"] = "1";
+    return 0;
+}
+
 // 从socket读取字符串,解析构造生成Request对象
-int HttpServer::ReadOneRequest(Context* context)
+// 请求行和header必须在accept之后kReadHeaderTimeoutMs内读完,每一行不能超过kMaxLineSize
+Task<int> HttpServer::ReadOneRequest(Context* context)
 {
     Request* req = &context->req;
+    Connection* conn = context->conn;
+    int64_t deadline = context->accept_us / 1000 + kReadHeaderTimeoutMs;
+    conn->SetDeadline(deadline);
     //拿出请求的部分,解析出来的数据放到这个请求中去
     //1.从socket中读取一行数据作为Request
     //按行读取的分隔符是\n
     std::string first_line;
-    FileUtil::ReadLine(context->new_sock, &first_line);
+    int ret = 0;
+    {
+        TraceSpan span("read_line");
+        ret = co_await conn->ReadLine(&first_line, kMaxLineSize);
+    }
+    if(ret < 0)
+    {
+        LOG(ERROR) << "Read first line error!\n";
+        co_return -1;
+    }
     std::cerr << first_line << std::endl;
     //2.解析首行,获取到请求的 method 和 url
-    int ret = ParseFirstLine(first_line, &req->method, &req->url);
+    {
+        TraceSpan span("parse_first_line");
+        ret = ParseFirstLine(first_line, &req->method, &req->url);
+    }
     if(ret < 0)
     {
         LOG(ERROR) << "ParseFirstLine error! first_line" << first_line<<"\n";
-        return -1;
+        co_return -1;
     }
     //3.解析 url ,获取到 url path和 query_string
     ret = ParseUrl(req->url, &req->url_path, &req->query_string);
     if(ret < 0)
     {
         LOG(ERROR) << "ParseUrl error! url" << req->url<<"\n";
-        return -1;
+        co_return -1;
     }
     //4.循环的按行读取数据,每读取到一行数据,进行一次header的解析读到空行,说明header解析完毕
     std::string header_line;
+    size_t header_size = 0;
     while(1)
     {
-        FileUtil::ReadLine(context->new_sock, &header_line);
+        {
+            TraceSpan span("read_line");
+            ret = co_await conn->ReadLine(&header_line, kMaxLineSize);
+        }
+        header_size += header_line.size();
+        if(ret < 0 || header_size > kMaxHeaderSize)
+        {
+            LOG(ERROR) << "Read header error! header_size=" << header_size << "\n";
+            co_return -1;
+        }
         //如果header_line是空行就退出循环
         //由于Readline返回的 header_line 不包含\n等分隔符
         //因此读到空行的时候,header_line就是空字符串
@@ -166,30 +683,53 @@ int HttpServer::ReadOneRequest(Context* context)
             break;
         }
         //req->header是key_value形式
+        TraceSpan span("parse_header");
         ret = ParseHeader(header_line, &req->header);
     }
+    //HTTP/2的连接前言"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"的前半部分刚好符合HTTP/1.1请求的格式
+    //剩下的"SM\r\n\r\n"读掉之后就是HTTP/2的帧了
+    if(req->method == "PRI" && req->url == "*")
+    {
+        std::string preface;
+        if(co_await conn->ReadN(6, &preface) < 0 || preface != "SM\r\n\r\n")
+        {
+            LOG(ERROR) << "Invalid HTTP/2 connection preface!\n";
+            co_return -1;
+        }
+        context->http2 = true;
+        co_return 0;
+    }
     //5.如果是POST请求,但是没有content-length字段,认为这次请求失败
     Header::iterator it = req->header.find("Content-Length");
     if(req->method == "POST" && it == req->header.end())
     {
         LOG(ERROR) << "POST Request has no Content-Length!\n";
-        return -1;
+        co_return -1;
     }
-    //如果是GET请求,就不用读Body
-    if(req->method == "GET")
+    //GET请求,以及其他没有content-length字段的请求,都没有body
+    if(req->method == "GET" || it == req->header.end())
     {
-        return 0;
+        co_return 0;
     }
-    //如果是 post 请求,并且header中包含了content-length字段
     //继续读取 socket ,获取body的内容
-    int content_length = atoi(it->second.c_str());
-    ret = FileUtil::ReadN(context->new_sock, content_length, &req->body);
+    //content-length必须是合法的非负整数,并且不能超过上限,否则一个请求就能耗尽内存
+    char* end = NULL;
+    long long content_length = strtoll(it->second.c_str(), &end, 10);
+    if(it->second.empty() || *end != '\0' || content_length < 0 || content_length > kMaxRequestBody)
+    {
+        LOG(ERROR) << "Invalid Content-Length! content_length=" << it->second << "\n";
+        co_return -1;
+    }
+    //body越大允许的时间越长,但是总时间仍然有上限
+    conn->SetDeadline(TimeUtil::MonotonicMS() + kReadHeaderTimeoutMs + content_length * 1000 / kMinBodyBytesPerSec);
+    TraceSpan span("read_body");
+    ret = co_await conn->ReadN(content_length, &req->body);
     if(ret < 0)
     {
         LOG(ERROR) << "ReadN error! content_length=" << content_length<<"\n";
-        return -1;
+        co_return -1;
     }
-    return 0;
+    co_return 0;
 }
 
 // 解析首行,就是按照空格进行分割,分割成三个部分
@@ -258,38 +798,68 @@ int HttpServer::ParseHeader(const std::string& header_line, Header* header)
 
 //该函数实现序列化，把Response对象转换成一个string写回到socket中
 //此函数完全按照http协议的要求来构造响应数据
-int HttpServer::WriteOneResponse(Context* context)
+Task<int> HttpServer::WriteOneResponse(Context* context)
 {
     //1.进行序列化
+    //header部分拼接成字符串,body不再拷贝一次,和header一起通过writev一次写出
     const Response& resp = context->resp;
     std::stringstream ss;
     // 首行
     ss << "HTTP/1.1 " << resp.code << " " << resp.desc << "\n";
+    struct iovec iov[2];
     // header
     if(resp.cgi_resp == "")
     {
         //当前当前是在处理静态页面
         //把键值对全部对应出来
-        for(auto item : resp.header)
+        for(auto& item : resp.header)
         {
             ss << item.first << ": " << item.second << "\n";
         }
         // 空行
         ss << "\n";
-        // body
-        ss << resp.body;
+        // body,可能来自打包文件的mmap区域,也可能是普通的字符串
+        if(resp.mapped_body != NULL)
+        {
+            iov[1].iov_base = const_cast<char*>(resp.mapped_body);
+            iov[1].iov_len = resp.mapped_len;
+        }
+        else
+        {
+            iov[1].iov_base = const_cast<char*>(resp.body.data());
+            iov[1].iov_len = resp.body.size();
+        }
     }
     else
     {
         //当前是在处理CGI生成的页面
         //cgi_resp同时把包含了响应数据的header空行和body
-        std::cout << resp.cgi_resp << std::endl;
-        ss << resp.cgi_resp;
+        iov[1].iov_base = const_cast<char*>(resp.cgi_resp.data());
+        iov[1].iov_len = resp.cgi_resp.size();
     }
     //2.将序列化的结果写入到socket中
     const std::string& str = ss.str();
-    
-    write(context->new_sock, str.c_str(), str.size());
+    iov[0].iov_base = const_cast<char*>(str.data());
+    iov[0].iov_len = str.size();
+    if(resp.file)
+    {
+        //磁盘上的静态文件,header写完之后body直接从文件sendfile到socket中
+        if(co_await context->conn->Write(iov, 1) < 0)
+        {
+            co_return -1;
+        }
+        co_return co_await context->conn->SendFile(resp.file->fd, 0, resp.file->st.st_size);
+    }
+    co_return co_await context->conn->Write(iov, 2);
+}
+
+// 返回当前进程的追踪记录(Chrome trace_event格式的JSON)
+int HttpServer::ProcessTrace(Context* context)
+{
+    Response* resp = &context->resp;
+    Tracer::Dump(&resp->body);
+    resp->header["Content-Type"] = "application/json";
+    resp->header["Content-Length"] = std::to_string(resp->body.size());
     return 0;
 }
 
@@ -299,51 +869,179 @@ int HttpServer::WriteOneResponse(Context* context)
 //2.动态生成页面
 // a.GET请求存在 query_string作为参数
 // b.POST请求 
-int HttpServer::HandlerRequest(Context* context)
+Task<int> HttpServer::HandlerRequest(Context* context)
 {
     const Request& req = context->req;
     Response* resp = &context->resp;
     resp->code = 200;
     resp->desc = "OK";
 
+    // 管理接口:导出追踪记录,只允许本机访问
+    if(req.method == "GET" && req.url_path == "/__trace" && Tracer::IsEnabled()
+       && context->peer_ip == htonl(INADDR_LOOPBACK))
+    {
+        co_return ProcessTrace(context);
+    }
     // 判定当前的处理方式是按照静态文件处理还是动态生成
     if(req.method == "GET" && req.query_string == "")
     {
-        return context->server->ProcessStaticFile(context);
+        // 先按客户端IP进行限流,超过限制直接返回429
+        if(!limiter_.Allow(context->peer_ip, ROUTE_STATIC))
+        {
+            co_return Process429(context);
+        }
+        co_return co_await ProcessStaticFile(context);
     }
 
     else if((req.method == "GET" && req.query_string != "") || req.method == "POST")
     {
-      return context->server->ProcessCGI(context);
+      //CGI的限流在ProcessCGI中确定真的要fork时才检查,命中缓存的请求不消耗令牌
+      co_return co_await ProcessCGI(context);
     }
 
     else
     {
         LOG(ERROR) << "Unsupport Method ! method=" << req.method<<"\n";
-        return -1;
+        co_return -1;
     }
-    return -1;
+    co_return -1;
 }
 
 //1.通过Request中的url_path字段,计算出文件在磁盘上的路径是什么
 //  例如url_path/index.html,想要得到的磁盘上的文件就是 ./wwwroot/index.html
-//2.打开文件,将文件中的所有内容读取出来放到body中
-int HttpServer::ProcessStaticFile(Context* context)
+//2.从文件缓存中拿到已经打开的文件,写回响应时直接sendfile给客户端
+Task<int> HttpServer::ProcessStaticFile(Context* context)
 {
     const Request& req = context->req;
     Response* resp = &context->resp;
 
-    //1.获取到静态文件的完整路径
-    std::string file_path;
-    GetFilePath(req.url_path, &file_path);
-    //2.打开并读取完整的文件
-    //把文件目录下的所有内容都读入到resp->body中
-    int ret = FileUtil::ReadAll(file_path, &resp->body);
+    //1.规范化url_path,拒绝通过..访问wwwroot之外的文件
+    std::string clean_path;
+    int ret = 0;
+    {
+        TraceSpan span("resolve_path");
+        ret = PathUtil::Normalize(req.url_path, &clean_path);
+    }
     if(ret < 0)
     {
-        LOG(ERROR) << "ReadAll error! file_path=" << file_path << "\n";
-        return -1;
+        LOG(ERROR) << "Invalid url_path! url_path=" << req.url_path << "\n";
+        co_return -1;
+    }
+    //2.加载了打包文件时优先从打包文件中查找,找不到再去磁盘上找
+    if(bundle_.IsLoaded())
+    {
+        const BundleEntry* entry = NULL;
+        {
+            TraceSpan span("bundle_lookup");
+            entry = bundle_.Find(clean_path);
+        }
+        if(entry != NULL)
+        {
+            co_return ProcessBundleFile(context, entry);
+        }
     }
+    //3.命中缓存时不需要再stat和open
+    {
+        TraceSpan span("file_open");
+        resp->file = co_await OpenStaticFile(clean_path);
+    }
+    if(!resp->file)
+    {
+        LOG(ERROR) << "Open file error! url_path=" << clean_path << "\n";
+        co_return -1;
+    }
+    resp->header["Content-Type"] = FileUtil::GetMimeType(resp->file->path);
+    resp->header["Content-Length"] = std::to_string(resp->file->st.st_size);
+    co_return 0;
+}
+
+// 通过FileCache查找已经打开的文件,没有命中或者需要重新确认时stat/open通过事件循环完成
+// 使用io_uring后端时由内核异步执行,磁盘上的元数据不在缓存中时也不会阻塞事件循环
+Task<OpenFilePtr> HttpServer::OpenStaticFile(const std::string& clean_path)
+{
+    EventLoop* loop = EventLoop::Current();
+    int64_t now = TimeUtil::TimeStamp();
+    bool need_check = false;
+    OpenFilePtr file = file_cache_.Lookup(clean_path, now, &need_check);
+    if(file && need_check)
+    {
+        //超过ttl之后重新确认一次文件没有被修改
+        struct statx stx;
+        struct stat st;
+        int ret = co_await loop->Statx(AT_FDCWD, file->path.c_str(), 0, &stx);
+        FileCache::StatxToStat(stx, &st);
+        if(ret == 0 && FileCache::IsSame(file, st))
+        {
+            file->check_time.store(now, std::memory_order_relaxed);
+            co_return file;
+        }
+        file_cache_.Erase(clean_path, file);
+        file.reset();
+    }
+    if(file)
+    {
+        co_return file;
+    }
+    file = std::make_shared<OpenFile>();
+    file->path = file_cache_.DiskPath(clean_path);
+    //路径是个文件夹时,打开之后才知道,再打开一次文件夹下的index.html
+    for(int i = 0; i < 2; i++)
+    {
+        file->fd = co_await loop->OpenAt(file->path.c_str(), O_RDONLY | O_CLOEXEC);
+        if(file->fd < 0)
+        {
+            co_return OpenFilePtr();
+        }
+        struct statx stx;
+        if(co_await loop->Statx(file->fd, "", AT_EMPTY_PATH, &stx) < 0)
+        {
+            co_return OpenFilePtr();
+        }
+        FileCache::StatxToStat(stx, &file->st);
+        if(!S_ISDIR(file->st.st_mode))
+        {
+            break;
+        }
+        close(file->fd);
+        file->fd = -1;
+        file->path += "/index.html";
+    }
+    if(!S_ISREG(file->st.st_mode))
+    {
+        co_return OpenFilePtr();
+    }
+    co_return file_cache_.Insert(clean_path, file, now);
+}
+
+// 从打包文件中返回静态文件,body直接指向mmap的内存,不需要任何文件系统调用
+// 客户端带了匹配的If-None-Match时返回304,支持gzip时返回预先压缩好的版本
+int HttpServer::ProcessBundleFile(Context* context, const BundleEntry* entry)
+{
+    const Request& req = context->req;
+    Response* resp = &context->resp;
+    resp->header["Content-Type"] = bundle_.MimeType(entry);
+    resp->header["ETag"] = entry->etag;
+    Header::const_iterator it = req.header.find("If-None-Match");
+    if(it != req.header.end() && it->second == entry->etag)
+    {
+        resp->code = 304;
+        resp->desc = "Not Modified";
+        return 0;
+    }
+    resp->mapped_body = bundle_.Data(entry);
+    resp->mapped_len = entry->data_len;
+    if(entry->gzip_len > 0)
+    {
+        resp->header["Vary"] = "Accept-Encoding";
+        it = req.header.find("Accept-Encoding");
+        if(it != req.header.end() && it->second.find("gzip") != std::string::npos)
+        {
+            resp->header["Content-Encoding"] = "gzip";
+            resp->mapped_body = bundle_.GzipData(entry);
+            resp->mapped_len = entry->gzip_len;
+        }
+    }
+    resp->header["Content-Length"] = std::to_string(resp->mapped_len);
     return 0;
 }
 
@@ -351,109 +1049,145 @@ int HttpServer::ProcessStaticFile(Context* context)
 // 例如请求url可能是http://192.268.2.2:9090/
 // 这种情况下url_path是 \ 此时等价于请求 /index.html
 // 如果url_path指向的是一个目录,就尝试在这个目录下访问一个叫做index.html的文件
-void HttpServer::GetFilePath(const std::string& url_path, std::string* file_path)
+// url_path非法(例如通过..越过了根目录)或者找不到普通文件时返回-1,st中是文件的信息
+// stat通过事件循环完成,和OpenStaticFile一样不会阻塞事件循环
+Task<int> HttpServer::GetFilePath(const std::string& url_path, std::string* file_path, struct stat* st)
 {
-    *file_path = "./wwwroot" + url_path;
-    std::cerr << *file_path << std::endl;
-
-    // 判定一个路径是普通文件还是目录文件
-    // 1.linux的stat函数,可以查看文件类型
-    // 2.通过boost filesystem模块来进行判定
-    // 如果当前文件是一个目录,就可以进行一个文件名拼接,拼接上index.html后缀
-    if(FileUtil::IsDir(*file_path))
+    std::string clean_path;
+    if(PathUtil::Normalize(url_path, &clean_path) < 0)
+    {
+        co_return -1;
+    }
+    EventLoop* loop = EventLoop::Current();
+    *file_path = file_cache_.DiskPath(clean_path);
+    for(int i = 0; i < 2; i++)
     {
-        //路径是个文件夹，默认返回文件夹下的index.html
-        //1./image/
-        //2./image
-        if(file_path->back() != '/')
+        struct statx stx;
+        int ret = co_await loop->Statx(AT_FDCWD, file_path->c_str(), 0, &stx);
+        if(ret < 0)
         {
-            file_path->push_back('/');
+            co_return -1;
         }
-        (*file_path) += "index.html";
+        FileCache::StatxToStat(stx, st);
+        if(!S_ISDIR(st->st_mode))
+        {
+            break;
+        }
+        (*file_path) += "/index.html";
     }
-    return;
+    co_return S_ISREG(st->st_mode) ? 0 : -1;
 }
 
 // 处理CGI请求
-int HttpServer::ProcessCGI(Context* context)
+// 开启了缓存的路由上的GET请求先查缓存,同样的请求正在执行时等待它的结果,避免重复fork
+// 限流是为了限制fork的频率,所以只有真正需要执行CGI(LEADER/MISS)的请求才消耗令牌
+Task<int> HttpServer::ProcessCGI(Context* context)
+{
+    const Request& req = context->req;
+    Response* resp = &context->resp;
+    std::string clean_path;
+    if(req.method != "GET" || PathUtil::Normalize(req.url_path, &clean_path) < 0
+       || !cgi_cache_.IsEnabled(clean_path))
+    {
+        if(!limiter_.Allow(context->peer_ip, ROUTE_CGI))
+        {
+            co_return Process429(context);
+        }
+        co_return co_await RunCGI(context);
+    }
+    std::string key = CgiCache::MakeKey(clean_path, req.query_string);
+    CgiCache::Result result = CgiCache::MISS;
+    {
+        TraceSpan span("cgi_cache");
+        //同样的请求正在执行时,挂起这个协程等leader的通知,事件循环线程不会被阻塞
+        std::shared_ptr<LoopEvent> event = std::make_shared<LoopEvent>(context->conn->Loop());
+        CgiCache::FlightPtr flight;
+        result = cgi_cache_.TryAcquire(key, &resp->cgi_resp, [event]{ event->Set(); }, &flight);
+        if(result == CgiCache::WAIT)
+        {
+            co_await event->Wait(TimeUtil::MonotonicMS() + cgi_cache_.WaitMs());
+            result = cgi_cache_.Collect(flight, &resp->cgi_resp);
+        }
+    }
+    if(result == CgiCache::HIT)
+    {
+        co_return 0;
+    }
+    if(!limiter_.Allow(context->peer_ip, ROUTE_CGI))
+    {
+        if(result == CgiCache::LEADER)
+        {
+            //被限流的leader不执行CGI,等待它的请求各自去执行
+            cgi_cache_.Finish(key, clean_path, "", false);
+        }
+        co_return Process429(context);
+    }
+    int ret = co_await RunCGI(context);
+    if(result == CgiCache::LEADER)
+    {
+        cgi_cache_.Finish(key, clean_path, resp->cgi_resp, ret == 0 && !resp->cgi_resp.empty());
+    }
+    co_return ret;
+}
+
+// fork子进程执行CGI程序,CGI程序的输出放到resp->cgi_resp中
+// 多线程的进程fork之后,子进程里只能调用异步信号安全的函数(别的线程fork时可能正持有malloc的锁)
+// 所以路径检查和环境变量的拼接都在fork之前完成,子进程只做dup2和exec
+Task<int> HttpServer::RunCGI(Context* context)
 {
     const Request& req = context->req;
     Response* resp = &context->resp;
 
-    //1.创建一对匿名管道（父子进程要双向通信）
-    int fd1[2],fd2[2];
-    pipe(fd1);
-    pipe(fd2);
-    int father_write = fd1[1];
-    int child_read = fd1[0];
-    int father_read = fd2[0];
-    int child_write = fd2[1];
-    // 创建子进程
-    pid_t ret = fork();
+    //1.找到要执行的CGI程序,路径非法、不存在或者不可执行时直接返回,不需要fork
+    //没有任何执行权限的文件直接返回,其他权限问题由execve失败时处理
+    std::string file_path;
+    struct stat st;
+    int ret = co_await GetFilePath(req.url_path, &file_path, &st);
+    if(ret < 0 || (st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)) == 0)
+    {
+        LOG(ERROR) << "CGI not found! url_path=" << req.url_path << "\n";
+        co_return -1;
+    }
 
-    if(ret < 0)
+    //2.准备环境变量:继承服务器自己的环境变量,再加上这次请求的参数
+    std::vector<std::string> vars;
+    vars.push_back("METHOD=" + req.method);
+    if(req.method == "GET")
     {
-        perror("fork");
-        goto END;    
+        // QUERY_STRING请求参数
+        vars.push_back("QUERY_STRING=" + req.query_string);
     }
-    if(ret > 0)
+    else if(req.method == "POST")
     {
-        //3.fork 父进程流程
-        close(child_read);
-        close(child_write);
-        // 如果是POST请求，父进程就要把body写入到管道中
-        if(req.method == "POST")
+        // POST方法，就设置CONTENT_LENGTH
+        Header::const_iterator pos = req.header.find("Content-Length");
+        if(pos != req.header.end())
         {
-            write(father_write, req.body.c_str(), req.body.size());
+            vars.push_back("CONTENT_LENGTH=" + pos->second);
         }
-        // 阻塞式的读取管道，尝试把子进程的结果读取出来，并且放到 Response对象中
-        FileUtil::ReadAll(father_read, &resp->cgi_resp);
-        // 对子进程进行进程等待为了避免僵尸进程
-        wait(NULL);
     }
-    else
+    std::vector<char*> envp;
+    for(char** env = environ; *env != NULL; ++env)
     {
-      //设置环境变量
-      std::string env = "METHOD=" + req.method;
-      putenv(const_cast<char*>(env.c_str()));
-
-      if(req.method == "GET")
-      {
-          // QUERY_STRING请求参数
-          env = "QUERY_STRING=" + req.query_string;
-          putenv(const_cast<char*>(env.c_str()));
-      }
-      else if(req.method == "POST")
-      {
-          // POST方法，就设置CONTENT_LENGTH
-          auto pos = req.header.find("Content-Length");
-          env = "CONTENT_LENGTH=" + pos->second;
-          putenv(const_cast<char*>(env.c_str()));
-      }
-      // fork 子进程流程
-      close(father_read);
-      close(father_write);
-      // 把标准输入输出进行重定向
-      dup2(child_read,0);
-      dup2(child_write,1);
-      // 先获取到要替换的可执行文件是哪个（通过url_path来获取）
-      std::string file_path;
-      GetFilePath(req.url_path,&file_path);
-      // 进行进程的程序替换
-      execl(file_path.c_str(),file_path.c_str(),NULL);
-      // 有我们的CGI可执行程序完成动态页面的计算，并且写回数据到管道
-      // 这部分逻辑，我们需要放到另外单独的文件中实现，并且根据该文件
-      // 编译生成我们的CGI可执行程序
-      //执行到这里说明替换失败了
-      //std::cerr << "替换失败" << std::endl;
-    }
-END:
-    //统一处理收尾工作
-    close(father_read);
-    close(father_write);
-    close(child_read);
-    close(child_write);
-    return 0;
+        //同名的变量以这次请求为准
+        if(strncmp(*env, "METHOD=", 7) != 0 && strncmp(*env, "QUERY_STRING=", 13) != 0
+           && strncmp(*env, "CONTENT_LENGTH=", 15) != 0)
+        {
+            envp.push_back(*env);
+        }
+    }
+    for(size_t i = 0; i < vars.size(); i++)
+    {
+        envp.push_back(&vars[i][0]);
+    }
+    envp.push_back(NULL);
+    char* argv[] = {&file_path[0], NULL};
+
+    //3.在事件循环中执行CGI程序,超过kCgiTimeoutMs还没有结束就杀掉
+    static const std::string kEmptyInput;
+    CgiProcess cgi(context->conn->Loop());
+    co_return co_await cgi.Run(argv, &envp[0], req.method == "POST" ? req.body : kEmptyInput,
+                               &resp->cgi_resp, TimeUtil::MonotonicMS() + kCgiTimeoutMs);
 }
 
 // 测试函数
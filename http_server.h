@@ -1,6 +1,18 @@
 #pragma once
 #include <string>
 #include <unordered_map>
+#include <stdint.h>
+#include <sys/types.h>
+#include "rate_limiter.hpp"
+#include "util.hpp"
+#include "coroutine.hpp"
+#include "event_loop.h"
+#include "connection.h"
+#include "file_cache.hpp"
+#include "bundle.hpp"
+#include "cgi_cache.hpp"
+#include "trace.hpp"
+#include "http2_session.h"
 
 namespace http_server{
 
@@ -28,6 +40,9 @@ struct Response{
     //并且cgi_resp字段为空
     Header header;   //响应报文中的header数据
     std::string body;//响应报文中的body数据
+    OpenFilePtr file;//静态文件,不为空时代替body,写回时直接sendfile
+    const char* mapped_body = NULL;//打包文件中的静态文件,不为空时代替body
+    size_t mapped_len = 0;
 
     /*下面这个变量专门给CGI来使用,如果当前请求时CGI*/
     //cgi_resp就会被CGI程序进行填充
@@ -44,36 +59,89 @@ class HttpServer;
 struct Context{
     Request req;
     Response resp;
-    int new_sock;
-    HttpServer* server;
+    Connection* conn = NULL;  //请求所在的连接,HTTP/2的多个stream共用一个连接
+    uint32_t peer_ip = 0;  //客户端的IP地址(网络字节序),用于限流
+    bool http2 = false;  //收到了HTTP/2的连接前言(prior knowledge)
+    uint64_t accept_us = 0;  //accept的时间,追踪请求时作为请求的开始时间
+    HttpServer* server = NULL;
+    TraceContext trace;  //这个请求的追踪记录
 };
 
 //HTTP服务器核心流程的类
 class HttpServer{
+    //HTTP/2的每个stream都要复用请求的解析和处理流程
+    friend class Http2Session;
 public:
+    HttpServer();
     /*以下的几个函数,返回0表示成功,返回小于0的值表示执行失败*/
     int Start(const std::string& ip,short port);
+    //设置某一类请求的限流参数,burst为0表示不限流
+    void SetRateLimit(RouteClass rc, uint32_t burst, uint32_t rate);
+    //设置事件循环线程数,0表示和CPU核数相同,需要在Start之前调用,多进程模式下是每个worker进程的线程数
+    void SetThreadNum(int thread_num);
+    //设置worker进程数,0表示单进程模式,需要在Start之前调用
+    void SetWorkerNum(int worker_num);
+    //选择事件循环的IO后端,默认epoll,内核不支持io_uring时退回到epoll
+    void SetBackend(IoBackend backend);
+    //加载打包好的静态站点,静态文件优先从打包文件中返回
+    int LoadBundle(const std::string& path);
+    //对url_path上的CGI GET请求开启结果缓存,default_ttl为CGI程序没有指定时的缓存时间(秒)
+    void EnableCgiCache(const std::string& url_path, int default_ttl);
+    //开启请求追踪,每sample_rate个请求采样一个,耗时超过slow_ms毫秒的请求全部保留
+    //记录可以通过SIGUSR1导出到trace-<pid>.json,或者从本机访问/__trace
+    void EnableTrace(uint32_t sample_rate, uint32_t slow_ms);
 
 private:
+    //处理一个连接的协程
+    Task<void> ServeConnection(Connection* conn, uint32_t peer_ip, uint64_t accept_us);
     //从socket中读取一个Request
-    int ReadOneRequest(Context* context);
+    Task<int> ReadOneRequest(Context* context);
     //根据Response对象,拼接成一个字符串,写回到客户端
-    int WriteOneResponse(Context* context);
+    Task<int> WriteOneResponse(Context* context);
     //根据Request对象,构造Response对象
-    int HandlerRequest(Context* context);
+    Task<int> HandlerRequest(Context* context);
     //构造404页面
     int Process404(Context* context);
+    //构造429页面(请求过于频繁)
+    int Process429(Context* context);
+    //返回追踪记录
+    int ProcessTrace(Context* context);
     //处理静态页面
-    int ProcessStaticFile(Context* context);
+    Task<int> ProcessStaticFile(Context* context);
+    //从文件缓存中获取文件,没有命中时通过事件循环打开
+    Task<OpenFilePtr> OpenStaticFile(const std::string& clean_path);
+    //处理打包文件中的静态页面
+    int ProcessBundleFile(Context* context, const BundleEntry* entry);
     //处理动态页面(CGI)
-    int ProcessCGI(Context* context);
+    Task<int> ProcessCGI(Context* context);
+    //fork并执行CGI程序
+    Task<int> RunCGI(Context* context);
 private:
-    static void* ThreadEntry(void* arg);
+    int CreateListenSocket(const std::string& ip, short port);
+    //master进程的主循环,管理worker进程
+    int RunMaster(int listen_sock);
+    pid_t SpawnWorker(int listen_sock);
+    //exec新的可执行文件,返回新进程的pid
+    pid_t Upgrade(int listen_sock);
+    //启动事件循环线程,处理连接直到收到退出信号
+    int RunWorker(int listen_sock);
+    //每个事件循环上的accept协程,收到退出信号之后结束
+    Task<void> AcceptLoop(EventLoop* loop, int listen_sock);
+    int DumpTraceFile();
+    static void* LoopEntry(void* arg);
     int ParseFirstLine(const std::string& first_line,std::string* method,std::string* url);
     int ParseUrl(const std::string& url,std::string* url_path,std::string* query_string);
     int ParseHeader(const std::string& header_line,Header* header);
-    void GetFilePath(const std::string& url_path,std::string* file_path);
+    Task<int> GetFilePath(const std::string& url_path,std::string* file_path,struct stat* st);
     //测试函数
     void PrintRequest(const Request& req);
+private:
+    RateLimiter limiter_;
+    int thread_num_;
+    int worker_num_;
+    IoBackend backend_;
+    FileCache file_cache_;
+    Bundle bundle_;
+    CgiCache cgi_cache_;
 };
 } 
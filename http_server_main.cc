@@ -1,15 +1,118 @@
 #include "http_server.h"
 #include<iostream>
+#include<stdlib.h>
+#include<unistd.h>
 
 using namespace http_server;
 
 int main(int argc,char* argv[])
 {
-    if(argc != 3)
+    HttpServer server;
+    // -b 打包好的静态站点文件 -c 开启结果缓存的CGI路径[:秒] -t 事件循环线程数(默认和CPU核数相同) -w worker进程数
+    // -T 请求追踪的采样比例[:慢请求的毫秒数] -r 某一类请求的限流参数,可以指定多次
+    // -e IO后端,epoll(默认)或者uring
+    int opt = 0;
+    while((opt = getopt(argc, argv, "b:c:t:w:T:r:e:")) != -1)
+    {
+        if(opt == 'b')
+        {
+            if(server.LoadBundle(optarg) < 0)
+            {
+                return 1;
+            }
+        }
+        else if(opt == 'c')
+        {
+            // 形如/cgi_code/cgi_index:10,冒号后面是默认的缓存时间
+            std::string route = optarg;
+            int ttl = 10;
+            size_t pos = route.rfind(':');
+            if(pos != std::string::npos)
+            {
+                ttl = atoi(route.c_str() + pos + 1);
+                route.resize(pos);
+            }
+            server.EnableCgiCache(route, ttl);
+        }
+        else if(opt == 't')
+        {
+            server.SetThreadNum(atoi(optarg));
+        }
+        else if(opt == 'w')
+        {
+            server.SetWorkerNum(atoi(optarg));
+        }
+        else if(opt == 'e')
+        {
+            std::string backend = optarg;
+            if(backend == "uring")
+            {
+                server.SetBackend(BACKEND_URING);
+            }
+            else if(backend != "epoll")
+            {
+                optind = argc + 1;
+                break;
+            }
+        }
+        else if(opt == 'T')
+        {
+            // 形如100:50,每100个请求采样一个,超过50毫秒的请求全部保留
+            std::string trace = optarg;
+            int slow_ms = 0;
+            size_t pos = trace.find(':');
+            if(pos != std::string::npos)
+            {
+                slow_ms = atoi(trace.c_str() + pos + 1);
+                trace.resize(pos);
+            }
+            server.EnableTrace(atoi(trace.c_str()), slow_ms);
+        }
+        else if(opt == 'r')
+        {
+            // 形如cgi:50:20,桶的容量为50,每秒补充20个令牌,省略补充速度时与容量相同
+            // 容量为0表示这一类请求不限流,例如static:0
+            std::string limit = optarg;
+            size_t pos = limit.find(':');
+            if(pos == std::string::npos)
+            {
+                optind = argc + 1;
+                break;
+            }
+            std::string route = limit.substr(0, pos);
+            RouteClass rc = ROUTE_CLASS_NUM;
+            if(route == "static")
+            {
+                rc = ROUTE_STATIC;
+            }
+            else if(route == "cgi")
+            {
+                rc = ROUTE_CGI;
+            }
+            if(rc == ROUTE_CLASS_NUM)
+            {
+                optind = argc + 1;
+                break;
+            }
+            uint32_t burst = strtoul(limit.c_str() + pos + 1, NULL, 10);
+            uint32_t rate = burst;
+            pos = limit.find(':', pos + 1);
+            if(pos != std::string::npos)
+            {
+                rate = strtoul(limit.c_str() + pos + 1, NULL, 10);
+            }
+            server.SetRateLimit(rc, burst, rate);
+        }
+        else
+        {
+            optind = argc + 1;
+            break;
+        }
+    }
+    if(argc - optind != 2)
     {
-        std::cout << "Usage:./server [ip] [port]" << std::endl;
+        std::cout << "Usage:./server [ip] [port] [-b bundle] [-c cgi_path[:ttl]] [-t threads] [-w workers] [-T rate[:slow_ms]] [-r static|cgi:burst[:rate]] [-e epoll|uring]" << std::endl;
         return 1;
     }
-    HttpServer server;
-    server.Start(argv[1],atoi(argv[2]));
+    server.Start(argv[optind],atoi(argv[optind + 1]));
 }
@@ -0,0 +1,244 @@
+#pragma once
+#include <atomic>
+#include <new>
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+
+namespace http_server{
+
+// 限流时区分的请求类型,每种类型有各自独立的令牌桶
+enum RouteClass{
+    ROUTE_STATIC,    //静态文件
+    ROUTE_CGI,       //CGI动态页面
+    ROUTE_CLASS_NUM,
+};
+
+// 按客户端IP进行限流的令牌桶表
+// 1.整张表按照IP的哈希值分成若干个分片,每个分片是一个开放寻址(线性探测)的数组
+// 2.每个槽位保存一个IP以及这个IP在每种请求类型上的令牌桶
+// 3.令牌桶的剩余令牌数和上次补充的时间打包到一个64位整数中,通过CAS原子更新,不需要加锁
+// 4.长时间没有访问的槽位不会主动清理,而是在插入新IP时发现它已经空闲才复用(惰性过期)
+// 5.整张表放在MAP_SHARED的匿名内存中,fork出来的worker进程共用同一张表,限流额度不会随worker数放大
+class RateLimiter{
+public:
+    RateLimiter()
+        :shards_(NULL)
+        ,shared_(true)
+        ,idle_ms_(60 * 1000)
+    {
+        void* addr = mmap(NULL, sizeof(Shard) * kShardNum, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if(addr == MAP_FAILED)
+        {
+            //拿不到共享内存时退化成每个进程各自一张表
+            addr = ::operator new(sizeof(Shard) * kShardNum);
+            shared_ = false;
+        }
+        shards_ = static_cast<Shard*>(addr);
+        for(int i = 0; i < kShardNum; i++)
+        {
+            new (&shards_[i]) Shard;
+            for(int j = 0; j < kSlotsPerShard; j++)
+            {
+                Slot& slot = shards_[i].slots[j];
+                slot.key.store(0, std::memory_order_relaxed);
+                for(int k = 0; k < ROUTE_CLASS_NUM; k++)
+                {
+                    slot.bucket[k].store(0, std::memory_order_relaxed);
+                }
+            }
+        }
+        // 默认限制:静态文件宽松一些,CGI每次都要fork,限制得更严
+        SetLimit(ROUTE_STATIC, 200, 100);
+        SetLimit(ROUTE_CGI, 20, 10);
+        epoch_ms_ = NowMs();
+    }
+
+    ~RateLimiter()
+    {
+        if(shared_)
+        {
+            munmap(shards_, sizeof(Shard) * kShardNum);
+        }
+        else
+        {
+            ::operator delete(shards_);
+        }
+    }
+
+    // burst为桶的容量,rate为每秒补充的令牌数
+    // burst为0表示这一类请求不限流
+    void SetLimit(RouteClass rc, uint32_t burst, uint32_t rate)
+    {
+        if(burst > kMaxBurst)
+        {
+            burst = kMaxBurst;
+        }
+        limits_[rc].burst = burst;
+        limits_[rc].rate = rate;
+    }
+
+    // 判断来自ip的一个rc类请求是否放行,放行时会消耗一个令牌
+    // ip为网络字节序的IPv4地址
+    bool Allow(uint32_t ip, RouteClass rc)
+    {
+        return Allow(ip, rc, NowMs() - epoch_ms_);
+    }
+
+    // 同上,now_ms为限流器创建以来经过的毫秒数,测试时可以直接指定时间
+    bool Allow(uint32_t ip, RouteClass rc, uint64_t now_ms)
+    {
+        const Limit& limit = limits_[rc];
+        if(limit.burst == 0)
+        {
+            return true;
+        }
+        //时间为0的桶表示还没有使用过,所以整体往后错开1毫秒
+        uint64_t now = now_ms + 1;
+        Slot* slot = FindSlot(ip, now);
+        if(slot == NULL)
+        {
+            // 探测范围内没有可用的槽位,宁可放行也不误伤正常客户端
+            return true;
+        }
+        std::atomic<uint64_t>& bucket = slot->bucket[rc];
+        uint64_t old_value = bucket.load(std::memory_order_relaxed);
+        while(true)
+        {
+            uint64_t last = now;
+            uint64_t tokens = (uint64_t)limit.burst * 1000;
+            if(old_value != 0)
+            {
+                last = old_value >> kTokenBits;
+                tokens = old_value & kTokenMask;
+                if(now > last)
+                {
+                    //按照流逝的毫秒数补充令牌,令牌以千分之一为单位存储
+                    tokens += (now - last) * limit.rate;
+                    if(tokens > (uint64_t)limit.burst * 1000)
+                    {
+                        tokens = (uint64_t)limit.burst * 1000;
+                    }
+                    last = now;
+                }
+            }
+            if(tokens < 1000)
+            {
+                return false;
+            }
+            tokens -= 1000;
+            uint64_t new_value = (last << kTokenBits) | tokens;
+            if(bucket.compare_exchange_weak(old_value, new_value, std::memory_order_relaxed))
+            {
+                return true;
+            }
+        }
+    }
+
+private:
+    RateLimiter(const RateLimiter&);
+    RateLimiter& operator=(const RateLimiter&);
+
+    static const int kShardBits = 4;
+    static const int kShardNum = 1 << kShardBits;
+    static const int kSlotsPerShard = 4096;  //必须是2的幂
+    static const int kMaxProbe = 16;
+    // 打包格式:高40位为上次补充的时间(毫秒),低24位为剩余令牌数(千分之一个)
+    static const int kTokenBits = 24;
+    static const uint64_t kTokenMask = (1ULL << kTokenBits) - 1;
+    static const uint32_t kMaxBurst = kTokenMask / 1000;
+
+    struct Limit{
+        uint32_t burst;
+        uint32_t rate;
+    };
+
+    struct Slot{
+        std::atomic<uint32_t> key;  //0表示空槽位
+        std::atomic<uint64_t> bucket[ROUTE_CLASS_NUM];
+    };
+
+    struct Shard{
+        Slot slots[kSlotsPerShard];
+    };
+
+    // 使用粗粒度的单调时钟,走vDSO不会陷入内核
+    static uint64_t NowMs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+
+    bool IsIdle(Slot& slot, uint64_t now)
+    {
+        for(int i = 0; i < ROUTE_CLASS_NUM; i++)
+        {
+            uint64_t value = slot.bucket[i].load(std::memory_order_relaxed);
+            if(value != 0 && (value >> kTokenBits) + idle_ms_ > now)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void ResetSlot(Slot& slot)
+    {
+        for(int i = 0; i < ROUTE_CLASS_NUM; i++)
+        {
+            slot.bucket[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // 查找ip对应的槽位,没有的话就占用一个空槽位或者复用一个空闲过期的槽位
+    Slot* FindSlot(uint32_t ip, uint64_t now)
+    {
+        uint32_t hash = ip * 2654435761U;
+        Shard& shard = shards_[hash >> (32 - kShardBits)];
+        Slot* expired = NULL;
+        uint32_t expired_key = 0;
+        for(int i = 0; i < kMaxProbe; i++)
+        {
+            Slot& slot = shard.slots[(hash + i) & (kSlotsPerShard - 1)];
+            uint32_t key = slot.key.load(std::memory_order_acquire);
+            if(key == ip)
+            {
+                return &slot;
+            }
+            if(key == 0)
+            {
+                if(slot.key.compare_exchange_strong(key, ip, std::memory_order_acq_rel))
+                {
+                    return &slot;
+                }
+                //被别的线程抢先占用了,看看是不是同一个ip
+                if(key == ip)
+                {
+                    return &slot;
+                }
+            }
+            if(expired == NULL && IsIdle(slot, now))
+            {
+                expired = &slot;
+                expired_key = key;
+            }
+        }
+        // 复用过期槽位时,旧ip并发进行的更新可能会残留在桶里,这点误差可以接受
+        if(expired != NULL
+           && expired->key.compare_exchange_strong(expired_key, ip, std::memory_order_acq_rel))
+        {
+            ResetSlot(*expired);
+            return expired;
+        }
+        return NULL;
+    }
+
+    Shard* shards_;
+    bool shared_;
+    Limit limits_[ROUTE_CLASS_NUM];
+    uint64_t epoch_ms_;
+    uint64_t idle_ms_;
+};
+}
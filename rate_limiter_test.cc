@@ -0,0 +1,141 @@
+#include "rate_limiter.hpp"
+#include "unit_test.hpp"
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace http_server;
+
+static const uint32_t kIp = 0x0100007f;    //127.0.0.1
+
+TEST(BurstThenDeny)
+{
+    RateLimiter limiter;
+    limiter.SetLimit(ROUTE_CGI, 3, 2);
+    for(int i = 0; i < 3; i++)
+    {
+        EXPECT_TRUE(limiter.Allow(kIp, ROUTE_CGI, 0));
+    }
+    EXPECT_FALSE(limiter.Allow(kIp, ROUTE_CGI, 0));
+}
+
+TEST(RefillByElapsedMilliseconds)
+{
+    RateLimiter limiter;
+    limiter.SetLimit(ROUTE_CGI, 3, 2);
+    for(int i = 0; i < 3; i++)
+    {
+        limiter.Allow(kIp, ROUTE_CGI, 1000);
+    }
+    //每秒2个令牌,499毫秒只补充了0.998个
+    EXPECT_FALSE(limiter.Allow(kIp, ROUTE_CGI, 1499));
+    //前面被拒绝的请求不消耗令牌,到500毫秒时正好补满一个
+    EXPECT_TRUE(limiter.Allow(kIp, ROUTE_CGI, 1500));
+    EXPECT_FALSE(limiter.Allow(kIp, ROUTE_CGI, 1500));
+    //被拒绝时不更新补充时间,零头不会丢失:1500到1999补充了0.998个,再过1毫秒凑满
+    EXPECT_FALSE(limiter.Allow(kIp, ROUTE_CGI, 1999));
+    EXPECT_TRUE(limiter.Allow(kIp, ROUTE_CGI, 2000));
+}
+
+TEST(RefillCappedAtBurst)
+{
+    RateLimiter limiter;
+    limiter.SetLimit(ROUTE_STATIC, 5, 100);
+    for(int i = 0; i < 5; i++)
+    {
+        limiter.Allow(kIp, ROUTE_STATIC, 0);
+    }
+    int allowed = 0;
+    for(int i = 0; i < 10; i++)
+    {
+        allowed += limiter.Allow(kIp, ROUTE_STATIC, 3600 * 1000) ? 1 : 0;
+    }
+    EXPECT_EQ(5, allowed);
+}
+
+TEST(ClassesAndIpsAreIndependent)
+{
+    RateLimiter limiter;
+    limiter.SetLimit(ROUTE_STATIC, 1, 1);
+    limiter.SetLimit(ROUTE_CGI, 1, 1);
+    EXPECT_TRUE(limiter.Allow(kIp, ROUTE_CGI, 0));
+    EXPECT_FALSE(limiter.Allow(kIp, ROUTE_CGI, 0));
+    EXPECT_TRUE(limiter.Allow(kIp, ROUTE_STATIC, 0));
+    EXPECT_TRUE(limiter.Allow(kIp + 1, ROUTE_CGI, 0));
+}
+
+TEST(ZeroBurstDisablesLimit)
+{
+    RateLimiter limiter;
+    limiter.SetLimit(ROUTE_CGI, 0, 0);
+    for(int i = 0; i < 1000; i++)
+    {
+        EXPECT_TRUE(limiter.Allow(kIp, ROUTE_CGI, 0));
+    }
+}
+
+TEST(BurstClampedToTokenBits)
+{
+    RateLimiter limiter;
+    limiter.SetLimit(ROUTE_STATIC, 1000000, 1);
+    int allowed = 0;
+    while(allowed < 1000000 && limiter.Allow(kIp, ROUTE_STATIC, 0))
+    {
+        ++allowed;
+    }
+    //令牌数占24位,以千分之一为单位,最多16777个
+    EXPECT_EQ(16777, allowed);
+}
+
+// 找出17个探测范围完全相同的ip,前16个占满探测范围
+static void FindCollidingIps(std::vector<uint32_t>* ips)
+{
+    uint32_t base = 1U * 2654435761U;
+    for(uint32_t ip = 1; ips->size() < 17; ip++)
+    {
+        uint32_t hash = ip * 2654435761U;
+        if((hash & 0xF0000FFF) == (base & 0xF0000FFF))
+        {
+            ips->push_back(ip);
+        }
+    }
+}
+
+TEST(FullProbeWindowFailsOpenThenExpires)
+{
+    RateLimiter limiter;
+    limiter.SetLimit(ROUTE_CGI, 1, 1);
+    std::vector<uint32_t> ips;
+    FindCollidingIps(&ips);
+    for(int i = 0; i < 16; i++)
+    {
+        EXPECT_TRUE(limiter.Allow(ips[i], ROUTE_CGI, 0));
+    }
+    //没有空槽位时宁可放行
+    EXPECT_TRUE(limiter.Allow(ips[16], ROUTE_CGI, 0));
+    EXPECT_TRUE(limiter.Allow(ips[16], ROUTE_CGI, 0));
+    //空闲超过60秒的槽位被惰性复用,之后正常限流
+    EXPECT_TRUE(limiter.Allow(ips[16], ROUTE_CGI, 61 * 1000));
+    EXPECT_FALSE(limiter.Allow(ips[16], ROUTE_CGI, 61 * 1000));
+}
+
+TEST(TableSharedAcrossFork)
+{
+    RateLimiter limiter;
+    limiter.SetLimit(ROUTE_CGI, 2, 1);
+    pid_t pid = fork();
+    if(pid == 0)
+    {
+        //worker进程消耗掉一个令牌
+        _exit(limiter.Allow(kIp, ROUTE_CGI, 0) ? 0 : 1);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    EXPECT_TRUE(limiter.Allow(kIp, ROUTE_CGI, 0));
+    EXPECT_FALSE(limiter.Allow(kIp, ROUTE_CGI, 0));
+}
+
+int main()
+{
+    return unit_test::RunAll();
+}
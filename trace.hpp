@@ -0,0 +1,369 @@
+#pragma once
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <string>
+#include <vector>
+
+namespace http_server{
+
+// 一个已经结束的span,name必须是字符串常量(只保存指针)
+struct TraceEvent{
+    const char* name;
+    uint64_t start_us;
+    uint64_t dur_us;
+    uint64_t req_id;
+    char detail[64];     //附加信息,例如请求的url,没有的话为空串
+};
+
+// 请求还没有结束时记录下来的span
+struct TracePending{
+    const char* name;
+    uint64_t start_us;
+    uint64_t dur_us;
+};
+
+// 一个请求的追踪状态,放在请求的Context中
+// 同一个线程上的多个请求在事件循环中交替执行,事件循环恢复某个请求的协程之前,
+// 把它的TraceContext切换成当前线程的当前请求,span总是记到正确的请求上
+struct TraceContext{
+    static const size_t kMaxPending = 64;  //一个请求最多记录的span数,多出来的丢弃
+    TraceContext() :active(false), start_us(0), pending_num(0) { detail[0] = '\0'; }
+    bool active;
+    uint64_t start_us;
+    char detail[64];
+    size_t pending_num;
+    TracePending pending[kMaxPending];
+};
+
+// 按请求采样的追踪
+// 1.请求中的每个span先记到请求自己的TraceContext里,不加锁也不分配内存
+// 2.请求结束时决定是否保留:每N个请求保留一个,或者整个请求的耗时超过了阈值
+// 3.保留的请求连同它的所有span一起拷贝到结束它的线程的环形缓冲区中,缓冲区满了覆盖最旧的记录
+// 4.每个线程的缓冲区第一次使用时注册到全局列表中,导出时逐个加锁拷贝出来,生成Chrome的trace_event格式
+// 当前线程没有在追踪请求时,每个span只多一次线程局部变量的判断
+class Tracer{
+public:
+    // sample_rate为N表示每N个请求采样一个,0表示不按比例采样
+    // slow_ms大于0时,耗时超过slow_ms毫秒的请求一定会被保留
+    // 需要在服务器开始处理请求之前调用
+    static void Enable(uint32_t sample_rate, uint32_t slow_ms)
+    {
+        Config& config = GetConfig();
+        config.sample_rate = sample_rate;
+        config.slow_us = (uint64_t)slow_ms * 1000;
+        config.enabled = sample_rate > 0 || slow_ms > 0;
+    }
+
+    static bool IsEnabled()
+    {
+        return GetConfig().enabled;
+    }
+
+    // 当前线程正在执行的请求是否在被追踪
+    static bool IsActive()
+    {
+        TraceContext* context = Current();
+        return context != NULL && context->active;
+    }
+
+    static uint64_t NowUs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+
+    // 当前线程正在执行的请求,没有时为NULL
+    static TraceContext*& Current()
+    {
+        static thread_local TraceContext* context = NULL;
+        return context;
+    }
+
+    // 开始追踪一个新的请求并切换成当前请求,start_us为请求开始的时间(例如accept的时间)
+    static void Begin(TraceContext* context, uint64_t start_us)
+    {
+        if(!IsEnabled())
+        {
+            return;
+        }
+        context->active = true;
+        context->start_us = start_us;
+        context->pending_num = 0;
+        context->detail[0] = '\0';
+        Current() = context;
+    }
+
+    // 给当前请求记录一个span,当前请求没有在被追踪时什么也不做
+    static void Record(const char* name, uint64_t start_us, uint64_t end_us)
+    {
+        TraceContext* context = Current();
+        if(context == NULL || !context->active || context->pending_num >= TraceContext::kMaxPending)
+        {
+            return;
+        }
+        TracePending& span = context->pending[context->pending_num++];
+        span.name = name;
+        span.start_us = start_us;
+        span.dur_us = end_us - start_us;
+    }
+
+    // 设置当前请求的附加信息,导出时显示在整个请求的span上
+    static void SetDetail(const std::string& detail)
+    {
+        TraceContext* context = Current();
+        if(context != NULL && context->active)
+        {
+            CopyDetail(context->detail, sizeof(context->detail), detail.c_str());
+        }
+    }
+
+    // 请求处理完毕,根据采样规则决定是否保留到当前线程的环形缓冲区中
+    static void End(TraceContext* context)
+    {
+        if(Current() == context)
+        {
+            Current() = NULL;
+        }
+        if(!context->active)
+        {
+            return;
+        }
+        context->active = false;
+        ThreadTrace* trace = ThreadLocal();
+        const Config& config = GetConfig();
+        uint64_t end_us = NowUs();
+        ++trace->count;
+        bool sampled = config.sample_rate > 0 && trace->count % config.sample_rate == 0;
+        bool slow = config.slow_us > 0 && end_us - context->start_us >= config.slow_us;
+        if(!sampled && !slow)
+        {
+            return;
+        }
+        uint64_t req_id = (trace->tid << 32) | (trace->count & 0xFFFFFFFF);
+        pthread_mutex_lock(&trace->mutex);
+        TraceEvent* request = Append(trace);
+        request->name = "request";
+        request->start_us = context->start_us;
+        request->dur_us = end_us - context->start_us;
+        request->req_id = req_id;
+        memcpy(request->detail, context->detail, sizeof(request->detail));
+        for(size_t i = 0; i < context->pending_num; i++)
+        {
+            TraceEvent* event = Append(trace);
+            event->name = context->pending[i].name;
+            event->start_us = context->pending[i].start_us;
+            event->dur_us = context->pending[i].dur_us;
+            event->req_id = req_id;
+            event->detail[0] = '\0';
+        }
+        pthread_mutex_unlock(&trace->mutex);
+    }
+
+    // 放弃一个请求的追踪,例如连接升级成了HTTP/2,之后按stream分别追踪
+    static void Cancel(TraceContext* context)
+    {
+        context->active = false;
+        if(Current() == context)
+        {
+            Current() = NULL;
+        }
+    }
+
+    // 导出所有线程中保留的请求,格式为Chrome的trace_event JSON,可以直接用Perfetto打开
+    static void Dump(std::string* output)
+    {
+        std::vector<TraceEvent> events;
+        std::vector<uint64_t> tids;
+        Registry& registry = GetRegistry();
+        pthread_mutex_lock(&registry.mutex);
+        for(size_t i = 0; i < registry.traces.size(); i++)
+        {
+            ThreadTrace* trace = registry.traces[i];
+            pthread_mutex_lock(&trace->mutex);
+            //环形缓冲区从最旧的记录开始拷贝
+            size_t first = 0;
+            if(trace->ring_num > kRingSize)
+            {
+                first = trace->ring_num - kRingSize;
+            }
+            for(size_t j = first; j < trace->ring_num; j++)
+            {
+                events.push_back(trace->ring[j % kRingSize]);
+                tids.push_back(trace->tid);
+            }
+            pthread_mutex_unlock(&trace->mutex);
+        }
+        pthread_mutex_unlock(&registry.mutex);
+
+        output->clear();
+        output->reserve(events.size() * 160 + 64);
+        *output += "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        char buf[256];
+        int pid = getpid();
+        for(size_t i = 0; i < events.size(); i++)
+        {
+            const TraceEvent& event = events[i];
+            snprintf(buf, sizeof(buf),
+                     "%s{\"name\":\"%s\",\"cat\":\"http\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,"
+                     "\"pid\":%d,\"tid\":%llu,\"args\":{\"req\":\"%llx\"",
+                     i == 0 ? "" : ",\n", event.name, (unsigned long long)event.start_us,
+                     (unsigned long long)event.dur_us, pid, (unsigned long long)tids[i],
+                     (unsigned long long)event.req_id);
+            *output += buf;
+            if(event.detail[0] != '\0')
+            {
+                *output += ",\"detail\":\"";
+                AppendEscaped(event.detail, output);
+                *output += "\"";
+            }
+            *output += "}}";
+        }
+        *output += "]}\n";
+    }
+
+private:
+    static const size_t kRingSize = 2048;    //每个线程保留的span数
+
+    struct Config{
+        bool enabled;
+        uint32_t sample_rate;
+        uint64_t slow_us;
+    };
+
+    struct ThreadTrace{
+        uint64_t tid;
+        uint64_t count;       //这个线程结束过的请求数,用于按比例采样
+        //保留下来的请求,导出时会被其他线程读取,需要加锁
+        pthread_mutex_t mutex;
+        size_t ring_num;      //写入过的总数,ring_num % kRingSize是下一个写入的位置
+        TraceEvent ring[kRingSize];
+    };
+
+    struct Registry{
+        Registry()
+        {
+            pthread_mutex_init(&mutex, NULL);
+        }
+        pthread_mutex_t mutex;
+        std::vector<ThreadTrace*> traces;
+    };
+
+    static Config& GetConfig()
+    {
+        static Config config = {false, 0, 0};
+        return config;
+    }
+
+    static Registry& GetRegistry()
+    {
+        static Registry registry;
+        return registry;
+    }
+
+    // 当前线程的缓冲区,第一次使用时创建并注册,处理请求的线程不会提前退出,所以不需要释放
+    static ThreadTrace* ThreadLocal()
+    {
+        static thread_local ThreadTrace* trace = NULL;
+        if(trace == NULL)
+        {
+            trace = new ThreadTrace();
+            trace->tid = syscall(SYS_gettid);
+            trace->count = 0;
+            trace->ring_num = 0;
+            pthread_mutex_init(&trace->mutex, NULL);
+            Registry& registry = GetRegistry();
+            pthread_mutex_lock(&registry.mutex);
+            registry.traces.push_back(trace);
+            pthread_mutex_unlock(&registry.mutex);
+        }
+        return trace;
+    }
+
+    static TraceEvent* Append(ThreadTrace* trace)
+    {
+        return &trace->ring[trace->ring_num++ % kRingSize];
+    }
+
+    static void CopyDetail(char* dst, size_t size, const char* src)
+    {
+        strncpy(dst, src, size - 1);
+        dst[size - 1] = '\0';
+    }
+
+    static void AppendEscaped(const char* str, std::string* output)
+    {
+        for(const char* p = str; *p != '\0'; ++p)
+        {
+            unsigned char c = *p;
+            if(c == '"' || c == '\\')
+            {
+                output->push_back('\\');
+                output->push_back(c);
+            }
+            else if(c < 0x20 || c >= 0x80)
+            {
+                //截断的url可能在多字节字符中间断开,非ASCII字符统一转义
+                char buf[8];
+                snprintf(buf, sizeof(buf), "\\u%04x", c);
+                *output += buf;
+            }
+            else
+            {
+                output->push_back(c);
+            }
+        }
+    }
+};
+
+// 记录一个span的辅助类,构造时记下开始时间,析构时结束
+// 用法: { TraceSpan span("parse"); ... }
+class TraceSpan{
+public:
+    explicit TraceSpan(const char* name)
+        :name_(name)
+        ,start_us_(Tracer::IsActive() ? Tracer::NowUs() : 0)
+    {}
+
+    ~TraceSpan()
+    {
+        if(start_us_ != 0)
+        {
+            Tracer::Record(name_, start_us_, Tracer::NowUs());
+        }
+    }
+
+private:
+    TraceSpan(const TraceSpan&);
+    TraceSpan& operator=(const TraceSpan&);
+
+    const char* name_;
+    uint64_t start_us_;
+};
+
+// 追踪一个完整的请求,构造时Begin,析构时End,适合有多个返回点的处理函数
+class TraceRequest{
+public:
+    TraceRequest(TraceContext* context, uint64_t start_us)
+        :context_(context)
+    {
+        Tracer::Begin(context, start_us);
+    }
+
+    ~TraceRequest()
+    {
+        Tracer::End(context_);
+    }
+
+private:
+    TraceRequest(const TraceRequest&);
+    TraceRequest& operator=(const TraceRequest&);
+
+    TraceContext* context_;
+};
+}
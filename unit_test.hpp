@@ -0,0 +1,108 @@
+#pragma once
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+// 单元测试用的简单框架,每个xxx_test.cc编译成一个独立的可执行程序,make test会逐个运行
+// 用法:
+//   TEST(Normalize) { EXPECT_EQ(...); }
+//   int main() { return unit_test::RunAll(); }
+namespace unit_test{
+
+typedef void (*TestFunc)();
+
+struct TestCase{
+    const char* name;
+    TestFunc func;
+};
+
+inline std::vector<TestCase>& Registry()
+{
+    static std::vector<TestCase> tests;
+    return tests;
+}
+
+inline int& Failures()
+{
+    static int failures = 0;
+    return failures;
+}
+
+struct Register{
+    Register(const char* name, TestFunc func)
+    {
+        TestCase test = {name, func};
+        Registry().push_back(test);
+    }
+};
+
+inline void Fail(const char* file, int line, const std::string& message)
+{
+    fprintf(stderr, "%s:%d: %s\n", file, line, message.c_str());
+    ++Failures();
+}
+
+inline std::string ToString(const std::string& value)
+{
+    return "\"" + value + "\"";
+}
+
+inline std::string ToString(const char* value)
+{
+    return ToString(std::string(value));
+}
+
+template<typename T>
+std::string ToString(const T& value)
+{
+    return std::to_string(value);
+}
+
+// 运行所有注册的测试,返回值直接作为main的返回值
+inline int RunAll()
+{
+    std::vector<TestCase>& tests = Registry();
+    int failed = 0;
+    for(size_t i = 0; i < tests.size(); i++)
+    {
+        int before = Failures();
+        tests[i].func();
+        if(Failures() != before)
+        {
+            fprintf(stderr, "[FAIL] %s\n", tests[i].name);
+            ++failed;
+        }
+        else
+        {
+            printf("[ OK ] %s\n", tests[i].name);
+        }
+    }
+    printf("%d/%d passed\n", (int)tests.size() - failed, (int)tests.size());
+    return failed == 0 ? 0 : 1;
+}
+}
+
+#define TEST(name) \
+    static void Test##name(); \
+    static unit_test::Register register_##name(#name, Test##name); \
+    static void Test##name()
+
+#define EXPECT_TRUE(cond) \
+    do { \
+        if(!(cond)) \
+        { \
+            unit_test::Fail(__FILE__, __LINE__, "expected true: " #cond); \
+        } \
+    } while(0)
+
+#define EXPECT_FALSE(cond) EXPECT_TRUE(!(cond))
+
+#define EXPECT_EQ(expected, actual) \
+    do { \
+        if(!((expected) == (actual))) \
+        { \
+            unit_test::Fail(__FILE__, __LINE__, std::string(#actual " is ") \
+                            + unit_test::ToString(actual) + ", expected " \
+                            + unit_test::ToString(expected)); \
+        } \
+    } while(0)
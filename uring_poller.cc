@@ -0,0 +1,820 @@
+#include"uring_poller.h"
+#include"util.hpp"
+#include<errno.h>
+#include<fcntl.h>
+#include<poll.h>
+#include<signal.h>
+#include<stdlib.h>
+#include<string.h>
+#include<unistd.h>
+#include<sys/eventfd.h>
+#include<sys/mman.h>
+#include<sys/socket.h>
+#include<sys/stat.h>
+#include<sys/syscall.h>
+#include<algorithm>
+
+namespace http_server{
+
+static const unsigned kRingEntries = 256;
+static const unsigned kCqEntries = kRingEntries * 4;
+//recv使用的缓冲区:数量必须是2的幂,每个和连接的读缓冲区一样大
+static const unsigned kBufCount = 128;
+static const size_t kBufSize = 4096;
+static const uint16_t kBufGroup = 0;
+//每次splice最多搬运一个管道的容量
+static const size_t kPipeSize = 64 * 1024;
+static const size_t kMaxFreePipes = 16;
+
+//user_data的低3位区分完成事件的来源,IoOp和Acceptor都至少按8字节对齐
+enum{
+    kTagOp = 0,
+    kTagAccept = 1,
+    kTagCancel = 2,
+    kTagWakeup = 3,
+    kTagMask = 7,
+};
+
+//IoOp::stage
+enum{
+    kStageIo = 0,
+    kStagePlainRecv,   //缓冲区环用完了,直接读到调用者的缓冲区
+    kStagePoll,        //返回了EAGAIN,等待fd就绪
+    kStageSpliceIn,    //文件->管道
+    kStageSpliceOut,   //管道->socket
+};
+
+static int SysSetup(unsigned entries, struct io_uring_params* params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int SysEnter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void* arg, size_t arg_size)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int SysRegister(int fd, unsigned opcode, void* arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static bool IsReadOp(IoOpType type)
+{
+    return type == IO_RECV || type == IO_READ || type == IO_POLL_IN;
+}
+
+UringPoller::UringPoller()
+    :ring_fd_(-1)
+    ,sq_ptr_(MAP_FAILED)
+    ,sq_size_(0)
+    ,cq_ptr_(MAP_FAILED)
+    ,cq_size_(0)
+    ,sqes_((struct io_uring_sqe*)MAP_FAILED)
+    ,sqes_size_(0)
+    ,sq_head_(NULL)
+    ,sq_tail_(NULL)
+    ,sq_flags_(NULL)
+    ,sq_array_(NULL)
+    ,sq_mask_(0)
+    ,sq_entries_(0)
+    ,sq_local_tail_(0)
+    ,cq_head_(NULL)
+    ,cq_tail_(NULL)
+    ,cq_mask_(0)
+    ,cqes_(NULL)
+    ,buf_ring_(NULL)
+    ,buf_ring_size_(0)
+    ,bufs_(NULL)
+    ,buf_tail_(0)
+    ,wakeup_fd_(-1)
+    ,wakeup_value_(0)
+    ,multishot_accept_(true)
+{}
+
+UringPoller::~UringPoller()
+{
+    for(size_t i = 0; i < acceptors_.size(); i++)
+    {
+        std::deque<int>& ready = acceptors_[i]->ready;
+        for(size_t j = 0; j < ready.size(); j++)
+        {
+            if(ready[j] >= 0)
+            {
+                close(ready[j]);
+            }
+        }
+    }
+    for(size_t i = 0; i < free_pipes_.size(); i++)
+    {
+        close(free_pipes_[i]);
+    }
+    //关闭ring会取消所有还在内核中的操作,缓冲区环也随之注销
+    if(ring_fd_ >= 0)
+    {
+        close(ring_fd_);
+    }
+    if(buf_ring_ != NULL)
+    {
+        munmap(buf_ring_, buf_ring_size_);
+    }
+    free(bufs_);
+    if(sqes_ != MAP_FAILED)
+    {
+        munmap(sqes_, sqes_size_);
+    }
+    if(cq_ptr_ != MAP_FAILED && cq_ptr_ != sq_ptr_)
+    {
+        munmap(cq_ptr_, cq_size_);
+    }
+    if(sq_ptr_ != MAP_FAILED)
+    {
+        munmap(sq_ptr_, sq_size_);
+    }
+    if(wakeup_fd_ >= 0)
+    {
+        close(wakeup_fd_);
+    }
+}
+
+int UringPoller::Init()
+{
+    if(SetupRing() < 0)
+    {
+        return -1;
+    }
+    //确认内核支持所有用到的操作
+    size_t probe_size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    std::vector<char> probe_buf(probe_size, 0);
+    struct io_uring_probe* probe = reinterpret_cast<struct io_uring_probe*>(&probe_buf[0]);
+    if(SysRegister(ring_fd_, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) < 0)
+    {
+        return -1;
+    }
+    static const uint8_t kRequiredOps[] = {
+        IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_READ, IORING_OP_WRITEV, IORING_OP_ACCEPT,
+        IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL, IORING_OP_SPLICE, IORING_OP_OPENAT, IORING_OP_STATX,
+    };
+    for(size_t i = 0; i < sizeof(kRequiredOps); i++)
+    {
+        uint8_t op = kRequiredOps[i];
+        if(op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+        {
+            errno = ENOTSUP;
+            return -1;
+        }
+    }
+    //缓冲区环需要5.19,不支持时recv直接读到调用者的缓冲区
+    SetupBufferRing();
+    wakeup_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(wakeup_fd_ < 0)
+    {
+        return -1;
+    }
+    ArmWakeup();
+    return 0;
+}
+
+int UringPoller::SetupRing()
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = kCqEntries;
+    ring_fd_ = SysSetup(kRingEntries, &params);
+    if(ring_fd_ < 0 && errno == EINVAL)
+    {
+        //老的内核不认识后面两个标志
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = kCqEntries;
+        ring_fd_ = SysSetup(kRingEntries, &params);
+    }
+    if(ring_fd_ < 0)
+    {
+        return -1;
+    }
+    //需要在等待时带超时(EXT_ARG,5.11),完成队列满了也不能丢事件
+    if(!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP))
+    {
+        errno = ENOTSUP;
+        return -1;
+    }
+    sq_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if(single_mmap)
+    {
+        sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+    }
+    sq_ptr_ = mmap(NULL, sq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+    if(sq_ptr_ == MAP_FAILED)
+    {
+        return -1;
+    }
+    cq_ptr_ = single_mmap ? sq_ptr_
+            : mmap(NULL, cq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+    if(cq_ptr_ == MAP_FAILED)
+    {
+        return -1;
+    }
+    sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes_ = (struct io_uring_sqe*)mmap(NULL, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                       ring_fd_, IORING_OFF_SQES);
+    if(sqes_ == MAP_FAILED)
+    {
+        return -1;
+    }
+    char* sq = static_cast<char*>(sq_ptr_);
+    sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_flags_ = reinterpret_cast<unsigned*>(sq + params.sq_off.flags);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_entries_ = params.sq_entries;
+    sq_local_tail_ = *sq_tail_;
+    char* cq = static_cast<char*>(cq_ptr_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+    return 0;
+}
+
+int UringPoller::SetupBufferRing()
+{
+    buf_ring_size_ = kBufCount * sizeof(struct io_uring_buf);
+    void* ring = mmap(NULL, buf_ring_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ring == MAP_FAILED)
+    {
+        return -1;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring;
+    reg.ring_entries = kBufCount;
+    reg.bgid = kBufGroup;
+    bufs_ = static_cast<char*>(malloc(kBufCount * kBufSize));
+    if(bufs_ == NULL || SysRegister(ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        munmap(ring, buf_ring_size_);
+        free(bufs_);
+        bufs_ = NULL;
+        return -1;
+    }
+    buf_ring_ = static_cast<struct io_uring_buf_ring*>(ring);
+    for(unsigned i = 0; i < kBufCount; i++)
+    {
+        RecycleBuffer(i);
+    }
+    return 0;
+}
+
+// 把缓冲区还给内核,环的tail和第一个缓冲区的resv字段重叠,只能写addr/len/bid
+void UringPoller::RecycleBuffer(uint16_t bid)
+{
+    struct io_uring_buf* buf = &buf_ring_->bufs[buf_tail_ & (kBufCount - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(bufs_ + bid * kBufSize);
+    buf->len = kBufSize;
+    buf->bid = bid;
+    ++buf_tail_;
+    __atomic_store_n(&buf_ring_->tail, buf_tail_, __ATOMIC_RELEASE);
+}
+
+// 取一个空闲的提交项,提交队列满了就先提交给内核
+struct io_uring_sqe* UringPoller::GetSqe()
+{
+    while(sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_)
+    {
+        __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+        if(SysEnter(ring_fd_, sq_local_tail_ - *sq_head_, 0, 0, NULL, 0) < 0 && errno == EBUSY)
+        {
+            //完成队列积压了太多事件,内核暂时不接受提交,先收下来,下一次Wait时交给事件循环
+            Reap(&deferred_);
+        }
+    }
+    unsigned index = sq_local_tail_ & sq_mask_;
+    struct io_uring_sqe* sqe = &sqes_[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array_[index] = index;
+    ++sq_local_tail_;
+    return sqe;
+}
+
+bool UringPoller::Submit(IoOp* op)
+{
+    if(op->type == IO_ACCEPT)
+    {
+        Acceptor* acceptor = GetAcceptor(op->fd);
+        if(!acceptor->ready.empty())
+        {
+            int fd = acceptor->ready.front();
+            acceptor->ready.pop_front();
+            DeliverAccept(op, fd);
+            return false;
+        }
+        if(acceptor->waiter != NULL)
+        {
+            op->result = -EBUSY;
+            return false;
+        }
+        acceptor->waiter = op;
+        if(!acceptor->armed)
+        {
+            ArmAccept(acceptor);
+        }
+        return true;
+    }
+    if(op->type == IO_SENDFILE)
+    {
+        SpliceState* state = new SpliceState();
+        state->piped = 0;
+        state->drained = 0;
+        state->resume = kStageSpliceOut;
+        if(TakePipe(state->pipe_fds) < 0)
+        {
+            delete state;
+            op->result = -errno;
+            return false;
+        }
+        op->backend = state;
+        op->stage = kStageSpliceIn;
+        PrepareSplice(op);
+        return true;
+    }
+    op->stage = kStageIo;
+    PrepareOp(op);
+    return true;
+}
+
+bool UringPoller::Cancel(IoOp* op)
+{
+    if(op->type == IO_ACCEPT)
+    {
+        //只在事件循环退出时取消accept:不再接收新连接,已经accept但是没有取走的连接关闭掉
+        Acceptor* acceptor = GetAcceptor(op->fd);
+        if(acceptor->waiter == op)
+        {
+            acceptor->waiter = NULL;
+        }
+        if(acceptor->armed)
+        {
+            struct io_uring_sqe* sqe = GetSqe();
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = (uint64_t)(uintptr_t)acceptor | kTagAccept;
+            sqe->user_data = kTagCancel;
+        }
+        for(size_t i = 0; i < acceptor->ready.size(); i++)
+        {
+            if(acceptor->ready[i] >= 0)
+            {
+                close(acceptor->ready[i]);
+            }
+        }
+        acceptor->ready.clear();
+        return true;
+    }
+    //操作完成时的结果是-ECANCELED,也可能在取消之前就已经完成了
+    struct io_uring_sqe* sqe = GetSqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uint64_t)(uintptr_t)op;
+    sqe->user_data = kTagCancel;
+    return false;
+}
+
+int UringPoller::Wait(int timeout_ms, std::vector<IoOp*>* done)
+{
+    if(!deferred_.empty())
+    {
+        done->insert(done->end(), deferred_.begin(), deferred_.end());
+        deferred_.clear();
+        timeout_ms = 0;
+    }
+    __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+    unsigned to_submit = sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    if(*cq_head_ != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE))
+    {
+        timeout_ms = 0;
+    }
+    //没有要提交的,完成队列里已经有事件,也不需要内核补做task work时,不用进入内核
+    unsigned sq_flags = __atomic_load_n(sq_flags_, __ATOMIC_RELAXED);
+    if(to_submit > 0 || timeout_ms != 0 || (sq_flags & (IORING_SQ_CQ_OVERFLOW | IORING_SQ_TASKRUN)))
+    {
+        if(Enter(to_submit, timeout_ms) < 0)
+        {
+            return -1;
+        }
+    }
+    size_t old_size = done->size();
+    Reap(done);
+    return (int)(done->size() - old_size);
+}
+
+// 一次系统调用同时提交和等待,timeout_ms为-1表示一直等到有完成事件
+int UringPoller::Enter(unsigned to_submit, int timeout_ms)
+{
+    unsigned flags = IORING_ENTER_GETEVENTS;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    void* arg_ptr = NULL;
+    size_t arg_size = 0;
+    if(timeout_ms > 0)
+    {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        memset(&arg, 0, sizeof(arg));
+        arg.sigmask_sz = _NSIG / 8;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        flags |= IORING_ENTER_EXT_ARG;
+        arg_ptr = &arg;
+        arg_size = sizeof(arg);
+    }
+    int ret = SysEnter(ring_fd_, to_submit, timeout_ms != 0 ? 1 : 0, flags, arg_ptr, arg_size);
+    if(ret < 0 && errno != EINTR && errno != ETIME && errno != EBUSY && errno != EAGAIN)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+void UringPoller::Reap(std::vector<IoOp*>* done)
+{
+    unsigned head = *cq_head_;
+    while(head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE))
+    {
+        struct io_uring_cqe* cqe = &cqes_[head & cq_mask_];
+        uint64_t user_data = cqe->user_data;
+        int res = cqe->res;
+        uint32_t flags = cqe->flags;
+        //先把位置还给内核,处理过程中可能会提交新的操作
+        ++head;
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+        HandleCqe(user_data, res, flags, done);
+    }
+}
+
+void UringPoller::HandleCqe(uint64_t user_data, int res, uint32_t flags, std::vector<IoOp*>* done)
+{
+    switch(user_data & kTagMask)
+    {
+    case kTagOp:
+        HandleOp(reinterpret_cast<IoOp*>((uintptr_t)user_data), res, flags, done);
+        break;
+    case kTagAccept:
+        HandleAccept(reinterpret_cast<Acceptor*>((uintptr_t)(user_data & ~(uint64_t)kTagMask)), res, flags, done);
+        break;
+    case kTagWakeup:
+    {
+        ssize_t ret = read(wakeup_fd_, &wakeup_value_, sizeof(wakeup_value_));
+        (void)ret;
+        if(!(flags & IORING_CQE_F_MORE))
+        {
+            ArmWakeup();
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+void UringPoller::HandleOp(IoOp* op, int res, uint32_t flags, std::vector<IoOp*>* done)
+{
+    if(op->type == IO_RECV && (flags & IORING_CQE_F_BUFFER))
+    {
+        //数据在内核挑选的缓冲区中,拷贝出来之后马上还回去
+        uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        if(res > 0)
+        {
+            memcpy(op->buf, bufs_ + bid * kBufSize, res);
+        }
+        RecycleBuffer(bid);
+    }
+    if(op->stage == kStagePoll)
+    {
+        if(res < 0 || op->timed_out)
+        {
+            Finish(op, res < 0 ? res : -ECANCELED, done);
+            return;
+        }
+        if(op->type == IO_SENDFILE)
+        {
+            op->stage = static_cast<SpliceState*>(op->backend)->resume;
+            PrepareSplice(op);
+        }
+        else
+        {
+            op->stage = kStageIo;
+            PrepareOp(op);
+        }
+        return;
+    }
+    if(op->stage == kStageSpliceIn || op->stage == kStageSpliceOut)
+    {
+        HandleSplice(op, res, done);
+        return;
+    }
+    if(op->timed_out && res < 0)
+    {
+        Finish(op, -ECANCELED, done);
+        return;
+    }
+    if(res == -ENOBUFS && op->type == IO_RECV)
+    {
+        op->stage = kStagePlainRecv;
+        PrepareOp(op);
+        return;
+    }
+    //非阻塞的fd(例如CGI的管道)暂时不能读写,等就绪之后重新提交
+    if(res == -EAGAIN)
+    {
+        PreparePoll(op, IsReadOp(op->type) ? POLLIN : POLLOUT);
+        return;
+    }
+    Finish(op, res, done);
+}
+
+void UringPoller::HandleAccept(Acceptor* acceptor, int res, uint32_t flags, std::vector<IoOp*>* done)
+{
+    if(!(flags & IORING_CQE_F_MORE))
+    {
+        acceptor->armed = false;
+    }
+    if(res == -EINVAL && multishot_accept_)
+    {
+        //内核不支持multishot accept(5.19之前),退回到每次accept提交一次
+        multishot_accept_ = false;
+    }
+    else if(res != -ECANCELED)
+    {
+        if(acceptor->waiter != NULL)
+        {
+            IoOp* op = acceptor->waiter;
+            acceptor->waiter = NULL;
+            DeliverAccept(op, res);
+            done->push_back(op);
+        }
+        else
+        {
+            acceptor->ready.push_back(res);
+        }
+    }
+    //出错(例如EMFILE)之后multishot会结束,有人在等的话重新提交
+    if(!acceptor->armed && acceptor->waiter != NULL)
+    {
+        ArmAccept(acceptor);
+    }
+}
+
+void UringPoller::HandleSplice(IoOp* op, int res, std::vector<IoOp*>* done)
+{
+    SpliceState* state = static_cast<SpliceState*>(op->backend);
+    if(op->stage == kStageSpliceIn)
+    {
+        if(res <= 0 || op->timed_out)
+        {
+            //管道中没有数据,可以继续复用
+            ReleaseSplice(op, res <= 0);
+            Finish(op, res <= 0 ? res : -ECANCELED, done);
+            return;
+        }
+        state->piped = res;
+        state->drained = 0;
+        op->stage = kStageSpliceOut;
+        PrepareSplice(op);
+        return;
+    }
+    if(res == -EAGAIN && !op->timed_out)
+    {
+        state->resume = kStageSpliceOut;
+        PreparePoll(op, POLLOUT);
+        return;
+    }
+    if(res <= 0)
+    {
+        Finish(op, res == 0 ? -EPIPE : res, done);
+        return;
+    }
+    state->drained += res;
+    if(state->drained < state->piped)
+    {
+        if(op->timed_out)
+        {
+            Finish(op, -ECANCELED, done);
+            return;
+        }
+        PrepareSplice(op);
+        return;
+    }
+    size_t sent = state->piped;
+    ReleaseSplice(op, true);
+    Finish(op, (int)sent, done);
+}
+
+void UringPoller::Finish(IoOp* op, int res, std::vector<IoOp*>* done)
+{
+    if(op->backend != NULL)
+    {
+        //管道中可能还留着没有发出去的数据,不能再复用
+        ReleaseSplice(op, false);
+    }
+    op->result = res;
+    done->push_back(op);
+}
+
+void UringPoller::PrepareOp(IoOp* op)
+{
+    struct io_uring_sqe* sqe = GetSqe();
+    sqe->user_data = (uint64_t)(uintptr_t)op;
+    sqe->fd = op->fd;
+    switch(op->type)
+    {
+    case IO_RECV:
+        sqe->opcode = IORING_OP_RECV;
+        if(buf_ring_ != NULL && op->stage == kStageIo)
+        {
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = kBufGroup;
+            sqe->len = std::min(op->len, kBufSize);
+        }
+        else
+        {
+            sqe->addr = (uint64_t)(uintptr_t)op->buf;
+            sqe->len = op->len;
+        }
+        break;
+    case IO_SEND:
+        memset(&op->msg, 0, sizeof(op->msg));
+        op->msg.msg_iov = const_cast<struct iovec*>(op->iov);
+        op->msg.msg_iovlen = op->iovcnt;
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->addr = (uint64_t)(uintptr_t)&op->msg;
+        sqe->len = 1;
+        //对端已经关闭时返回EPIPE,不要产生SIGPIPE
+        sqe->msg_flags = MSG_NOSIGNAL;
+        break;
+    case IO_READ:
+        sqe->opcode = IORING_OP_READ;
+        sqe->addr = (uint64_t)(uintptr_t)op->buf;
+        sqe->len = op->len;
+        sqe->off = (uint64_t)-1;
+        break;
+    case IO_WRITE:
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->addr = (uint64_t)(uintptr_t)op->iov;
+        sqe->len = op->iovcnt;
+        sqe->off = (uint64_t)-1;
+        break;
+    case IO_POLL_IN:
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->poll32_events = POLLIN;
+        break;
+    case IO_OPENAT:
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uint64_t)(uintptr_t)op->path;
+        sqe->open_flags = op->flags;
+        break;
+    case IO_STATX:
+        sqe->opcode = IORING_OP_STATX;
+        sqe->addr = (uint64_t)(uintptr_t)op->path;
+        sqe->len = STATX_BASIC_STATS;
+        sqe->off = (uint64_t)(uintptr_t)op->buf;
+        sqe->statx_flags = op->flags;
+        break;
+    default:
+        sqe->opcode = IORING_OP_NOP;
+        break;
+    }
+}
+
+void UringPoller::PreparePoll(IoOp* op, uint32_t events)
+{
+    struct io_uring_sqe* sqe = GetSqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = op->fd;
+    sqe->poll32_events = events;
+    sqe->user_data = (uint64_t)(uintptr_t)op;
+    op->stage = kStagePoll;
+}
+
+void UringPoller::PrepareSplice(IoOp* op)
+{
+    SpliceState* state = static_cast<SpliceState*>(op->backend);
+    struct io_uring_sqe* sqe = GetSqe();
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->user_data = (uint64_t)(uintptr_t)op;
+    //管道一端没有偏移量,用-1表示
+    sqe->off = (uint64_t)-1;
+    if(op->stage == kStageSpliceIn)
+    {
+        sqe->fd = state->pipe_fds[1];
+        sqe->splice_fd_in = op->in_fd;
+        sqe->splice_off_in = op->offset;
+        sqe->len = std::min(op->len, kPipeSize);
+    }
+    else
+    {
+        sqe->fd = op->fd;
+        sqe->splice_fd_in = state->pipe_fds[0];
+        sqe->splice_off_in = (uint64_t)-1;
+        sqe->len = state->piped - state->drained;
+    }
+}
+
+void UringPoller::ArmAccept(Acceptor* acceptor)
+{
+    struct io_uring_sqe* sqe = GetSqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = acceptor->fd;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    if(multishot_accept_)
+    {
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    }
+    sqe->user_data = (uint64_t)(uintptr_t)acceptor | kTagAccept;
+    acceptor->armed = true;
+}
+
+void UringPoller::ArmWakeup()
+{
+    struct io_uring_sqe* sqe = GetSqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = wakeup_fd_;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = kTagWakeup;
+}
+
+// multishot accept没有办法为每个连接分别返回对端地址,通过getpeername获取
+void UringPoller::DeliverAccept(IoOp* op, int fd)
+{
+    op->result = fd;
+    if(fd >= 0 && op->addr != NULL)
+    {
+        socklen_t len = sizeof(*op->addr);
+        if(getpeername(fd, (struct sockaddr*)op->addr, &len) < 0)
+        {
+            memset(op->addr, 0, sizeof(*op->addr));
+        }
+    }
+}
+
+UringPoller::Acceptor* UringPoller::GetAcceptor(int fd)
+{
+    for(size_t i = 0; i < acceptors_.size(); i++)
+    {
+        if(acceptors_[i]->fd == fd)
+        {
+            return acceptors_[i].get();
+        }
+    }
+    Acceptor* acceptor = new Acceptor();
+    acceptor->fd = fd;
+    acceptors_.push_back(std::unique_ptr<Acceptor>(acceptor));
+    return acceptor;
+}
+
+int UringPoller::TakePipe(int pipe_fds[2])
+{
+    if(!free_pipes_.empty())
+    {
+        pipe_fds[1] = free_pipes_.back();
+        free_pipes_.pop_back();
+        pipe_fds[0] = free_pipes_.back();
+        free_pipes_.pop_back();
+        return 0;
+    }
+    return pipe2(pipe_fds, O_CLOEXEC);
+}
+
+void UringPoller::ReleaseSplice(IoOp* op, bool clean)
+{
+    SpliceState* state = static_cast<SpliceState*>(op->backend);
+    if(clean && free_pipes_.size() < kMaxFreePipes * 2)
+    {
+        free_pipes_.push_back(state->pipe_fds[0]);
+        free_pipes_.push_back(state->pipe_fds[1]);
+    }
+    else
+    {
+        close(state->pipe_fds[0]);
+        close(state->pipe_fds[1]);
+    }
+    delete state;
+    op->backend = NULL;
+}
+
+void UringPoller::Wakeup()
+{
+    uint64_t value = 1;
+    ssize_t ret = write(wakeup_fd_, &value, sizeof(value));
+    (void)ret;
+}
+
+// 操作都记录在IoOp中,fd本身没有额外的状态
+void UringPoller::Forget(int fd)
+{
+    (void)fd;
+}
+}
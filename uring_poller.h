@@ -0,0 +1,116 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <deque>
+#include <memory>
+#include <vector>
+#include <linux/io_uring.h>
+#include "event_loop.h"
+
+namespace http_server{
+
+// 基于io_uring的后端,直接使用系统调用,不依赖liburing
+// 1.每个事件循环一个ring,协程提交的操作先放到提交队列中,
+//   事件循环每一轮只调用一次io_uring_enter,同时完成提交和等待
+// 2.监听socket上使用multishot accept,一次提交持续返回新连接,来不及处理的连接先排队
+// 3.recv使用注册的缓冲区环(provided buffer ring),数据到达之后内核才挑选缓冲区,
+//   空闲的连接不占用内核中的读缓冲区;缓冲区用完时退回到直接读到调用者的缓冲区
+// 4.静态文件的openat/statx也通过ring完成
+// 5.sendfile用两次splice实现:文件->管道->socket,管道在操作之间复用
+// 非阻塞的fd返回EAGAIN时,先通过POLL_ADD等待就绪再重新提交
+// 内核不支持需要的操作(或者io_uring被禁用)时Init返回-1,由事件循环退回到epoll
+class UringPoller : public Poller{
+public:
+    UringPoller();
+    virtual ~UringPoller();
+
+    int Init();
+
+    virtual const char* Name() const
+    {
+        return "io_uring";
+    }
+
+    virtual bool Submit(IoOp* op);
+    virtual bool Cancel(IoOp* op);
+    virtual int Wait(int timeout_ms, std::vector<IoOp*>* done);
+    virtual void Wakeup();
+    virtual void Forget(int fd);
+
+private:
+    UringPoller(const UringPoller&);
+    UringPoller& operator=(const UringPoller&);
+
+    // 一个监听socket上的multishot accept
+    struct Acceptor{
+        Acceptor() :fd(-1), armed(false), waiter(NULL) {}
+        int fd;
+        bool armed;              //multishot accept还在内核中
+        std::deque<int> ready;   //已经accept但是还没有被取走的连接(或者错误码)
+        IoOp* waiter;
+    };
+
+    // 一次sendfile使用的管道和进度
+    struct SpliceState{
+        int pipe_fds[2];
+        size_t piped;    //已经从文件读到管道中的字节数
+        size_t drained;  //已经从管道写到socket的字节数
+        int resume;      //等待socket可写之后继续的阶段
+    };
+
+    int SetupRing();
+    int SetupBufferRing();
+    struct io_uring_sqe* GetSqe();
+    int Enter(unsigned to_submit, int timeout_ms);
+    void Reap(std::vector<IoOp*>* done);
+    void HandleCqe(uint64_t user_data, int res, uint32_t flags, std::vector<IoOp*>* done);
+    void HandleOp(IoOp* op, int res, uint32_t flags, std::vector<IoOp*>* done);
+    void HandleAccept(Acceptor* acceptor, int res, uint32_t flags, std::vector<IoOp*>* done);
+    void HandleSplice(IoOp* op, int res, std::vector<IoOp*>* done);
+    void Finish(IoOp* op, int res, std::vector<IoOp*>* done);
+
+    void PrepareOp(IoOp* op);
+    void PreparePoll(IoOp* op, uint32_t events);
+    void PrepareSplice(IoOp* op);
+    void ArmAccept(Acceptor* acceptor);
+    void ArmWakeup();
+    void DeliverAccept(IoOp* op, int fd);
+    Acceptor* GetAcceptor(int fd);
+    void RecycleBuffer(uint16_t bid);
+    int TakePipe(int pipe_fds[2]);
+    void ReleaseSplice(IoOp* op, bool clean);
+
+    int ring_fd_;
+    //提交队列和完成队列,mmap自内核
+    void* sq_ptr_;
+    size_t sq_size_;
+    void* cq_ptr_;
+    size_t cq_size_;
+    struct io_uring_sqe* sqes_;
+    size_t sqes_size_;
+    unsigned* sq_head_;
+    unsigned* sq_tail_;
+    unsigned* sq_flags_;
+    unsigned* sq_array_;
+    unsigned sq_mask_;
+    unsigned sq_entries_;
+    unsigned sq_local_tail_;  //已经填好但是还没有告诉内核的提交
+    unsigned* cq_head_;
+    unsigned* cq_tail_;
+    unsigned cq_mask_;
+    struct io_uring_cqe* cqes_;
+
+    //recv使用的缓冲区环
+    struct io_uring_buf_ring* buf_ring_;
+    size_t buf_ring_size_;
+    char* bufs_;
+    uint16_t buf_tail_;
+
+    int wakeup_fd_;
+    uint64_t wakeup_value_;
+    std::vector<std::unique_ptr<Acceptor> > acceptors_;
+    bool multishot_accept_;
+    std::vector<int> free_pipes_;  //成对存放读端和写端
+    std::vector<IoOp*> deferred_;  //提交时顺便收到的完成事件
+};
+}
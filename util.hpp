@@ -3,11 +3,16 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <ctype.h>
 #include <vector>
 #include <sys/time.h>
+#include <time.h>
 #include <unordered_map>
 #include <fstream>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/uio.h>
 // boost库
 // #include <boost/algorithm/string.hpp>
 // #include <boost/filesystem.hpp>
@@ -28,6 +33,12 @@ public:
         gettimeofday(&tv, NULL);
         return 1000*1000*tv.tv_sec + tv.tv_usec;
     }
+    //获取单调时钟的毫秒数,不受系统时间调整的影响,用于计算超时
+    static int64_t MonotonicMS(){
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
 };
 
 //枚举日志级别
@@ -142,39 +153,110 @@ public:
         return 0;
    }
 
-   static bool IsDir(const std::string& file_path)
-   {
-      struct stat buf; 
-      int ret = stat(file_path.c_str(), &buf); 
-      if( (buf.st_mode&__S_IFMT) == __S_IFDIR )
-      {
-        return true;
-      }
-      return false;
-   }
-
    //从文件中读取全部内容到std::string中
+   //用fstat拿到文件大小后一次read读完,避免ifstream反复lseek带来的系统调用
    static int ReadAll(const std::string& file_path, std::string* output)
    {
-        std::ifstream file(file_path.c_str());
-        if(!file.is_open())
+        int fd = open(file_path.c_str(), O_RDONLY);
+        if(fd < 0)
         {
             LOG(ERROR) << "Open file error! file_path=" << file_path<<"\n";
             return -1;
         }
-        //seekg调整文件指针的位置，此处是将文件指针调整到文件末尾
-        file.seekg(0, file.end);
-        //查询当前文件指针的位置，返回值就是文件指针位置相对于文件
-        //起始位置的偏移量
-        int length = file.tellg();
-        //为了从头读取文件，需要把文件指针设置到开头位置
-        file.seekg(0, file.beg);
-        //读取完整的文件内容
-        output->resize(length);
-        file.read(const_cast<char*>(output->c_str()), length);
-        //万一忘记写close，问题不大，
-        //因为ifstream会在析构的时候自动关闭文件描述符
-        file.close();
+        struct stat st;
+        if(fstat(fd, &st) < 0)
+        {
+            close(fd);
+            return -1;
+        }
+        output->resize(st.st_size);
+        size_t offset = 0;
+        while(offset < output->size())
+        {
+            ssize_t read_size = read(fd, &(*output)[offset], output->size() - offset);
+            if(read_size < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if(read_size <= 0)
+            {
+                break;
+            }
+            offset += read_size;
+        }
+        output->resize(offset);
+        close(fd);
+        return 0;
+   }
+
+   //根据文件的扩展名得到Content-Type,不认识的类型按二进制数据处理
+   static std::string GetMimeType(const std::string& file_path)
+   {
+        static const char* kMimeTypes[][2] = {
+            {"html", "text/html; charset=utf-8"},
+            {"htm",  "text/html; charset=utf-8"},
+            {"css",  "text/css; charset=utf-8"},
+            {"js",   "application/javascript; charset=utf-8"},
+            {"json", "application/json"},
+            {"txt",  "text/plain; charset=utf-8"},
+            {"xml",  "text/xml"},
+            {"svg",  "image/svg+xml"},
+            {"png",  "image/png"},
+            {"jpg",  "image/jpeg"},
+            {"jpeg", "image/jpeg"},
+            {"gif",  "image/gif"},
+            {"ico",  "image/x-icon"},
+            {"mp3",  "audio/mpeg"},
+            {"wav",  "audio/wav"},
+        };
+        size_t pos = file_path.rfind('.');
+        size_t slash = file_path.rfind('/');
+        if(pos != std::string::npos && (slash == std::string::npos || pos > slash))
+        {
+            std::string ext = file_path.substr(pos + 1);
+            for(size_t i = 0; i < ext.size(); i++)
+            {
+                ext[i] = tolower(ext[i]);
+            }
+            for(size_t i = 0; i < sizeof(kMimeTypes) / sizeof(kMimeTypes[0]); i++)
+            {
+                if(ext == kMimeTypes[i][0])
+                {
+                    return kMimeTypes[i][1];
+                }
+            }
+        }
+        return "application/octet-stream";
+   }
+
+   //把iov中的所有数据写到fd中,处理write只写了一部分的情况
+   static int WriteV(int fd, struct iovec* iov, int iov_cnt)
+   {
+        while(iov_cnt > 0)
+        {
+            ssize_t write_size = writev(fd, iov, iov_cnt);
+            if(write_size < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if(write_size < 0)
+            {
+                perror("writev");
+                return -1;
+            }
+            //跳过已经写完的部分
+            while(iov_cnt > 0 && (size_t)write_size >= iov->iov_len)
+            {
+                write_size -= iov->iov_len;
+                ++iov;
+                --iov_cnt;
+            }
+            if(iov_cnt > 0)
+            {
+                iov->iov_base = (char*)iov->iov_base + write_size;
+                iov->iov_len -= write_size;
+            }
+        }
         return 0;
    }
 };
@@ -187,21 +269,21 @@ public:
     static int Split(const std::string& input, const std::string& split_char, std::vector<std::string>* output)
     {
         // boost::split(*output,input,boost::is_any_of(split_char),boost::token_compress_on);
-        char buf[1024];
-        strcpy(buf, input.c_str());
-        int i = 0;
-        //字符串分割函数
-        char* tmp = strtok(buf, split_char.c_str());
-        if(tmp != NULL)
-          output->push_back(tmp);
-        while(1)
+        // 不使用strtok:它依赖全局状态,多个线程同时切分会互相破坏,而且需要把input拷贝到定长的缓冲区中
+        size_t start = 0;
+        while(start < input.size())
         {
-          tmp = strtok(NULL, split_char.c_str());
-          if(tmp == NULL)
-          {
-            break;
-          }
-          output->push_back(tmp);
+            size_t end = input.find_first_of(split_char, start);
+            if(end == std::string::npos)
+            {
+                end = input.size();
+            }
+            //连续的分隔符当成一个处理
+            if(end > start)
+            {
+                output->push_back(input.substr(start, end - start));
+            }
+            start = end + 1;
         }
         return 0;
     }